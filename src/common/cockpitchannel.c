@@ -72,6 +72,7 @@
 #define  CHANNEL_FLOW_WINDOW       (2L * 1024L * 1024L)
 
 typedef struct {
+    gboolean registered;
     gulong recv_sig;
     gulong close_sig;
     gulong control_sig;
@@ -422,10 +423,17 @@ cockpit_channel_constructed (GObject *object)
   g_return_if_fail (priv->transport != NULL);
 
   priv->capabilities = NULL;
-  priv->recv_sig = g_signal_connect (priv->transport, "recv",
-                                           G_CALLBACK (on_transport_recv), self);
-  priv->control_sig = g_signal_connect (priv->transport, "control",
-                                              G_CALLBACK (on_transport_control), self);
+
+  /* Have our messages routed straight to us, unless the id is taken */
+  priv->registered = cockpit_transport_register_channel (priv->transport, priv->id,
+                                                         on_transport_recv, on_transport_control, self);
+  if (!priv->registered)
+    {
+      priv->recv_sig = g_signal_connect (priv->transport, "recv",
+                                         G_CALLBACK (on_transport_recv), self);
+      priv->control_sig = g_signal_connect (priv->transport, "control",
+                                            G_CALLBACK (on_transport_control), self);
+    }
   priv->close_sig = g_signal_connect (priv->transport, "closed",
                                             G_CALLBACK (on_transport_closed), self);
 
@@ -603,6 +611,10 @@ cockpit_channel_dispose (GObject *object)
       priv->prepare_tag = 0;
     }
 
+  if (priv->registered)
+    cockpit_transport_unregister_channel (priv->transport, priv->id, self);
+  priv->registered = FALSE;
+
   if (priv->recv_sig)
     g_signal_handler_disconnect (priv->transport, priv->recv_sig);
   priv->recv_sig = 0;
@@ -791,6 +803,10 @@ cockpit_channel_close (CockpitChannel *self,
   g_return_if_fail (COCKPIT_IS_CHANNEL (self));
 
   /* No further messages should be received */
+  if (priv->registered)
+    cockpit_transport_unregister_channel (priv->transport, priv->id, self);
+  priv->registered = FALSE;
+
   if (priv->recv_sig)
     g_signal_handler_disconnect (priv->transport, priv->recv_sig);
   priv->recv_sig = 0;
@@ -0,0 +1,282 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The binary header of version 2 of the PROXY protocol, see
+ * https://www.haproxy.org/download/2.4/doc/proxy-protocol.txt
+ *
+ * cockpit-tls can send this to cockpit-ws in front of the client data,
+ * instead of passing a metadata memfd along with it.  The client
+ * certificate file and the IPv6 scope of the origin address go into
+ * TLVs of our own.  HAProxy can send the same header.
+ */
+
+#include "config.h"
+
+#include "cockpitproxyheader.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static const unsigned char signature[12] = "\r\n\r\n\0\r\nQUIT\n";
+
+#define VERSION_2     0x20
+#define COMMAND_LOCAL 0x00
+#define COMMAND_PROXY 0x01
+
+#define FAMILY_UNSPEC     0x00
+#define FAMILY_TCP_INET   0x11
+#define FAMILY_TCP_INET6  0x21
+
+#define ADDRESSES_INET_SIZE  12
+#define ADDRESSES_INET6_SIZE 36
+#define ADDRESSES_UNIX_SIZE  216
+
+static unsigned char *
+put_uint16 (unsigned char *p,
+            uint16_t       value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+  return p + 2;
+}
+
+static uint16_t
+get_uint16 (const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static unsigned char *
+put_tlv (unsigned char *p,
+         unsigned char  type,
+         const void    *value,
+         uint16_t       length)
+{
+  *p++ = type;
+  p = put_uint16 (p, length);
+  memcpy (p, value, length);
+  return p + length;
+}
+
+/**
+ * cockpit_proxy_header_build: Format a PROXY protocol v2 header
+ *
+ * @buffer: Where to write the header
+ * @size: The size of @buffer
+ * @source: The address of the client
+ * @destination: The address which the client connected to; must be of
+ *               the same family as @source
+ * @client_certificate: The name of the client certificate file, or %NULL
+ *
+ * Addresses other than IPv4 and IPv6 ones are sent as "unspecified".
+ * Nothing gets written if @buffer is too small.
+ *
+ * Returns: the size of the header, like snprintf()
+ */
+size_t
+cockpit_proxy_header_build (unsigned char         *buffer,
+                            size_t                 size,
+                            const struct sockaddr *source,
+                            const struct sockaddr *destination,
+                            const char            *client_certificate)
+{
+  size_t cert_len = client_certificate ? strlen (client_certificate) : 0;
+  size_t length = COCKPIT_PROXY_HEADER_FIXED_SIZE;
+  unsigned char family = FAMILY_UNSPEC;
+  uint32_t scope_id = 0;
+
+  assert (source->sa_family == destination->sa_family);
+  assert (cert_len <= UINT16_MAX);
+
+  if (source->sa_family == AF_INET)
+    {
+      family = FAMILY_TCP_INET;
+      length += ADDRESSES_INET_SIZE;
+    }
+  else if (source->sa_family == AF_INET6)
+    {
+      family = FAMILY_TCP_INET6;
+      length += ADDRESSES_INET6_SIZE;
+
+      scope_id = ((const struct sockaddr_in6 *) source)->sin6_scope_id;
+      if (scope_id)
+        length += 3 + sizeof scope_id;
+    }
+
+  if (client_certificate)
+    length += 3 + cert_len;
+
+  if (length > size)
+    return length;
+
+  unsigned char *p = buffer;
+
+  memcpy (p, signature, sizeof signature);
+  p += sizeof signature;
+  *p++ = VERSION_2 | COMMAND_PROXY;
+  *p++ = family;
+  p = put_uint16 (p, length - COCKPIT_PROXY_HEADER_FIXED_SIZE);
+
+  /* addresses and ports are already in network byte order */
+  if (family == FAMILY_TCP_INET)
+    {
+      const struct sockaddr_in *src = (const struct sockaddr_in *) source;
+      const struct sockaddr_in *dst = (const struct sockaddr_in *) destination;
+
+      memcpy (p, &src->sin_addr, 4); p += 4;
+      memcpy (p, &dst->sin_addr, 4); p += 4;
+      memcpy (p, &src->sin_port, 2); p += 2;
+      memcpy (p, &dst->sin_port, 2); p += 2;
+    }
+  else if (family == FAMILY_TCP_INET6)
+    {
+      const struct sockaddr_in6 *src = (const struct sockaddr_in6 *) source;
+      const struct sockaddr_in6 *dst = (const struct sockaddr_in6 *) destination;
+
+      memcpy (p, &src->sin6_addr, 16); p += 16;
+      memcpy (p, &dst->sin6_addr, 16); p += 16;
+      memcpy (p, &src->sin6_port, 2); p += 2;
+      memcpy (p, &dst->sin6_port, 2); p += 2;
+
+      if (scope_id)
+        {
+          uint32_t value = htonl (scope_id);
+          p = put_tlv (p, COCKPIT_PROXY_TLV_SCOPE_ID, &value, sizeof value);
+        }
+    }
+
+  if (client_certificate)
+    p = put_tlv (p, COCKPIT_PROXY_TLV_CLIENT_CERTIFICATE, client_certificate, cert_len);
+
+  assert (p == buffer + length);
+  return length;
+}
+
+/**
+ * cockpit_proxy_header_parse: Parse a PROXY protocol v2 header
+ *
+ * @data: The start of the stream
+ * @length: How much of it there is so far
+ * @header: Where to store the result
+ *
+ * Unknown TLVs are ignored, so that this also accepts headers from
+ * HAProxy.  The data after the header belongs to the actual protocol.
+ *
+ * Returns: the size of the header, 0 if we need more data to tell,
+ * or -1 if @data does not start with a valid header.
+ */
+ssize_t
+cockpit_proxy_header_parse (const unsigned char *data,
+                            size_t               length,
+                            CockpitProxyHeader  *header)
+{
+  if (memcmp (data, signature, length < sizeof signature ? length : sizeof signature) != 0)
+    return -1;
+
+  if (length < COCKPIT_PROXY_HEADER_FIXED_SIZE)
+    return 0;
+
+  unsigned char version = data[12] & 0xf0;
+  unsigned char command = data[12] & 0x0f;
+  unsigned char family = data[13];
+  size_t size = COCKPIT_PROXY_HEADER_FIXED_SIZE + get_uint16 (data + 14);
+
+  if (version != VERSION_2 || (command != COMMAND_LOCAL && command != COMMAND_PROXY))
+    return -1;
+
+  if (length < size)
+    return 0;
+
+  memset (header, 0, sizeof *header);
+
+  const unsigned char *p = data + COCKPIT_PROXY_HEADER_FIXED_SIZE;
+  const unsigned char *end = data + size;
+  const unsigned char *port = NULL;
+  struct in6_addr in6_addr;
+  uint32_t scope_id = 0;
+
+  /* the size of the address block depends only on the address family */
+  static const size_t address_sizes[] = { 0, ADDRESSES_INET_SIZE, ADDRESSES_INET6_SIZE, ADDRESSES_UNIX_SIZE };
+  if ((family >> 4) >= sizeof address_sizes / sizeof address_sizes[0] || end - p < address_sizes[family >> 4])
+    return -1;
+
+  /* for LOCAL, and for anything but TCP over IP, ignore the addresses */
+  if (command == COMMAND_PROXY && family == FAMILY_TCP_INET)
+    {
+      const char *r = inet_ntop (AF_INET, p, header->origin_ip, sizeof header->origin_ip);
+      assert (r != NULL);
+      port = p + 8;
+    }
+  else if (command == COMMAND_PROXY && family == FAMILY_TCP_INET6)
+    {
+      memcpy (&in6_addr, p, sizeof in6_addr);
+      port = p + 32;
+    }
+
+  p += address_sizes[family >> 4];
+
+  if (port)
+    header->origin_port = get_uint16 (port);
+
+  while (p < end)
+    {
+      if (end - p < 3 || end - p - 3 < get_uint16 (p + 1))
+        return -1;
+
+      unsigned char type = p[0];
+      uint16_t tlv_length = get_uint16 (p + 1);
+      const unsigned char *value = p + 3;
+
+      if (type == COCKPIT_PROXY_TLV_SCOPE_ID && tlv_length == sizeof scope_id)
+        scope_id = ((uint32_t) get_uint16 (value) << 16) | get_uint16 (value + 2);
+      else if (type == COCKPIT_PROXY_TLV_CLIENT_CERTIFICATE)
+        {
+          header->client_certificate = (const char *) value;
+          header->client_certificate_len = tlv_length;
+        }
+
+      p = value + tlv_length;
+    }
+
+  if (port && family == FAMILY_TCP_INET6)
+    {
+      const char *r = inet_ntop (AF_INET6, &in6_addr, header->origin_ip, sizeof header->origin_ip);
+      assert (r != NULL);
+
+      if (scope_id)
+        {
+          size_t iplen = strlen (header->origin_ip);
+          header->origin_ip[iplen++] = '%';
+
+          /* same format as the "origin-ip" of the JSON metadata */
+          if (!if_indextoname (scope_id, header->origin_ip + iplen))
+            {
+              int r = snprintf (header->origin_ip + iplen, IF_NAMESIZE, "%u", scope_id);
+              assert (r < IF_NAMESIZE);
+            }
+        }
+    }
+
+  return size;
+}
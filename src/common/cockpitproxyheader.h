@@ -0,0 +1,55 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* signature, version/command, address family, length */
+#define COCKPIT_PROXY_HEADER_FIXED_SIZE 16
+
+/* PROXY protocol v2 TLV types in the range reserved for applications */
+#define COCKPIT_PROXY_TLV_SCOPE_ID           0xe0
+#define COCKPIT_PROXY_TLV_CLIENT_CERTIFICATE 0xe1
+
+typedef struct {
+  /* empty if the sender did not tell us (LOCAL command, non-IP transport) */
+  char origin_ip[INET6_ADDRSTRLEN + 1 + IF_NAMESIZE + 1];
+  unsigned origin_port;
+
+  /* points into the parsed data, not nul-terminated; NULL if absent */
+  const char *client_certificate;
+  size_t client_certificate_len;
+} CockpitProxyHeader;
+
+size_t
+cockpit_proxy_header_build (unsigned char         *buffer,
+                            size_t                 size,
+                            const struct sockaddr *source,
+                            const struct sockaddr *destination,
+                            const char            *client_certificate);
+
+ssize_t
+cockpit_proxy_header_parse (const unsigned char *data,
+                            size_t               length,
+                            CockpitProxyHeader  *header);
@@ -52,9 +52,18 @@ enum {
 
 static guint signals[NUM_SIGNALS];
 
+typedef struct {
+    CockpitTransportRecvFunc recv;
+    CockpitTransportControlFunc control;
+    gpointer user_data;
+} RegisteredChannel;
+
 typedef struct {
   GHashTable *freeze;
   GQueue *frozen;
+
+  /* Channel id to RegisteredChannel, routed before the signals */
+  GHashTable *channels;
 } CockpitTransportPrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (CockpitTransport, cockpit_transport, G_TYPE_OBJECT,
@@ -105,6 +114,17 @@ maybe_freeze_message (CockpitTransport *self,
   return FALSE;
 }
 
+static RegisteredChannel *
+lookup_registered (CockpitTransport *self,
+                   const gchar *channel)
+{
+  CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
+
+  if (!priv->channels || !channel)
+    return NULL;
+  return g_hash_table_lookup (priv->channels, channel);
+}
+
 static gboolean
 cockpit_transport_default_recv (CockpitTransport *transport,
                                 const gchar *channel,
@@ -173,6 +193,8 @@ cockpit_transport_finalize (GObject *object)
     g_hash_table_destroy (priv->freeze);
   if (priv->frozen)
     g_queue_free_full (priv->frozen, frozen_message_free);
+  if (priv->channels)
+    g_hash_table_destroy (priv->channels);
 
   G_OBJECT_CLASS (cockpit_transport_parent_class)->finalize (object);
 }
@@ -243,6 +265,7 @@ cockpit_transport_emit_recv (CockpitTransport *transport,
                              const gchar *channel,
                              GBytes *data)
 {
+  RegisteredChannel *registered;
   gboolean result = FALSE;
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
@@ -250,7 +273,12 @@ cockpit_transport_emit_recv (CockpitTransport *transport,
   if (maybe_freeze_message (transport, channel, NULL, data))
     return;
 
-  g_signal_emit (transport, signals[RECV], 0, channel, data, &result);
+  registered = lookup_registered (transport, channel);
+  if (registered && registered->recv)
+    result = (registered->recv) (transport, channel, data, registered->user_data);
+
+  if (!result)
+    g_signal_emit (transport, signals[RECV], 0, channel, data, &result);
 
   if (!result)
     g_debug ("no handler for received message in channel %s", channel);
@@ -263,6 +291,7 @@ cockpit_transport_emit_control (CockpitTransport *transport,
                                 JsonObject *options,
                                 GBytes *data)
 {
+  RegisteredChannel *registered;
   gboolean result = FALSE;
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
@@ -270,7 +299,12 @@ cockpit_transport_emit_control (CockpitTransport *transport,
   if (maybe_freeze_message (transport, channel, options, data))
     return;
 
-  g_signal_emit (transport, signals[CONTROL], 0, command, channel, options, data, &result);
+  registered = lookup_registered (transport, channel);
+  if (registered && registered->control)
+    result = (registered->control) (transport, command, channel, options, data, registered->user_data);
+
+  if (!result)
+    g_signal_emit (transport, signals[CONTROL], 0, command, channel, options, data, &result);
 
   if (!result)
     g_debug ("received unknown control command: %s", command);
@@ -284,6 +318,77 @@ cockpit_transport_emit_closed (CockpitTransport *transport,
   g_signal_emit (transport, signals[CLOSED], 0, problem);
 }
 
+/**
+ * cockpit_transport_register_channel:
+ * @transport: the transport
+ * @channel: the channel id
+ * @recv_func: (allow-none): called for messages in the channel
+ * @control_func: (allow-none): called for control messages about the channel
+ * @user_data: passed to the functions
+ *
+ * Route the messages for @channel straight to the given functions, with
+ * one lookup, rather than offering them to each "recv" and "control"
+ * signal handler in turn. The functions have the same signature as those
+ * signal handlers, and if they return %FALSE the signals are emitted as
+ * usual.
+ *
+ * Only one listener can be registered for a channel, like only the first
+ * signal handler to claim a message sees it.
+ *
+ * Returns: %FALSE if another listener is already registered for @channel
+ */
+gboolean
+cockpit_transport_register_channel (CockpitTransport *self,
+                                    const gchar *channel,
+                                    CockpitTransportRecvFunc recv_func,
+                                    CockpitTransportControlFunc control_func,
+                                    gpointer user_data)
+{
+  CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
+  RegisteredChannel *registered;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (self), FALSE);
+  g_return_val_if_fail (channel != NULL, FALSE);
+
+  if (!priv->channels)
+    priv->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  else if (g_hash_table_contains (priv->channels, channel))
+    return FALSE;
+
+  registered = g_new0 (RegisteredChannel, 1);
+  registered->recv = recv_func;
+  registered->control = control_func;
+  registered->user_data = user_data;
+  g_hash_table_insert (priv->channels, g_strdup (channel), registered);
+  return TRUE;
+}
+
+/**
+ * cockpit_transport_unregister_channel:
+ * @transport: the transport
+ * @channel: the channel id
+ * @user_data: what the listener was registered with
+ *
+ * Stop routing the messages for @channel to the listener registered
+ * with cockpit_transport_register_channel(). Nothing happens if another
+ * listener is registered for @channel now.
+ */
+void
+cockpit_transport_unregister_channel (CockpitTransport *self,
+                                      const gchar *channel,
+                                      gpointer user_data)
+{
+  CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
+  RegisteredChannel *registered;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (self));
+  g_return_if_fail (channel != NULL);
+
+  registered = lookup_registered (self, channel);
+  if (registered && registered->user_data == user_data)
+    g_hash_table_remove (priv->channels, channel);
+}
+
 void
 cockpit_transport_freeze (CockpitTransport *self,
                           const gchar *channel)
@@ -28,6 +28,18 @@ G_BEGIN_DECLS
 #define COCKPIT_TYPE_TRANSPORT            (cockpit_transport_get_type ())
 G_DECLARE_DERIVABLE_TYPE(CockpitTransport, cockpit_transport, COCKPIT, TRANSPORT, GObject)
 
+typedef gboolean (* CockpitTransportRecvFunc)     (CockpitTransport *transport,
+                                                   const gchar *channel,
+                                                   GBytes *data,
+                                                   gpointer user_data);
+
+typedef gboolean (* CockpitTransportControlFunc)  (CockpitTransport *transport,
+                                                   const gchar *command,
+                                                   const gchar *channel,
+                                                   JsonObject *options,
+                                                   GBytes *payload,
+                                                   gpointer user_data);
+
 struct _CockpitTransportClass
 {
   GObjectClass parent_class;
@@ -83,6 +95,16 @@ void        cockpit_transport_emit_control   (CockpitTransport *transport,
 void        cockpit_transport_emit_closed    (CockpitTransport *transport,
                                               const gchar *problem);
 
+gboolean    cockpit_transport_register_channel   (CockpitTransport *transport,
+                                                  const gchar *channel,
+                                                  CockpitTransportRecvFunc recv_func,
+                                                  CockpitTransportControlFunc control_func,
+                                                  gpointer user_data);
+
+void        cockpit_transport_unregister_channel (CockpitTransport *transport,
+                                                  const gchar *channel,
+                                                  gpointer user_data);
+
 void        cockpit_transport_freeze         (CockpitTransport *transport,
                                               const gchar *channel);
 
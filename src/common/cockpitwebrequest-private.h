@@ -12,6 +12,7 @@ struct _CockpitWebRequest {
   GSource *source;
   GSource *timeout;
   gboolean check_tls_redirect;
+  gboolean proxy_header_done;
 
   GHashTable *headers;
   const gchar *original_path;
@@ -38,6 +38,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/stat.h>
+
 /**
  * CockpitWebResponse:
  *
@@ -1281,42 +1283,191 @@ cockpit_web_response_resolve_roots (const gchar **input)
   return (gchar **)g_ptr_array_free (roots, FALSE);
 }
 
+/*
+ * The static files that were served most recently, so that serving them
+ * again doesn't need to search the roots, map the file and work out its
+ * headers. Login pages and branding get requested on every page load.
+ *
+ * A hit checks that the file is still the one that got mapped with a
+ * stat(), and once in a while that none of the paths that would be found
+ * before it have appeared.
+ */
+#define FILE_CACHE_SIZE            128
+#define FILE_CACHE_CHECK_INTERVAL  G_USEC_PER_SEC
+
+typedef struct {
+  gchar *key;
+  gchar *unescaped;
+  gboolean is_gzip;
+  GBytes *body;
+
+  /* What got mapped, and the paths that were not found before it */
+  gchar *path;
+  struct stat st;
+  gchar **shadowing;
+  gint64 checked;
+
+  /* The headers that only depend on the file and the origin */
+  gchar *origin;
+  gchar *headers;
+
+  GList *link;
+} CachedFile;
+
+static GHashTable *file_cache;
+static GQueue file_cache_lru = G_QUEUE_INIT;
+
 static void
-web_response_file (CockpitWebResponse *response,
-                   const gchar *escaped,
-                   const gchar **roots,
-                   gboolean search_gzip,
-                   gboolean accept_gzip,
-                   CockpitTemplateFunc template_func,
-                   gpointer user_data)
+cached_file_free (CachedFile *cached)
 {
-  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
+  g_free (cached->key);
+  g_free (cached->unescaped);
+  g_bytes_unref (cached->body);
+  g_free (cached->path);
+  g_strfreev (cached->shadowing);
+  g_free (cached->origin);
+  g_free (cached->headers);
+  g_free (cached);
+}
 
-  if (!escaped)
-    escaped = cockpit_web_response_get_path (response);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(CachedFile, cached_file_free)
 
-  g_return_if_fail (escaped != NULL);
+static void
+file_cache_remove (CachedFile *cached)
+{
+  g_queue_delete_link (&file_cache_lru, cached->link);
+  g_hash_table_remove (file_cache, cached->key);
+}
+
+static gboolean
+cached_file_valid (CachedFile *cached)
+{
+  struct stat st;
+  gint64 now;
+  gint i;
+
+  if (stat (cached->path, &st) < 0 ||
+      st.st_dev != cached->st.st_dev ||
+      st.st_ino != cached->st.st_ino ||
+      st.st_size != cached->st.st_size ||
+      st.st_mtim.tv_sec != cached->st.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != cached->st.st_mtim.tv_nsec)
+    return FALSE;
+
+  now = g_get_monotonic_time ();
+  if (now - cached->checked < FILE_CACHE_CHECK_INTERVAL)
+    return TRUE;
 
+  for (i = 0; cached->shadowing[i]; i++)
+    {
+      if (stat (cached->shadowing[i], &st) == 0 || errno != ENOENT)
+        return FALSE;
+    }
+
+  cached->checked = now;
+  return TRUE;
+}
+
+static CachedFile *
+file_cache_lookup (const gchar *key)
+{
+  CachedFile *cached;
+
+  if (!file_cache)
+    return NULL;
+
+  cached = g_hash_table_lookup (file_cache, key);
+  if (!cached)
+    return NULL;
+
+  if (!cached_file_valid (cached))
+    {
+      g_debug ("%s: file changed, dropping from cache", cached->path);
+      file_cache_remove (cached);
+      return NULL;
+    }
+
+  g_queue_unlink (&file_cache_lru, cached->link);
+  g_queue_push_head_link (&file_cache_lru, cached->link);
+  return cached;
+}
+
+static void
+file_cache_insert (CachedFile *cached)
+{
+  if (!file_cache)
+    file_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)cached_file_free);
+
+  while (g_hash_table_size (file_cache) >= FILE_CACHE_SIZE)
+    file_cache_remove (g_queue_peek_tail (&file_cache_lru));
+
+  g_queue_push_head (&file_cache_lru, cached);
+  cached->link = file_cache_lru.head;
+  g_hash_table_replace (file_cache, cached->key, cached);
+}
+
+static const gchar *
+cached_file_headers (CachedFile *cached,
+                     CockpitWebResponse *response)
+{
+  GString *string;
+
+  if (cached->headers && g_strcmp0 (cached->origin, response->origin) == 0)
+    return cached->headers;
+
+  string = g_string_new ("");
+
+  if (response->origin)
+    append_header (string, "Access-Control-Allow-Origin", response->origin);
+
+  /*
+   * The default Content-Security-Policy for .html files allows
+   * the site to have inline <script> and <style> tags. This code
+   * is only used for static resources that do not use the session.
+   */
+  if (g_str_has_suffix (cached->unescaped, ".html"))
+    {
+      const gchar *default_policy = "default-src 'self' 'unsafe-inline';";
+      g_autofree gchar *policy = cockpit_web_response_security_policy (default_policy, response->origin);
+      append_header (string, "Content-Security-Policy", policy);
+    }
+
+  g_free (cached->origin);
+  cached->origin = g_strdup (response->origin);
+  g_free (cached->headers);
+  cached->headers = g_string_free (string, FALSE);
+  return cached->headers;
+}
+
+static CachedFile *
+find_file (CockpitWebResponse *response,
+           const gchar *escaped,
+           const gchar **roots,
+           gboolean search_gzip)
+{
   /* Someone is trying to escape the root directory, or access hidden files? */
   g_autofree gchar *unescaped = g_uri_unescape_string (escaped, "/");
   if (!unescaped || strstr (unescaped, "/.") || strstr (unescaped, "../") || strstr (unescaped, "//"))
     {
       g_debug ("%s: invalid path request", escaped);
       cockpit_web_response_error (response, 404, NULL, "Not Found");
-      return;
+      return NULL;
     }
 
+  g_autoptr(GPtrArray) shadowing = g_ptr_array_new_with_free_func (g_free);
+  g_autofree gchar *path = NULL;
   gboolean is_gzip = FALSE;
   g_autoptr(GMappedFile) file = NULL;
   for (gint i = 0; roots[i]; i++)
     {
       const gchar *root = roots[i];
-      g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
+      g_free (path);
+      path = g_build_filename (root, unescaped, NULL);
 
       if (g_file_test (path, G_FILE_TEST_IS_DIR))
         {
           cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
-          return;
+          return NULL;
         }
 
       /* As a double check of above behavior */
@@ -1330,6 +1481,7 @@ web_response_file (CockpitWebResponse *response,
         {
           g_debug ("%s: file not found in root: %s, looking for .gz", escaped, root);
           g_clear_error (&error);
+          g_ptr_array_add (shadowing, g_strdup (path));
           g_autofree gchar *old_path = g_steal_pointer (&path);
           path = g_strconcat (old_path, ".gz", NULL);
           file = g_mapped_file_new (path, FALSE, &error);
@@ -1343,29 +1495,93 @@ web_response_file (CockpitWebResponse *response,
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
         {
           g_debug ("%s: file not found in root: %s", escaped, root);
+          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_ptr_array_add (shadowing, g_strdup (path));
         }
       else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_PERM) ||
                g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ACCES) ||
                g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR))
         {
           cockpit_web_response_error (response, 403, NULL, "Access denied");
-          return;
+          return NULL;
         }
       else
         {
           g_warning ("%s: %s", path, error->message);
           cockpit_web_response_error (response, 500, NULL, "Internal server error");
-          return;
+          return NULL;
         }
     }
 
   if (file == NULL)
     {
       cockpit_web_response_error (response, 404, NULL, "Not Found");
-      return;
+      return NULL;
+    }
+
+  CachedFile *cached = g_new0 (CachedFile, 1);
+  cached->unescaped = g_steal_pointer (&unescaped);
+  cached->is_gzip = is_gzip;
+  cached->body = g_mapped_file_get_bytes (file);
+  cached->checked = g_get_monotonic_time ();
+
+  /* The file can't be checked for changes without this, so don't keep it */
+  if (stat (path, &cached->st) == 0)
+    {
+      cached->path = g_steal_pointer (&path);
+      g_ptr_array_add (shadowing, NULL);
+      cached->shadowing = (gchar **)g_ptr_array_free (g_steal_pointer (&shadowing), FALSE);
     }
 
-  g_autoptr(GBytes) body = g_mapped_file_get_bytes (file);
+  return cached;
+}
+
+static void
+web_response_file (CockpitWebResponse *response,
+                   const gchar *escaped,
+                   const gchar **roots,
+                   gboolean search_gzip,
+                   gboolean accept_gzip,
+                   CockpitTemplateFunc template_func,
+                   gpointer user_data)
+{
+  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (response));
+
+  if (!escaped)
+    escaped = cockpit_web_response_get_path (response);
+
+  g_return_if_fail (escaped != NULL);
+
+  /* Which file gets served depends on all of these */
+  GString *key = g_string_new (search_gzip ? "gz\n" : "\n");
+  for (gint i = 0; roots[i]; i++)
+    g_string_append_printf (key, "%s\n", roots[i]);
+  g_string_append (key, escaped);
+
+  g_autoptr(CachedFile) uncached = NULL;
+  CachedFile *cached = file_cache_lookup (key->str);
+  if (cached)
+    {
+      g_string_free (key, TRUE);
+    }
+  else
+    {
+      cached = find_file (response, escaped, roots, search_gzip);
+      if (!cached)
+        {
+          g_string_free (key, TRUE);
+          return;
+        }
+
+      cached->key = g_string_free (key, FALSE);
+      if (cached->path)
+        file_cache_insert (cached);
+      else
+        uncached = cached;
+    }
+
+  g_autoptr(GBytes) body = g_bytes_ref (cached->body);
+  gboolean is_gzip = cached->is_gzip;
 
   if (is_gzip && (!accept_gzip || template_func))
     {
@@ -1399,20 +1615,7 @@ web_response_file (CockpitWebResponse *response,
   GString *string = begin_headers (response, 200, "OK");
   guint seen = 0;
 
-  if (response->origin)
-    seen |= append_header (string, "Access-Control-Allow-Origin", response->origin);
-
-  /*
-   * The default Content-Security-Policy for .html files allows
-   * the site to have inline <script> and <style> tags. This code
-   * is only used for static resources that do not use the session.
-   */
-  if (g_str_has_suffix (unescaped, ".html"))
-    {
-      const gchar *default_policy = "default-src 'self' 'unsafe-inline';";
-      g_autofree gchar *policy = cockpit_web_response_security_policy (default_policy, response->origin);
-      seen |= append_header (string, "Content-Security-Policy", policy);
-    }
+  g_string_append (string, cached_file_headers (cached, response));
 
   if (is_gzip)
     seen |= append_header (string, "Content-Encoding", "gzip");
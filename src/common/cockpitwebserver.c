@@ -26,6 +26,7 @@
 #include "cockpitjson.h"
 #include "cockpitmemfdread.h"
 #include "cockpitmemory.h"
+#include "cockpitproxyheader.h"
 #include "cockpitsocket.h"
 #include "cockpitwebresponse.h"
 
@@ -1096,6 +1097,91 @@ cockpit_web_request_on_accept_certificate (GTlsConnection *conn,
   return TRUE;
 }
 
+/* longer ones are possible, but neither cockpit-tls nor HAProxy send them */
+#define PROXY_HEADER_MAX_SIZE 4096
+
+/*
+ * Takes the PROXY protocol header from the start of the connection,
+ * and attaches its contents as the connection metadata, just like
+ * cockpit-tls' metadata memfd.
+ *
+ * Returns: the size of the header, 0 if it is not complete yet, or -1
+ * if the connection should be closed.
+ */
+static gssize
+cockpit_web_request_read_proxy_header (CockpitWebRequest *self,
+                                       GSocket *socket)
+{
+  guchar data[PROXY_HEADER_MAX_SIZE];
+  GInputVector vector[1] = { { data, sizeof data } };
+  gint flags = G_SOCKET_MSG_PEEK;
+  g_autoptr(GError) error = NULL;
+  CockpitProxyHeader header;
+
+  gssize num_read = g_socket_receive_message (socket, NULL, vector, 1, NULL, NULL, &flags, NULL, &error);
+  if (num_read < 0)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        return 0;
+
+      if (!should_suppress_request_error (error, 0))
+        g_message ("couldn't read from socket: %s", error->message);
+      return -1;
+    }
+
+  gssize size = cockpit_proxy_header_parse (data, num_read, &header);
+
+  /* The sender writes the whole header at once, so this shouldn't happen
+   * in practice.  Until the rest arrives, we keep waking up for what we
+   * already have, as we only peek.
+   */
+  if (size == 0 && num_read > 0 && (gsize) num_read < sizeof data)
+    return 0;
+
+  if (size <= 0)
+    {
+      if (num_read > 0)
+        g_message ("received connection without a valid PROXY protocol header");
+      return -1;
+    }
+
+  g_autoptr(JsonObject) metadata = json_object_new ();
+
+  if (header.origin_ip[0])
+    {
+      json_object_set_string_member (metadata, "origin-ip", header.origin_ip);
+      json_object_set_int_member (metadata, "origin-port", header.origin_port);
+    }
+
+  if (header.client_certificate)
+    {
+      /* the same restriction as for the metadata memfd */
+      for (gsize i = 0; i < header.client_certificate_len; i++)
+        if (!g_ascii_isprint (header.client_certificate[i]))
+          {
+            g_warning ("PROXY protocol header contains invalid client certificate name");
+            return -1;
+          }
+
+      g_autofree gchar *filename = g_strndup (header.client_certificate, header.client_certificate_len);
+      json_object_set_string_member (metadata, "client-certificate", filename);
+    }
+
+  /* now actually take it out of the stream */
+  num_read = g_socket_receive (socket, (gchar *) data, size, NULL, &error);
+  if (num_read != size)
+    {
+      g_message ("couldn't read PROXY protocol header: %s", error ? error->message : "short read");
+      return -1;
+    }
+
+  g_object_set_qdata_full (G_OBJECT (self->io),
+                           g_quark_from_static_string ("metadata"),
+                           g_steal_pointer (&metadata), (GDestroyNotify) json_object_unref);
+
+  return size;
+}
+
 static gboolean
 cockpit_web_request_on_socket_input (GSocket *socket,
                                      GIOCondition condition,
@@ -1110,6 +1196,20 @@ cockpit_web_request_on_socket_input (GSocket *socket,
   gssize num_read;
   g_auto(CockpitControlMessages) ccm = COCKPIT_CONTROL_MESSAGES_INIT;
 
+  if (self->web_server->flags & COCKPIT_WEB_SERVER_PROXY_PROTOCOL && !self->proxy_header_done)
+    {
+      num_read = cockpit_web_request_read_proxy_header (self, socket);
+      if (num_read < 0)
+        {
+          cockpit_web_request_finish (self);
+          return FALSE;
+        }
+      else if (num_read == 0)
+        return TRUE;
+
+      self->proxy_header_done = TRUE;
+    }
+
   num_read = g_socket_receive_message (socket,
                                        NULL, /* out GSocketAddress */
                                        vector,
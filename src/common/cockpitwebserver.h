@@ -86,7 +86,9 @@ typedef enum {
   COCKPIT_WEB_SERVER_FOR_TLS_PROXY = 1 << 0,
   /* http → https redirection for non-localhost addresses */
   COCKPIT_WEB_SERVER_REDIRECT_TLS = 1 << 1,
-  COCKPIT_WEB_SERVER_FLAGS_MAX = 1 << 2
+  /* connections start with a PROXY protocol v2 header */
+  COCKPIT_WEB_SERVER_PROXY_PROTOCOL = 1 << 2,
+  COCKPIT_WEB_SERVER_FLAGS_MAX = 1 << 3
 } CockpitWebServerFlags;
 
 
@@ -346,6 +346,96 @@ test_close_transport (TestCase *tc,
   g_free (problem);
 }
 
+static void
+test_recv_many (TestCase *tc,
+                gconstpointer unused)
+{
+  CockpitChannel *channels[100];
+  GBytes *payload;
+  GBytes *sent;
+  gchar *id;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      id = g_strdup_printf ("many-%u", i);
+      channels[i] = mock_echo_channel_open (COCKPIT_TRANSPORT (tc->transport), id);
+      g_free (id);
+    }
+
+  while (g_main_context_iteration (NULL, FALSE));
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    cockpit_channel_ready (channels[i], NULL);
+
+  /* Only the channel that it's for sees the message */
+  payload = g_bytes_new ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "many-42", payload);
+
+  sent = mock_transport_pop_channel (tc->transport, "many-42");
+  g_assert (sent != NULL);
+  g_assert (g_bytes_equal (payload, sent));
+  g_assert (mock_transport_pop_channel (tc->transport, "many-42") == NULL);
+  g_assert (mock_transport_pop_channel (tc->transport, "many-41") == NULL);
+  g_assert (mock_transport_pop_channel (tc->transport, "554") == NULL);
+
+  /* And nothing routes to it after it closes */
+  cockpit_channel_close (channels[42], NULL);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "many-42", payload);
+  g_assert (mock_transport_pop_channel (tc->transport, "many-42") == NULL);
+
+  g_bytes_unref (payload);
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    g_object_unref (channels[i]);
+}
+
+static gboolean
+on_recv_count (CockpitTransport *transport,
+               const gchar *channel_id,
+               GBytes *data,
+               gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return FALSE;
+}
+
+static void
+test_recv_duplicate (TestCase *tc,
+                     gconstpointer unused)
+{
+  CockpitChannel *duplicate;
+  GBytes *payload;
+  gint count = 0;
+
+  /* This one can't be registered, and falls back to the signals */
+  duplicate = mock_echo_channel_open (COCKPIT_TRANSPORT (tc->transport), "554");
+  while (g_main_context_iteration (NULL, FALSE));
+  cockpit_channel_ready (tc->channel, NULL);
+  cockpit_channel_ready (duplicate, NULL);
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_count), &count);
+
+  /* The first channel claims the message, like with the signals */
+  payload = g_bytes_new ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_assert (mock_transport_pop_channel (tc->transport, "554") != NULL);
+  g_assert (mock_transport_pop_channel (tc->transport, "554") == NULL);
+  g_assert_cmpint (count, ==, 0);
+
+  /* Other listeners still see the messages of unregistered channels */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "other", payload);
+  g_assert_cmpint (count, ==, 1);
+
+  /* Once it's closed the other one gets them, before our handler */
+  cockpit_channel_close (tc->channel, NULL);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_assert (mock_transport_pop_channel (tc->transport, "554") != NULL);
+  g_assert_cmpint (count, ==, 1);
+
+  g_bytes_unref (payload);
+  g_object_unref (duplicate);
+}
+
 static void
 test_get_option (void)
 {
@@ -783,6 +873,10 @@ main (int argc,
               setup, test_recv_and_send, teardown);
   g_test_add ("/channel/recv-queue", TestCase, NULL,
               setup, test_recv_and_queue, teardown);
+  g_test_add ("/channel/recv-many", TestCase, NULL,
+              setup, test_recv_many, teardown);
+  g_test_add ("/channel/recv-duplicate", TestCase, NULL,
+              setup, test_recv_duplicate, teardown);
   g_test_add ("/channel/ready-message", TestCase, NULL,
               setup, test_ready_message, teardown);
   g_test_add ("/channel/close-immediately", TestCase, NULL,
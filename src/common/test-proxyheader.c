@@ -0,0 +1,218 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "common/cockpitproxyheader.h"
+#include "testlib/cockpittest.h"
+
+#include <glib.h>
+#include <string.h>
+#include <sys/un.h>
+
+/* as HAProxy sends it: TCP over IPv4 from 192.0.2.1:56324 to 192.0.2.2:443,
+ * with an ALPN TLV (type 0x01) and a NOOP TLV (type 0x04) */
+static const unsigned char haproxy_header[] = {
+  0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a,
+  0x21, 0x11, 0x00, 0x17,
+  192, 0, 2, 1,  192, 0, 2, 2,  0xdc, 0x04,  0x01, 0xbb,
+  0x01, 0x00, 0x02, 'h', '2',
+  0x04, 0x00, 0x03, 0x00, 0x00, 0x00,
+  'G', 'E', 'T'
+};
+
+static void
+assert_parse_incomplete (const unsigned char *data,
+                         size_t               size)
+{
+  CockpitProxyHeader header;
+
+  /* every prefix of a header is a "maybe" */
+  for (size_t i = 0; i < size; i++)
+    g_assert_cmpint (cockpit_proxy_header_parse (data, i, &header), ==, 0);
+}
+
+static void
+test_haproxy (void)
+{
+  CockpitProxyHeader header;
+
+  assert_parse_incomplete (haproxy_header, sizeof haproxy_header - 3);
+
+  ssize_t size = cockpit_proxy_header_parse (haproxy_header, sizeof haproxy_header, &header);
+  g_assert_cmpint (size, ==, sizeof haproxy_header - 3);
+  g_assert_cmpstr (header.origin_ip, ==, "192.0.2.1");
+  g_assert_cmpuint (header.origin_port, ==, 56324);
+  g_assert (header.client_certificate == NULL);
+}
+
+static void
+test_inet (void)
+{
+  struct sockaddr_in source = { .sin_family = AF_INET, .sin_port = htons (1234) };
+  struct sockaddr_in destination = { .sin_family = AF_INET, .sin_port = htons (9090) };
+  unsigned char buffer[256];
+  CockpitProxyHeader header;
+
+  inet_pton (AF_INET, "10.1.2.3", &source.sin_addr);
+  inet_pton (AF_INET, "10.3.2.1", &destination.sin_addr);
+
+  size_t length = cockpit_proxy_header_build (buffer, sizeof buffer,
+                                              (struct sockaddr *) &source, (struct sockaddr *) &destination,
+                                              "abcdef");
+  g_assert_cmpuint (length, ==, 16 + 12 + 3 + 6);
+
+  assert_parse_incomplete (buffer, length);
+
+  g_assert_cmpint (cockpit_proxy_header_parse (buffer, length, &header), ==, length);
+  g_assert_cmpstr (header.origin_ip, ==, "10.1.2.3");
+  g_assert_cmpuint (header.origin_port, ==, 1234);
+  g_assert_cmpuint (header.client_certificate_len, ==, 6);
+  g_assert (memcmp (header.client_certificate, "abcdef", 6) == 0);
+}
+
+static void
+test_inet6 (void)
+{
+  struct sockaddr_in6 source = { .sin6_family = AF_INET6, .sin6_port = htons (4321), .sin6_scope_id = 1 };
+  struct sockaddr_in6 destination = { .sin6_family = AF_INET6, .sin6_port = htons (9090) };
+  unsigned char buffer[256];
+  CockpitProxyHeader header;
+  char ifname[IF_NAMESIZE];
+
+  inet_pton (AF_INET6, "fe80::1", &source.sin6_addr);
+  inet_pton (AF_INET6, "fe80::2", &destination.sin6_addr);
+
+  size_t length = cockpit_proxy_header_build (buffer, sizeof buffer,
+                                              (struct sockaddr *) &source, (struct sockaddr *) &destination,
+                                              NULL);
+  g_assert_cmpuint (length, ==, 16 + 36 + 3 + 4);
+
+  g_assert_cmpint (cockpit_proxy_header_parse (buffer, length, &header), ==, length);
+  g_autofree gchar *expected = g_strdup_printf ("fe80::1%%%s", if_indextoname (1, ifname) ?: "1");
+  g_assert_cmpstr (header.origin_ip, ==, expected);
+  g_assert_cmpuint (header.origin_port, ==, 4321);
+  g_assert (header.client_certificate == NULL);
+}
+
+static void
+test_unspec (void)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  unsigned char buffer[256];
+  CockpitProxyHeader header;
+
+  size_t length = cockpit_proxy_header_build (buffer, sizeof buffer,
+                                              (struct sockaddr *) &addr, (struct sockaddr *) &addr,
+                                              "certfile");
+  g_assert_cmpuint (length, ==, 16 + 3 + 8);
+
+  g_assert_cmpint (cockpit_proxy_header_parse (buffer, length, &header), ==, length);
+  g_assert_cmpstr (header.origin_ip, ==, "");
+  g_assert_cmpuint (header.origin_port, ==, 0);
+  g_assert_cmpuint (header.client_certificate_len, ==, 8);
+  g_assert (memcmp (header.client_certificate, "certfile", 8) == 0);
+}
+
+static void
+test_too_small (void)
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  unsigned char buffer[16 + 12];
+
+  memset (buffer, 'x', sizeof buffer);
+  g_assert_cmpuint (cockpit_proxy_header_build (buffer, sizeof buffer, (struct sockaddr *) &addr,
+                                                (struct sockaddr *) &addr, "cert"), ==, 16 + 12 + 3 + 4);
+  g_assert_cmpint (buffer[0], ==, 'x');
+}
+
+static void
+test_local (void)
+{
+  unsigned char data[sizeof haproxy_header];
+  CockpitProxyHeader header;
+
+  memcpy (data, haproxy_header, sizeof data);
+  data[12] = 0x20;
+
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, sizeof data - 3);
+  g_assert_cmpstr (header.origin_ip, ==, "");
+  g_assert_cmpuint (header.origin_port, ==, 0);
+}
+
+static void
+test_invalid (void)
+{
+  unsigned char data[sizeof haproxy_header];
+  CockpitProxyHeader header;
+
+  /* plain HTTP */
+  g_assert_cmpint (cockpit_proxy_header_parse ((const unsigned char *) "GET / HTTP/1.1\r\n", 16, &header), ==, -1);
+  g_assert_cmpint (cockpit_proxy_header_parse ((const unsigned char *) "\r\n\r\nGET", 7, &header), ==, -1);
+
+  /* TLS client hello */
+  g_assert_cmpint (cockpit_proxy_header_parse ((const unsigned char *) "\x16\x03\x01", 3, &header), ==, -1);
+
+  /* version 1 of the protocol */
+  g_assert_cmpint (cockpit_proxy_header_parse ((const unsigned char *) "PROXY TCP4 ", 11, &header), ==, -1);
+
+  /* unknown version and command */
+  memcpy (data, haproxy_header, sizeof data);
+  data[12] = 0x31;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+  data[12] = 0x22;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+
+  /* addresses don't fit */
+  memcpy (data, haproxy_header, sizeof data);
+  data[15] = 8;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+
+  /* unknown address family */
+  memcpy (data, haproxy_header, sizeof data);
+  data[13] = 0x41;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+
+  /* TLV longer than the header */
+  memcpy (data, haproxy_header, sizeof data);
+  data[35] = 4;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+
+  /* incomplete TLV header */
+  memcpy (data, haproxy_header, sizeof data);
+  data[15] = 12 + 2;
+  g_assert_cmpint (cockpit_proxy_header_parse (data, sizeof data, &header), ==, -1);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/proxyheader/haproxy", test_haproxy);
+  g_test_add_func ("/proxyheader/inet", test_inet);
+  g_test_add_func ("/proxyheader/inet6", test_inet6);
+  g_test_add_func ("/proxyheader/unspec", test_unspec);
+  g_test_add_func ("/proxyheader/too-small", test_too_small);
+  g_test_add_func ("/proxyheader/local", test_local);
+  g_test_add_func ("/proxyheader/invalid", test_invalid);
+
+  return g_test_run ();
+}
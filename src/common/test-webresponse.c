@@ -1437,6 +1437,82 @@ test_negotiation_failure (void)
   g_assert (bytes == NULL);
 }
 
+static gchar *
+serve_file (const gchar *path,
+            const gchar **roots)
+{
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  GInputStream *input;
+  gboolean done = FALSE;
+  GIOStream *io;
+  gchar *data;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+  response = cockpit_web_response_new (io, path, path, NULL, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+
+  cockpit_web_response_file (response, NULL, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  data = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                    g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (input);
+  g_object_unref (output);
+  return data;
+}
+
+static void
+test_file_changed (void)
+{
+  const gchar *roots[] = { NULL, NULL };
+  GError *error = NULL;
+  gchar *directory;
+  gchar *filename;
+  gchar *resp;
+
+  directory = g_dir_make_tmp ("test-webresponse.XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (directory, "file.txt", NULL);
+  roots[0] = directory;
+
+  g_file_set_contents (filename, "first", -1, &error);
+  g_assert_no_error (error);
+
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\nfirst");
+  g_free (resp);
+
+  /* Served again, from the cache this time */
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\nfirst");
+  g_free (resp);
+
+  /* This replaces the file, which needs to be noticed */
+  g_file_set_contents (filename, "second", -1, &error);
+  g_assert_no_error (error);
+
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\nsecond");
+  g_free (resp);
+
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+
+  resp = serve_file ("/file.txt", roots);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 404 Not Found*");
+  g_free (resp);
+
+  g_assert_cmpint (g_rmdir (directory), ==, 0);
+  g_free (filename);
+  g_free (directory);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1476,6 +1552,7 @@ main (int argc,
               setup, test_file_slash_denied, teardown);
   g_test_add ("/web-response/file/breakout-non-existant", TestCase, NULL,
               setup, test_file_breakout_non_existant, teardown);
+  g_test_add_func ("/web-response/file/changed", test_file_changed);
   g_test_add ("/web-reponse/file/template", TestCase, &template_fixture,
               setup, test_template, teardown);
   g_test_add ("/web-response/content-type/html", TestCase, &content_type_fixture_html,
@@ -0,0 +1,356 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Admission control for new connections: limits for the number of
+ * concurrent connections and for the rate of new ones, both in total and
+ * per source.  The server asks right after accept(), and drops rejected
+ * connections before they cost a thread, a buffer, or a TLS handshake.
+ *
+ * A source is an IPv4 address, or an IPv6 /64 network, as that is what a
+ * single host usually gets.  Rates are counted in one-second windows.
+ * Sources are only tracked while they have connections, or connected
+ * within the current window.
+ */
+
+#include "config.h"
+
+#include "admission.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/cockpitmemory.h"
+
+#define N_BUCKETS 1024
+
+static const char * const result_names[ADMISSION_N_RESULTS] = {
+  "accepted", "connections", "source-connections", "rate", "source-rate", "no-fds"
+};
+
+struct _AdmissionSource {
+  unsigned char address[16]; /* IPv4 mapped into IPv6 */
+  unsigned connections;
+  time_t window;
+  unsigned window_count;
+  AdmissionSource *next;
+};
+
+/* protects admission */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* admission control state (singleton) */
+static struct {
+  AdmissionLimits limits;
+
+  unsigned connections;
+  time_t window;
+  unsigned window_count;
+
+  /* only with per-source limits */
+  AdmissionSource *buckets[N_BUCKETS];
+
+  uint64_t rejected[ADMISSION_N_RESULTS];
+} admission;
+
+static time_t
+now_seconds (void)
+{
+  struct timespec now;
+  int r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+  return now.tv_sec;
+}
+
+/* Returns: false if @address isn't an IP one */
+static bool
+source_address (const struct sockaddr *address,
+                unsigned char          out[16])
+{
+  memset (out, 0, 16);
+
+  if (address->sa_family == AF_INET)
+    {
+      out[10] = out[11] = 0xff;
+      memcpy (out + 12, &((const struct sockaddr_in *) address)->sin_addr, 4);
+      return true;
+    }
+
+  if (address->sa_family == AF_INET6)
+    {
+      const unsigned char *addr6 = ((const struct sockaddr_in6 *) address)->sin6_addr.s6_addr;
+      static const unsigned char v4mapped[12] = { [10] = 0xff, [11] = 0xff };
+
+      /* the whole address for mapped IPv4, otherwise the /64 */
+      memcpy (out, addr6, memcmp (addr6, v4mapped, sizeof v4mapped) == 0 ? 16 : 8);
+      return true;
+    }
+
+  return false;
+}
+
+static unsigned
+source_hash (const unsigned char address[16])
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for (unsigned i = 0; i < 16; i++)
+    hash = (hash ^ address[i]) * 16777619u;
+  return hash % N_BUCKETS;
+}
+
+static bool
+source_is_stale (AdmissionSource *source,
+                 time_t           now)
+{
+  return source->connections == 0 && source->window != now;
+}
+
+/* must be called with mutex held; creates the source if necessary */
+static AdmissionSource *
+source_lookup (const unsigned char address[16],
+               time_t              now)
+{
+  AdmissionSource **link = &admission.buckets[source_hash (address)];
+
+  while (*link)
+    {
+      AdmissionSource *source = *link;
+
+      if (memcmp (source->address, address, 16) == 0)
+        return source;
+
+      /* clean up on the way */
+      if (source_is_stale (source, now))
+        {
+          *link = source->next;
+          free (source);
+        }
+      else
+        link = &source->next;
+    }
+
+  AdmissionSource *source = callocx (1, sizeof (AdmissionSource));
+  memcpy (source->address, address, 16);
+  *link = source;
+  return source;
+}
+
+/* must be called with mutex held */
+static void
+source_remove (AdmissionSource *source)
+{
+  for (AdmissionSource **link = &admission.buckets[source_hash (source->address)]; *link; link = &(*link)->next)
+    if (*link == source)
+      {
+        *link = source->next;
+        free (source);
+        return;
+      }
+
+  assert (false);
+}
+
+/* must be called with mutex held; whether the current one-second window
+ * has room for another connection.  It only gets counted once admitted. */
+static bool
+window_full (time_t   *window,
+             unsigned *count,
+             unsigned  max,
+             time_t    now)
+{
+  if (*window != now)
+    {
+      *window = now;
+      *count = 0;
+    }
+
+  return max > 0 && *count >= max;
+}
+
+/**
+ * admission_set_limits: Configure admission control
+ *
+ * This should be called before accepting any connections.
+ */
+void
+admission_set_limits (const AdmissionLimits *limits)
+{
+  pthread_mutex_lock (&mutex);
+  assert (admission.connections == 0);
+  admission.limits = *limits;
+  pthread_mutex_unlock (&mutex);
+}
+
+/**
+ * admission_check: Decide whether to serve a new connection
+ *
+ * @address: The peer address of the connection
+ * @out_source: Where to store the source of the connection on success;
+ *              this is %NULL if there are no per-source limits
+ *
+ * Rejections get counted.  Every accepted connection must be given
+ * back with admission_release() once it is closed.
+ *
+ * Returns: %ADMISSION_ACCEPTED, or the reason for rejecting it
+ */
+AdmissionResult
+admission_check (const struct sockaddr  *address,
+                 AdmissionSource       **out_source)
+{
+  const AdmissionLimits *limits = &admission.limits;
+  AdmissionResult result = ADMISSION_ACCEPTED;
+  AdmissionSource *source = NULL;
+  unsigned char source_addr[16];
+  time_t now = now_seconds ();
+
+  pthread_mutex_lock (&mutex);
+
+  if (limits->max_connections > 0 && admission.connections >= limits->max_connections)
+    result = ADMISSION_REJECTED_CONNECTIONS;
+
+  /*
+   * The per-source limits go before the global rate, so that a source
+   * that is over its own limits can't use up the rate for everyone else.
+   */
+  if (result == ADMISSION_ACCEPTED &&
+      (limits->max_connections_per_source > 0 || limits->max_rate_per_source > 0) &&
+      source_address (address, source_addr))
+    {
+      source = source_lookup (source_addr, now);
+
+      if (limits->max_connections_per_source > 0 && source->connections >= limits->max_connections_per_source)
+        result = ADMISSION_REJECTED_SOURCE_CONNECTIONS;
+      else if (window_full (&source->window, &source->window_count, limits->max_rate_per_source, now))
+        result = ADMISSION_REJECTED_SOURCE_RATE;
+    }
+
+  if (result == ADMISSION_ACCEPTED &&
+      window_full (&admission.window, &admission.window_count, limits->max_rate, now))
+    result = ADMISSION_REJECTED_RATE;
+
+  if (result == ADMISSION_ACCEPTED)
+    {
+      admission.connections++;
+      admission.window_count++;
+
+      if (source)
+        {
+          source->connections++;
+          source->window_count++;
+        }
+    }
+  else
+    {
+      admission.rejected[result]++;
+      source = NULL;
+    }
+
+  pthread_mutex_unlock (&mutex);
+
+  *out_source = source;
+  return result;
+}
+
+/**
+ * admission_release: Account for a connection that went away
+ *
+ * @source: The source from admission_check(), can be %NULL
+ *
+ * Called from the connection's thread, or from a worker thread.
+ */
+void
+admission_release (AdmissionSource *source)
+{
+  pthread_mutex_lock (&mutex);
+
+  assert (admission.connections > 0);
+  admission.connections--;
+
+  if (source)
+    {
+      assert (source->connections > 0);
+      if (--source->connections == 0 && source_is_stale (source, now_seconds ()))
+        source_remove (source);
+    }
+
+  pthread_mutex_unlock (&mutex);
+}
+
+/**
+ * admission_count_rejected: Count a connection rejected by the server
+ *
+ * For the cases that the server decides by itself, like running out of
+ * file descriptors.
+ */
+void
+admission_count_rejected (AdmissionResult result)
+{
+  assert (result != ADMISSION_ACCEPTED && result < ADMISSION_N_RESULTS);
+
+  pthread_mutex_lock (&mutex);
+  admission.rejected[result]++;
+  pthread_mutex_unlock (&mutex);
+}
+
+void
+admission_get_rejected (uint64_t rejected[ADMISSION_N_RESULTS])
+{
+  pthread_mutex_lock (&mutex);
+  memcpy (rejected, admission.rejected, sizeof admission.rejected);
+  pthread_mutex_unlock (&mutex);
+}
+
+const char *
+admission_result_name (AdmissionResult result)
+{
+  assert (result < ADMISSION_N_RESULTS);
+  return result_names[result];
+}
+
+/**
+ * admission_cleanup: Forget all sources, counters, and limits
+ *
+ * There must not be any connections left.
+ */
+void
+admission_cleanup (void)
+{
+  pthread_mutex_lock (&mutex);
+
+  assert (admission.connections == 0);
+
+  for (unsigned i = 0; i < N_BUCKETS; i++)
+    while (admission.buckets[i])
+      {
+        AdmissionSource *source = admission.buckets[i];
+        assert (source->connections == 0);
+        admission.buckets[i] = source->next;
+        free (source);
+      }
+
+  memset (&admission, 0, sizeof admission);
+
+  pthread_mutex_unlock (&mutex);
+}
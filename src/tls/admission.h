@@ -0,0 +1,66 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* all of these are 0 for no limit */
+typedef struct {
+  unsigned max_connections;
+  unsigned max_connections_per_source;
+  unsigned max_rate; /* new connections per second */
+  unsigned max_rate_per_source;
+} AdmissionLimits;
+
+typedef enum {
+  ADMISSION_ACCEPTED,
+  ADMISSION_REJECTED_CONNECTIONS,
+  ADMISSION_REJECTED_SOURCE_CONNECTIONS,
+  ADMISSION_REJECTED_RATE,
+  ADMISSION_REJECTED_SOURCE_RATE,
+  ADMISSION_REJECTED_NO_FDS, /* only counted, see admission_count_rejected() */
+  ADMISSION_N_RESULTS
+} AdmissionResult;
+
+/* the connections from one source address */
+typedef struct _AdmissionSource AdmissionSource;
+
+void
+admission_set_limits (const AdmissionLimits *limits);
+
+AdmissionResult
+admission_check (const struct sockaddr  *address,
+                 AdmissionSource       **out_source);
+
+void
+admission_release (AdmissionSource *source);
+
+void
+admission_count_rejected (AdmissionResult result);
+
+void
+admission_get_rejected (uint64_t rejected[ADMISSION_N_RESULTS]);
+
+const char *
+admission_result_name (AdmissionResult result);
+
+void
+admission_cleanup (void);
@@ -0,0 +1,195 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A pool of the buffers which Connections use for shoveling data back
+ * and forth.  A Connection only holds on to a buffer while there is data
+ * in flight, so most idle (or handshaking) connections don't have any.
+ * Released buffers are kept on a free list per size class for reuse, up
+ * to a configurable number.
+ */
+
+#include "config.h"
+
+#include "buffer-pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common/cockpitmemory.h"
+
+#include "utils.h"
+
+#define DEFAULT_MAX_IDLE 64
+
+/* an idle buffer on a free list */
+typedef struct _IdleBuffer IdleBuffer;
+struct _IdleBuffer {
+  IdleBuffer *next;
+};
+
+/* buffer pool state (singleton) */
+static struct {
+  /* all protected by mutex */
+  pthread_mutex_t mutex;
+  unsigned max_idle; /* per size class */
+
+  IdleBuffer *idle[BUFFER_POOL_N_CLASSES];
+  unsigned n_idle[BUFFER_POOL_N_CLASSES];
+  unsigned n_in_use[BUFFER_POOL_N_CLASSES];
+  unsigned high_water[BUFFER_POOL_N_CLASSES];
+} pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .max_idle = DEFAULT_MAX_IDLE,
+};
+
+static const unsigned class_sizes[BUFFER_POOL_N_CLASSES] = { BUFFER_POOL_SMALL, BUFFER_POOL_LARGE };
+
+static unsigned
+get_class (unsigned size)
+{
+  for (unsigned i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    if (class_sizes[i] == size)
+      return i;
+
+  abort ();
+}
+
+/**
+ * buffer_pool_acquire: Get a buffer
+ *
+ * @size: One of the size classes, BUFFER_POOL_SMALL or BUFFER_POOL_LARGE
+ *
+ * Returns: a buffer of @size bytes, with undefined contents.  Give it
+ * back with buffer_pool_release().
+ */
+char *
+buffer_pool_acquire (unsigned size)
+{
+  unsigned class = get_class (size);
+  IdleBuffer *buffer;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  buffer = pool.idle[class];
+  if (buffer)
+    {
+      pool.idle[class] = buffer->next;
+      pool.n_idle[class]--;
+    }
+
+  pool.n_in_use[class]++;
+  if (pool.n_in_use[class] > pool.high_water[class])
+    pool.high_water[class] = pool.n_in_use[class];
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  /* allocate outside of the lock */
+  if (buffer == NULL)
+    buffer = mallocx (size);
+
+  return (char *) buffer;
+}
+
+void
+buffer_pool_release (char     *buffer,
+                     unsigned  size)
+{
+  unsigned class = get_class (size);
+  IdleBuffer *idle = (IdleBuffer *) buffer;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  assert (pool.n_in_use[class] > 0);
+  pool.n_in_use[class]--;
+
+  if (pool.n_idle[class] < pool.max_idle)
+    {
+      idle->next = pool.idle[class];
+      pool.idle[class] = idle;
+      pool.n_idle[class]++;
+      idle = NULL;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  free (idle);
+}
+
+/**
+ * buffer_pool_set_max_idle: Configure the size of the pool
+ *
+ * @max_idle: How many released buffers of each size class to keep for
+ *            reuse; further ones get freed.  Compare this with the high
+ *            water mark from buffer_pool_get_stats() to see how many
+ *            buffers are needed at peak times.
+ */
+void
+buffer_pool_set_max_idle (unsigned max_idle)
+{
+  pthread_mutex_lock (&pool.mutex);
+  pool.max_idle = max_idle;
+  pthread_mutex_unlock (&pool.mutex);
+
+  debug (SERVER, "keeping up to %u idle buffers of each size", max_idle);
+}
+
+void
+buffer_pool_get_stats (BufferPoolStats stats[BUFFER_POOL_N_CLASSES])
+{
+  pthread_mutex_lock (&pool.mutex);
+
+  for (unsigned i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    {
+      stats[i].size = class_sizes[i];
+      stats[i].in_use = pool.n_in_use[i];
+      stats[i].idle = pool.n_idle[i];
+      stats[i].high_water = pool.high_water[i];
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+}
+
+/**
+ * buffer_pool_cleanup: Free all idle buffers
+ *
+ * Also resets the high water mark to the number of buffers which are
+ * still in use.
+ */
+void
+buffer_pool_cleanup (void)
+{
+  pthread_mutex_lock (&pool.mutex);
+
+  for (unsigned i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    {
+      while (pool.idle[i])
+        {
+          IdleBuffer *buffer = pool.idle[i];
+          pool.idle[i] = buffer->next;
+          free (buffer);
+        }
+
+      pool.n_idle[i] = 0;
+      pool.high_water[i] = pool.n_in_use[i];
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+}
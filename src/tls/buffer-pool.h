@@ -0,0 +1,49 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* the size classes of buffers: small ones for a bit of interactive
+ * traffic, and large ones which can hold a complete TLS record */
+#define BUFFER_POOL_SMALL (4u << 10)
+#define BUFFER_POOL_LARGE (16u << 10)
+#define BUFFER_POOL_N_CLASSES 2
+
+typedef struct {
+  unsigned size;
+  unsigned in_use;
+  unsigned idle;
+  unsigned high_water; /* maximum of in_use so far */
+} BufferPoolStats;
+
+char *
+buffer_pool_acquire (unsigned size);
+
+void
+buffer_pool_release (char     *buffer,
+                     unsigned  size);
+
+void
+buffer_pool_set_max_idle (unsigned max_idle);
+
+void
+buffer_pool_get_stats (BufferPoolStats stats[BUFFER_POOL_N_CLASSES]);
+
+void
+buffer_pool_cleanup (void);
@@ -49,11 +49,30 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/random.h>
 #include <unistd.h>
 
+/* A browser opens many connections with the same certificate.  We
+ * export the certificate only once, and share the file between all of
+ * them; it gets removed when the last one goes away.
+ */
+typedef struct _CertificateExport CertificateExport;
+struct _CertificateExport {
+  char *wsinstance;
+  char *filename;
+  unsigned refs;
+  CertificateExport *next;
+};
+
+/* connections get accepted and freed on worker threads */
+static struct {
+  pthread_mutex_t mutex;
+  CertificateExport *list;
+} exports = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
 /**
  * client_certificate_verify: Custom client certificate validation function
@@ -301,8 +320,10 @@ client_certificate_create_tmpfile (int  dirfd,
  * If a client certificate was presented, the @out_wsinstance will
  * correspond to the SHA256 of the peer certificate.  In this case, a
  * file with a random filename will be written to the directory
- * referenced by @dirfd.  This file will contain the expected cgroup of
- * the cockpit-ws instance in question, plus the client certificate.
+ * referenced by @dirfd, unless another connection with the same
+ * certificate already did that: then the existing file gets shared.
+ * This file will contain the expected cgroup of the cockpit-ws
+ * instance in question, plus the client certificate.
  * That data is interpreted by the counterpart to this code, living in
  * src/ws/cockpit-session-client-certificate.c
  *
@@ -329,16 +350,46 @@ client_certificate_accept (gnutls_session_t   session,
     }
 
   char *wsinstance = client_certificate_get_wsinstance (peer_certificate);
+  CertificateExport *export;
+  bool success = true;
+
+  pthread_mutex_lock (&exports.mutex);
+
+  for (export = exports.list; export; export = export->next)
+    if (strcmp (export->wsinstance, wsinstance) == 0)
+      break;
+
+  if (export == NULL)
+    {
+      char *filename = NULL;
+      int fd = -1;
+
+      success =
+        client_certificate_create_tmpfile (dirfd, &fd) &&
+        client_certificate_write_cgroup_header (fd, wsinstance) &&
+        client_certificate_write_pem (fd, peer_certificate) &&
+        client_certificate_link_fd_to_random_name (dirfd, fd, &filename);
+
+      if (fd != -1)
+        close (fd);
+
+      if (success)
+        {
+          export = callocx (1, sizeof (CertificateExport));
+          export->wsinstance = strdupx (wsinstance);
+          export->filename = filename;
+          export->next = exports.list;
+          exports.list = export;
+        }
+    }
 
-  int fd = -1;
-  bool success =
-    client_certificate_create_tmpfile (dirfd, &fd) &&
-    client_certificate_write_cgroup_header (fd, wsinstance) &&
-    client_certificate_write_pem (fd, peer_certificate) &&
-    client_certificate_link_fd_to_random_name (dirfd, fd, out_filename);
+  if (success)
+    {
+      export->refs++;
+      *out_filename = strdupx (export->filename);
+    }
 
-  if (fd != -1)
-    close (fd);
+  pthread_mutex_unlock (&exports.mutex);
 
   if (success)
     *out_wsinstance = wsinstance;
@@ -356,7 +407,9 @@ client_certificate_accept (gnutls_session_t   session,
  * @dirfd: the directory for session-scoped client certificates
  * @inout_filename: the name of the client certificate file
  *
- * Glorified wrapper around unlinkat().
+ * Drops the reference on the client certificate file that was taken by
+ * client_certificate_accept(), and unlinks it once the last connection
+ * using it is gone.
  *
  * Frees @inout_filename.
  *
@@ -366,16 +419,38 @@ void
 client_certificate_unlink_and_free (int   dirfd,
                                     char *filename)
 {
-  if (unlinkat (dirfd, filename, 0) != 0)
+  CertificateExport **ptr;
+
+  pthread_mutex_lock (&exports.mutex);
+
+  for (ptr = &exports.list; *ptr; ptr = &(*ptr)->next)
+    if (strcmp ((*ptr)->filename, filename) == 0)
+      break;
+
+  /* we only get called for filenames we handed out */
+  assert (*ptr != NULL);
+  CertificateExport *export = *ptr;
+
+  if (--export->refs == 0)
     {
-      /* We can't leave stale certificate files hanging around after
-       * they should have been deleted, and we're really not expecting a
-       * failure here, so let's abort the entire service.  This should
-       * cause any running -ws instances to be terminated, and will
-       * cause systemd to delete the entire runtime directory as well.
-       */
-      err (EXIT_FAILURE, "Failed to unlink client certificate file %s", filename);
+      if (unlinkat (dirfd, export->filename, 0) != 0)
+        {
+          /* We can't leave stale certificate files hanging around after
+           * they should have been deleted, and we're really not expecting a
+           * failure here, so let's abort the entire service.  This should
+           * cause any running -ws instances to be terminated, and will
+           * cause systemd to delete the entire runtime directory as well.
+           */
+          err (EXIT_FAILURE, "Failed to unlink client certificate file %s", filename);
+        }
+
+      *ptr = export->next;
+      free (export->wsinstance);
+      free (export->filename);
+      free (export);
     }
 
+  pthread_mutex_unlock (&exports.mutex);
+
   free (filename);
 }
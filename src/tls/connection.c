@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -45,15 +46,24 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#define HAVE_KTLS 1
+#endif
+
 #include <common/cockpitfdpassing.h>
 #include <common/cockpitjsonprint.h>
 #include <common/cockpitmemory.h>
+#include <common/cockpitproxyheader.h>
 #include <common/cockpitwebcertificate.h>
 
+#include "buffer-pool.h"
 #include "certificate.h"
 #include "client-certificate.h"
 #include "httpredirect.h"
+#include "session-cache.h"
 #include "socket-io.h"
+#include "stats.h"
 #include "utils.h"
 
 /* cockpit-tls TCP server state (singleton) */
@@ -61,6 +71,7 @@ static struct {
   gnutls_certificate_request_t request_mode;
   Certificate *certificate;
   bool require_https;
+  bool proxy_header;
   int wsinstance_sockdir;
   int cert_session_dir;
 } parameters = {
@@ -70,16 +81,67 @@ static struct {
 
 typedef struct
 {
-  char buffer[16u << 10]; /* 16KiB */
+  /* from the buffer pool, only while there is data in it; NULL otherwise */
+  char *buffer;
+  unsigned size; /* 0, BUFFER_POOL_SMALL or BUFFER_POOL_LARGE */
   unsigned start, end;
   bool eof, shut_rd, shut_wr;
+  bool bulk; /* the last read filled the buffer: use a large one next time */
+
+  /* With kTLS, data gets spliced through this pipe instead, as long as
+   * the ring buffer is empty.  Whatever is in the pipe always comes
+   * before what is in the ring buffer.  pipe[0] is -1 if unused.
+   */
+  int pipe[2];
+  unsigned piped; /* bytes currently in the pipe */
+  unsigned pipe_size;
+  bool pipe_full;
+
+  /* Only for writing to TLS: GnuTLS still holds a record for us which
+   * it couldn't send yet (from the ring buffer, or already taken out of
+   * it, if corked), how much we sent since the last pause, and when we
+   * last sent something.
+   */
+  bool tls_pending;
+  bool tls_corked;
+  unsigned tls_sent;
+  uint64_t tls_last_write_ms;
+
+  /* NULL until the connection starts proxying */
+  StatsInstance *stats;
+  StatsDirection direction;
 #ifdef DEBUG
   const char *name;
 #endif
 } Buffer;
 
+/* how long to wait for the first byte of a new connection */
+#define FIRST_BYTE_TIMEOUT_MS 30000
+/* how long a TLS handshake may take in event-driven mode; the same as
+ * GnuTLS' default for blocking handshakes */
+#define TLS_HANDSHAKE_TIMEOUT_MS 40000
+
+typedef struct _Connection Connection;
+typedef struct _ConnectionWorker ConnectionWorker;
+
+/* only used in event-driven mode */
+typedef enum {
+  CONNECTION_STATE_WAITING, /* waiting for a handshake slot */
+  CONNECTION_STATE_FIRST_BYTE, /* waiting for the first byte */
+  CONNECTION_STATE_TLS_HANDSHAKE, /* non-blocking TLS handshake in progress */
+  CONNECTION_STATE_CONNECTING, /* waiting for cockpit-ws on a separate thread */
+  CONNECTION_STATE_PROXY, /* shoveling data back and forth */
+} ConnectionState;
+
+/* one of the two fds of a Connection, as registered with a worker's epoll */
+typedef struct
+{
+  Connection *connection;
+  uint32_t events; /* 0 if not registered */
+} Watch;
+
 /* a single TCP connection between the client (browser) and cockpit-tls */
-typedef struct {
+struct _Connection {
   int client_fd;
   int ws_fd;
 
@@ -91,25 +153,123 @@ typedef struct {
   char *client_cert_filename;
   char *wsinstance;
   int metadata_fd;
-} Connection;
 
-#define BUFFER_SIZE (sizeof ((Buffer *) 0)->buffer)
-#define BUFFER_MASK (BUFFER_SIZE - 1)
+  /* whether data gets spliced between the sockets (with kTLS) */
+  bool splice_from_client;
+  bool splice_to_client;
+
+  /* from connection_tls_init() until the handshake is over */
+  bool handshake_pending;
+  struct timespec handshake_start;
+  StatsInstance *stats;
+
+  /* only used in event-driven mode */
+  ConnectionState state;
+  ConnectionWorker *worker;
+  Watch client_watch;
+  Watch ws_watch;
+  short client_revents;
+  short ws_revents;
+  Connection *next; /* in the list of connections with events to dispatch */
+  void *closed_data;
+
+  /* protected by workers.mutex: whether this is in workers.waiting_head,
+   * and whether its worker still has to take it from the incoming list
+   * (only kept up to date while waiting) */
+  bool waiting;
+  bool queued;
+  Connection *next_waiting;
+
+  /* protected by workers.mutex: in the incoming list of our worker; this
+   * is apart from next, as a connection which is already watched by its
+   * worker can be pushed again while it is in the list of ready ones */
+  Connection *next_incoming;
+
+  /* only used while waiting for or holding one of the limited handshake slots */
+  bool handshaking;
+  struct timespec deadline;
+  Connection *next_handshake;
+};
+
+/* a thread running an epoll loop over many Connections */
+struct _ConnectionWorker {
+  pthread_t thread;
+  int epollfd;
+  int eventfd;
+
+  /* protected by workers.mutex */
+  Connection *incoming;
+
+  /* the connections of this worker which are handshaking, or waiting to */
+  Connection *handshakes;
+  Connection *waiting;
+};
+
+/* a dynamic wsinstance activation which is in progress */
+typedef struct _Activation Activation;
+struct _Activation {
+  char *fingerprint;
+  unsigned refs; /* the connection doing the activation, plus the waiting ones */
+  bool done;
+  bool result;
+  Activation *next;
+};
+
+/* activations in progress (singleton) */
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  Activation *list;
+} activations = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
 
-static_assert (!(BUFFER_SIZE & BUFFER_MASK), "buffer size not a power of 2");
+/* event-driven mode state (singleton) */
+static struct {
+  ConnectionWorker *workers;
+  unsigned n_workers;
+  pid_t pid;
+  void (*closed_func) (void *data);
+
+  /* rw, protected by mutex */
+  pthread_mutex_t mutex;
+  bool stopping;
+  unsigned next_worker;
+  unsigned n_handshakes;
+  unsigned max_handshakes; /* 0 for unlimited */
+  Connection *waiting_head; /* waiting for a handshake slot */
+  Connection *waiting_tail;
+} workers;
+
+/* the maximum amount of data in a Buffer */
+#define BUFFER_SIZE BUFFER_POOL_LARGE
+
+static_assert (!(BUFFER_POOL_SMALL & (BUFFER_POOL_SMALL - 1)), "buffer size not a power of 2");
+static_assert (!(BUFFER_SIZE & (BUFFER_SIZE - 1)), "buffer size not a power of 2");
 static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_SIZE, "buffer is too big");
 
 
+static inline bool
+buffer_can_splice (Buffer *self)
+{
+  /* new data may only go into the pipe while the ring buffer is empty */
+  return self->pipe[0] != -1 && self->end == self->start;
+}
+
 static inline bool
 buffer_full (Buffer *self)
 {
+  if (buffer_can_splice (self))
+    return self->pipe_full || self->piped == self->pipe_size;
+
   return self->end - self->start == BUFFER_SIZE;
 }
 
 static inline bool
 buffer_empty (Buffer *self)
 {
-  return self->end == self->start;
+  return self->end == self->start && self->piped == 0 && !self->tls_corked;
 }
 
 static inline bool
@@ -160,17 +320,132 @@ buffer_eof (Buffer *self)
   self->eof = true;
 }
 
+/* Give the memory back as soon as all data has been written */
+static void
+buffer_release_if_empty (Buffer *self)
+{
+  if (self->buffer && self->end == self->start)
+    {
+      buffer_pool_release (self->buffer, self->size);
+      self->buffer = NULL;
+      self->size = 0;
+      self->start = self->end = 0;
+    }
+}
+
 static void
 buffer_epipe (Buffer *self)
 {
   self->start = self->end;
+  self->piped = 0; /* never gets read again */
+  self->tls_pending = self->tls_corked = false;
   self->eof = true;
+
+  buffer_release_if_empty (self);
+}
+
+static bool
+buffer_setup_pipe (Buffer *self)
+{
+  assert (self->pipe[0] == -1);
+
+  if (pipe2 (self->pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      warn ("Failed to create pipe for splicing; copying data instead");
+      self->pipe[0] = self->pipe[1] = -1;
+      return false;
+    }
+
+  int size = fcntl (self->pipe[0], F_GETPIPE_SZ);
+  self->pipe_size = (size > 0) ? size : BUFFER_SIZE;
+
+  return true;
+}
+
+static void
+buffer_free (Buffer *self)
+{
+  if (self->buffer)
+    buffer_pool_release (self->buffer, self->size);
+
+  if (self->pipe[0] != -1)
+    {
+      close (self->pipe[0]);
+      close (self->pipe[1]);
+      self->pipe[0] = self->pipe[1] = -1;
+    }
+}
+
+/* Returns the result of splice(): -1 with errno set on errors */
+static ssize_t
+buffer_splice_in (Buffer *self,
+                  int     fd)
+{
+  ssize_t s;
+
+  assert (buffer_can_splice (self));
+
+  do
+    s = splice (fd, NULL, self->pipe[1], NULL, self->pipe_size - self->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (s == -1 && errno == EINTR);
+
+  debug (BUFFER, "  splice in returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+  if (s > 0)
+    self->piped += s;
+  /* The pipe fills up by pages, not by bytes, so that's the only way to
+   * tell.  If the pipe was empty, there just was no data to read.
+   */
+  else if (s == -1 && errno == EAGAIN && self->piped > 0)
+    self->pipe_full = true;
+
+  return s;
+}
+
+/* Returns the result of splice(): -1 with errno set on errors */
+static ssize_t
+buffer_splice_out (Buffer *self,
+                   int     fd)
+{
+  ssize_t s;
+
+  assert (self->piped > 0);
+
+  do
+    s = splice (self->pipe[0], NULL, fd, NULL, self->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (s == -1 && errno == EINTR);
+
+  debug (BUFFER, "  splice out returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+  if (s > 0)
+    {
+      self->piped -= s;
+      self->pipe_full = false;
+    }
+
+  return s;
 }
 
 static inline bool
 buffer_valid (Buffer *self)
 {
-  return self->end - self->start <= BUFFER_SIZE;
+  return self->end - self->start <= self->size;
+}
+
+/* Account for @size bytes read into the buffer */
+static void
+buffer_count_read (Buffer *self,
+                   size_t  size)
+{
+  stats_add_bytes (self->stats, self->direction, size);
+
+  /* the data comes in faster than it goes out */
+  self->bulk = self->buffer && self->end - self->start == self->size;
+
+  if (buffer_full (self))
+    stats_buffer_full (self->direction);
 }
 
 static short
@@ -191,20 +466,21 @@ static int
 get_iovecs (struct iovec *iov,
             int           iov_length,
             char         *buffer,
+            unsigned      size,
             unsigned      start,
             unsigned      end)
 {
   int i = 0;
 
-  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x)", iov, iov_length, buffer, start, end);
-  assert (end - start <= BUFFER_SIZE);
+  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x, 0x%x)", iov, iov_length, buffer, size, start, end);
+  assert (end - start <= size);
 
   for (i = 0; i < iov_length && start != end; i++)
     {
-      unsigned start_offset = start & BUFFER_MASK;
+      unsigned start_offset = start & (size - 1);
 
       iov[i].iov_base = &buffer[start_offset];
-      iov[i].iov_len = MIN(BUFFER_SIZE - start_offset, end - start);
+      iov[i].iov_len = MIN(size - start_offset, end - start);
       start += iov[i].iov_len;
 
       debug (IOVEC, "    iov[%i] = { 0x%zx, 0x%zx };  start = 0x%x;", i,
@@ -216,6 +492,43 @@ get_iovecs (struct iovec *iov,
   return i;
 }
 
+/* Make sure that there is room for reading more data */
+static void
+buffer_reserve (Buffer *self)
+{
+  unsigned used = self->end - self->start;
+
+  assert (used < BUFFER_SIZE);
+
+  if (self->buffer == NULL)
+    {
+      /* during bulk transfers, fill complete TLS records */
+      self->size = self->bulk ? BUFFER_POOL_LARGE : BUFFER_POOL_SMALL;
+      self->buffer = buffer_pool_acquire (self->size);
+      self->start = self->end = 0;
+    }
+  else if (used == self->size)
+    {
+      /* this isn't just a bit of interactive traffic: get a large one */
+      char *large = buffer_pool_acquire (BUFFER_POOL_LARGE);
+      struct iovec iov[2];
+      size_t offset = 0;
+      int iovcnt = get_iovecs (iov, 2, self->buffer, self->size, self->start, self->end);
+
+      for (int i = 0; i < iovcnt; i++)
+        {
+          memcpy (large + offset, iov[i].iov_base, iov[i].iov_len);
+          offset += iov[i].iov_len;
+        }
+
+      buffer_pool_release (self->buffer, self->size);
+      self->buffer = large;
+      self->size = BUFFER_POOL_LARGE;
+      self->start = 0;
+      self->end = used;
+    }
+}
+
 static void
 buffer_write_to_fd (Buffer *self,
                     int     fd,
@@ -227,9 +540,18 @@ buffer_write_to_fd (Buffer *self,
   debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
 
   struct msghdr msg = { .msg_iov = iov };
-  msg.msg_iovlen = get_iovecs (iov, 2, self->buffer, self->start, self->end);
+  msg.msg_iovlen = get_iovecs (iov, 2, self->buffer, self->size, self->start, self->end);
+
+  if (self->piped > 0)
+    {
+      /* the metadata fd always gets sent before we start splicing */
+      assert (fd_to_send == NULL || *fd_to_send == -1);
 
-  if (msg.msg_iovlen)
+      s = buffer_splice_out (self, fd);
+      if (s == -1 && errno != EAGAIN)
+        buffer_epipe (self);
+    }
+  else if (msg.msg_iovlen)
     {
       struct cmsghdr cmsg[2];
 
@@ -264,6 +586,7 @@ buffer_write_to_fd (Buffer *self,
       buffer_shut_wr (self);
     }
 
+  buffer_release_if_empty (self);
   assert (buffer_valid (self));
 }
 
@@ -282,14 +605,27 @@ buffer_read_from_fd (Buffer *self,
 
   struct iovec iov[2];
   ssize_t s;
-  int iovcnt = get_iovecs (iov, 2, self->buffer, self->end, self->start + BUFFER_SIZE);
-  assert (iovcnt > 0);
 
-  do
-    s = readv (fd, iov, iovcnt);
-  while (s == -1 && errno == EINTR);
+  if (buffer_can_splice (self))
+    {
+      s = buffer_splice_in (self, fd);
+    }
+  else
+    {
+      buffer_reserve (self);
+
+      int iovcnt = get_iovecs (iov, 2, self->buffer, self->size, self->end, self->start + self->size);
+      assert (iovcnt > 0);
+
+      do
+        s = readv (fd, iov, iovcnt);
+      while (s == -1 && errno == EINTR);
+
+      debug (BUFFER, "  readv returns %zi %s", s, (s == -1) ? strerror (errno) : "");
 
-  debug (BUFFER, "  readv returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+      if (s > 0)
+        self->end += s;
+    }
 
   if (s == -1)
     {
@@ -299,35 +635,143 @@ buffer_read_from_fd (Buffer *self,
   else if (s == 0)
     buffer_eof (self);
   else
-    self->end += s;
+    buffer_count_read (self, s);
 
+  buffer_release_if_empty (self);
   assert (buffer_valid (self));
 }
 
+/* How much data to put into the next TLS record */
+static unsigned
+buffer_tls_record_size (Buffer *self)
+{
+  struct timespec now;
+  int r = clock_gettime (CLOCK_MONOTONIC_COARSE, &now);
+  assert (r == 0);
+
+  uint64_t now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  if (now_ms - self->tls_last_write_ms > TLS_RECORD_IDLE_MS)
+    self->tls_sent = 0;
+  self->tls_last_write_ms = now_ms;
+
+  return (self->tls_sent < TLS_RECORD_WARMUP_BYTES) ? TLS_RECORD_SMALL : TLS_RECORD_FULL;
+}
+
 static void
-buffer_write_to_tls (Buffer           *self,
-                     gnutls_session_t  tls)
+buffer_tls_sent (Buffer  *self,
+                 ssize_t  s)
 {
-  struct iovec iov;
+  self->start += s;
+  self->tls_sent += s;
+}
+
+/* Returns the result of gnutls_record_send() or gnutls_record_uncork() */
+static ssize_t
+buffer_send_tls_record (Buffer           *self,
+                        gnutls_session_t  tls)
+{
+  struct iovec iov[2];
   ssize_t s;
 
-  debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
+  if (self->tls_corked)
+    {
+      /* finish sending the record which we gave to GnuTLS last time */
+      do
+        s = gnutls_record_uncork (tls, 0);
+      while (s == GNUTLS_E_INTERRUPTED);
+
+      debug (BUFFER, "  gnutls_record_uncork returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
 
-  if (get_iovecs (&iov, 1, self->buffer, self->start, self->end))
+      self->tls_corked = (s == GNUTLS_E_AGAIN);
+      return s;
+    }
+
+  if (self->tls_pending)
+    {
+      /* same, but the data is still in the ring buffer; the record size
+       * might have changed in the meantime, so let GnuTLS tell us */
+      do
+        s = gnutls_record_send (tls, NULL, 0);
+      while (s == GNUTLS_E_INTERRUPTED);
+
+      debug (BUFFER, "  gnutls_record_send (pending) returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
+
+      self->tls_pending = (s == GNUTLS_E_AGAIN);
+      if (s > 0)
+        buffer_tls_sent (self, s);
+      return s;
+    }
+
+  unsigned record_size = buffer_tls_record_size (self);
+  int iovcnt = get_iovecs (iov, 2, self->buffer, self->size, self->start, MIN (self->end, self->start + record_size));
+  assert (iovcnt > 0);
+
+  /* with kTLS, the kernel makes the records, and we can't cork */
+  if (iovcnt == 1 || self->pipe[0] != -1)
     {
       do
-        s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
+        s = gnutls_record_send (tls, iov[0].iov_base, iov[0].iov_len);
       while (s == GNUTLS_E_INTERRUPTED);
 
       debug (BUFFER, "  gnutls_record_send returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
 
+      self->tls_pending = (s == GNUTLS_E_AGAIN);
+      if (s > 0)
+        buffer_tls_sent (self, s);
+      return s;
+    }
+
+  /* The data wraps around the end of the ring.  Don't send the two
+   * parts as two records: let GnuTLS collect them, and send them as one.
+   * While corked, GnuTLS just copies the data, so this can't block.
+   */
+  gnutls_record_cork (tls);
+  for (int i = 0; i < iovcnt; i++)
+    {
+      s = gnutls_record_send (tls, iov[i].iov_base, iov[i].iov_len);
       if (s < 0)
+        return s;
+
+      assert (s == iov[i].iov_len);
+      buffer_tls_sent (self, s);
+    }
+
+  self->tls_corked = true;
+  return buffer_send_tls_record (self, tls);
+}
+
+static void
+buffer_write_to_tls (Buffer           *self,
+                     gnutls_session_t  tls)
+{
+  ssize_t s;
+
+  debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
+
+  if (self->piped > 0)
+    {
+      /* kTLS: the kernel does the encryption */
+      s = buffer_splice_out (self, gnutls_transport_get_int (tls));
+      if (s == -1 && errno != EAGAIN)
+        buffer_epipe (self);
+    }
+  else
+    {
+      /* Send records until we run out of data or the socket is full.
+       * Without this loop, each one of the small ones would cost us
+       * another round through poll().
+       */
+      while (!buffer_empty (self))
         {
-          if (s != GNUTLS_E_AGAIN)
-            buffer_epipe (self);
+          s = buffer_send_tls_record (self, tls);
+
+          if (s < 0)
+            {
+              if (s != GNUTLS_E_AGAIN)
+                buffer_epipe (self);
+              break;
+            }
         }
-      else
-        self->start += s;
     }
 
   if (buffer_needs_shut_wr (self))
@@ -336,6 +780,7 @@ buffer_write_to_tls (Buffer           *self,
       buffer_shut_wr (self);
     }
 
+  buffer_release_if_empty (self);
   assert (buffer_valid (self));
 }
 
@@ -358,7 +803,27 @@ buffer_read_from_tls (Buffer           *self,
       return;
     }
 
-  int iovcnt = get_iovecs (&iov, 1, self->buffer, self->end, self->start + BUFFER_SIZE);
+  if (buffer_can_splice (self) && gnutls_record_check_pending (tls) == 0)
+    {
+      /* kTLS: the kernel does the decryption, but refuses to splice
+       * anything but application data; GnuTLS handles the other records.
+       */
+      s = buffer_splice_in (self, gnutls_transport_get_int (tls));
+      if (s != -1 || (errno != EINVAL && errno != EIO))
+        {
+          if (s > 0)
+            buffer_count_read (self, s);
+          else if (s == 0 || errno != EAGAIN)
+            buffer_epipe (self);
+
+          assert (buffer_valid (self));
+          return;
+        }
+    }
+
+  buffer_reserve (self);
+
+  int iovcnt = get_iovecs (&iov, 1, self->buffer, self->size, self->end, self->start + self->size);
   assert (iovcnt == 1);
 
   do
@@ -373,8 +838,12 @@ buffer_read_from_tls (Buffer           *self,
         buffer_epipe (self);
     }
   else
-    self->end += s;
+    {
+      self->end += s;
+      buffer_count_read (self, s);
+    }
 
+  buffer_release_if_empty (self);
   assert (buffer_valid (self));
 }
 
@@ -424,6 +893,83 @@ out:
   return status;
 }
 
+/* must be called with activations.mutex held */
+static void
+activation_unref (Activation *activation)
+{
+  if (--activation->refs == 0)
+    {
+      free (activation->fingerprint);
+      free (activation);
+    }
+}
+
+/**
+ * request_dynamic_wsinstance_once: Coalesce concurrent activations
+ *
+ * Browsers open several connections in parallel, and with a client
+ * certificate they all need the same wsinstance.  Only the first one
+ * asks the factory to start it; the others wait for that result instead
+ * of starting their own factory processes.
+ */
+static bool
+request_dynamic_wsinstance_once (const char *fingerprint)
+{
+  Activation *activation;
+  bool result;
+
+  pthread_mutex_lock (&activations.mutex);
+
+  for (activation = activations.list; activation; activation = activation->next)
+    if (strcmp (activation->fingerprint, fingerprint) == 0)
+      break;
+
+  if (activation)
+    {
+      debug (CONNECTION, "  -> activation of %s already in progress; waiting for it", fingerprint);
+
+      activation->refs++;
+      while (!activation->done)
+        pthread_cond_wait (&activations.cond, &activations.mutex);
+
+      result = activation->result;
+      activation_unref (activation);
+
+      pthread_mutex_unlock (&activations.mutex);
+
+      return result;
+    }
+
+  activation = callocx (1, sizeof (Activation));
+  activation->fingerprint = strdupx (fingerprint);
+  activation->refs = 1;
+  activation->next = activations.list;
+  activations.list = activation;
+
+  pthread_mutex_unlock (&activations.mutex);
+
+  result = request_dynamic_wsinstance (fingerprint);
+
+  pthread_mutex_lock (&activations.mutex);
+
+  /* later connections will find the socket, or try again themselves */
+  for (Activation **a = &activations.list; *a; a = &(*a)->next)
+    if (*a == activation)
+      {
+        *a = activation->next;
+        break;
+      }
+
+  activation->result = result;
+  activation->done = true;
+  activation_unref (activation);
+  pthread_cond_broadcast (&activations.cond);
+
+  pthread_mutex_unlock (&activations.mutex);
+
+  return result;
+}
+
 static bool
 connection_connect_to_dynamic_wsinstance (Connection *self)
 {
@@ -446,7 +992,7 @@ connection_connect_to_dynamic_wsinstance (Connection *self)
 
   debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
   /* otherwise, ask for the instance to be started */
-  if (!request_dynamic_wsinstance (self->wsinstance))
+  if (!request_dynamic_wsinstance_once (self->wsinstance))
     return false;
 
   /* ... and try one more time. */
@@ -503,12 +1049,18 @@ connection_is_to_localhost (Connection *self)
     }
 }
 
+static bool
+connection_needs_redirect (Connection *self)
+{
+  /* server is expecting https connections, but localhost is exempt */
+  return self->tls == NULL && parameters.require_https && !connection_is_to_localhost (self);
+}
+
 static bool
 connection_connect_to_wsinstance (Connection *self)
 {
-  if (self->tls == NULL && parameters.require_https && !connection_is_to_localhost (self))
+  if (connection_needs_redirect (self))
     {
-      /* server is expecting https connections */
       self->ws_fd = http_redirect_connect ();
       if (self->ws_fd == -1)
         {
@@ -542,128 +1094,288 @@ connection_connect_to_wsinstance (Connection *self)
 }
 
 /**
- * connection_handshake: Handle first event on client fd
+ * connection_try_connect_to_wsinstance: Connect without blocking
  *
- * Check the very first byte of a new connection to tell apart TLS from plain
- * HTTP. Initialize TLS.
+ * This only succeeds if the cockpit-ws instance is already running and
+ * can accept the connection immediately.  Otherwise, nothing happened,
+ * and connection_connect_to_wsinstance() needs to be used.
  */
 static bool
-connection_handshake (Connection *self)
+connection_try_connect_to_wsinstance (Connection *self)
 {
-  char b;
-  int ret;
+  char sockname[80];
+  int r;
 
-  assert (self->ws_fd == -1);
+  if (connection_needs_redirect (self))
+    return connection_connect_to_wsinstance (self);
 
-  /* Wait for up to 30 seconds to receive the first byte before shutting
-   * down the connection.
-   */
-  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
-  do
-    ret = poll (&pfd, 1, 30000); /* timeout is wrong on syscall restart, but it's fine */
-  while (ret == -1 && errno == EINTR);
+  if (self->tls == NULL)
+    r = snprintf (sockname, sizeof sockname, "http.sock");
+  else
+    r = snprintf (sockname, sizeof sockname, "https@%s.sock", self->wsinstance);
+  assert (0 < r && r < sizeof sockname);
 
-  if (ret < 0)
-    err (EXIT_FAILURE, "poll() failed on client connection");
+  self->ws_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (self->ws_fd == -1)
+    return false;
 
-  if (ret == 0)
-    {
-      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
-      return false;
-    }
+  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) == 0)
+    return true;
+
+  debug (CONNECTION, "  -> connect(%s) would block or failed (%m)", sockname);
+  close (self->ws_fd);
+  self->ws_fd = -1;
+
+  return false;
+}
+
+typedef enum {
+  FIRST_BYTE_ERROR,
+  FIRST_BYTE_AGAIN,
+  FIRST_BYTE_PLAIN,
+  FIRST_BYTE_TLS,
+} FirstByte;
+
+/**
+ * connection_check_first_byte: Tell apart TLS from plain HTTP
+ *
+ * Peek the first byte and see if it's a TLS connection (starting with
+ * 22).  On a non-blocking fd, this can return %FIRST_BYTE_AGAIN.
+ */
+static FirstByte
+connection_check_first_byte (Connection *self)
+{
+  char b;
+  int ret;
 
-  /* peek the first byte and see if it's a TLS connection (starting with 22).
-     We can assume that there is some data to read, as this is called in response
-     to an epoll event. */
   ret = recv (self->client_fd, &b, 1, MSG_PEEK);
 
   if (ret < 0)
     {
+      if (errno == EAGAIN || errno == EINTR)
+        return FIRST_BYTE_AGAIN;
+
       debug (CONNECTION, "could not read first byte: %s", strerror (errno));
-      return false;
+      return FIRST_BYTE_ERROR;
     }
 
   if (ret == 0) /* EOF */
     {
       debug (CONNECTION, "client disconnected without sending any data");
-      return false;
+      return FIRST_BYTE_ERROR;
     }
 
-  if (b == 22)
+  if (b != 22)
+    return FIRST_BYTE_PLAIN;
+
+  debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+  return FIRST_BYTE_TLS;
+}
+
+static bool
+connection_tls_init (Connection *self)
+{
+  int ret;
+
+  if (parameters.certificate == NULL)
     {
-      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+      warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
+      return false;
+    }
 
-      if (parameters.certificate == NULL)
-        {
-          warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
-          return false;
-        }
+  ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  ret = gnutls_set_default_priority (self->tls);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_set_default_priority (self->tls);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
+                                certificate_get_credentials (parameters.certificate));
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
-                                    certificate_get_credentials (parameters.certificate));
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  gnutls_session_set_verify_function (self->tls, client_certificate_verify);
+  gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
+  gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+  gnutls_transport_set_int (self->tls, self->client_fd);
+  session_cache_setup (self->tls);
 
-      gnutls_session_set_verify_function (self->tls, client_certificate_verify);
-      gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
-      gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
-      gnutls_transport_set_int (self->tls, self->client_fd);
+  stats_handshake_started (&self->handshake_start);
+  self->handshake_pending = true;
 
-      debug (CONNECTION, "TLS is initialised; doing handshake");
+  debug (CONNECTION, "TLS is initialised; doing handshake");
 
-      do
-        ret = gnutls_handshake (self->tls);
-      while (ret == GNUTLS_E_INTERRUPTED);
+  return true;
+}
 
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+/* Account for the end of the handshake, successful or not */
+static void
+connection_tls_handshake_over (Connection *self,
+                               int         result)
+{
+  if (self->handshake_pending)
+    {
+      stats_handshake_finished (&self->handshake_start, result);
+      self->handshake_pending = false;
+    }
+}
+
+static bool
+connection_tls_handshake_finish (Connection *self)
+{
+  debug (CONNECTION, "TLS handshake completed");
+
+  connection_tls_handshake_over (self, GNUTLS_E_SUCCESS);
+  session_cache_handshake_done (self->tls);
+
+  return client_certificate_accept (self->tls, parameters.cert_session_dir,
+                                    &self->wsinstance, &self->client_cert_filename);
+}
+
+/**
+ * connection_handshake: Handle first event on client fd
+ *
+ * Check the very first byte of a new connection to tell apart TLS from plain
+ * HTTP. Initialize TLS.
+ */
+static bool
+connection_handshake (Connection *self)
+{
+  int ret;
+
+  assert (self->ws_fd == -1);
+
+  /* Wait for up to 30 seconds to receive the first byte before shutting
+   * down the connection.
+   */
+  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
+  do
+    ret = poll (&pfd, 1, FIRST_BYTE_TIMEOUT_MS); /* timeout is wrong on syscall restart, but it's fine */
+  while (ret == -1 && errno == EINTR);
 
-      debug (CONNECTION, "TLS handshake completed");
+  if (ret < 0)
+    err (EXIT_FAILURE, "poll() failed on client connection");
 
-      if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
-                                      &self->wsinstance, &self->client_cert_filename))
-        return false;
+  if (ret == 0)
+    {
+      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
+      return false;
     }
 
-  return true;
+  /* We can assume that there is some data to read, as poll() said so. */
+  switch (connection_check_first_byte (self))
+    {
+    case FIRST_BYTE_PLAIN:
+      stats_connection_plain ();
+      return true;
+
+    case FIRST_BYTE_TLS:
+      break;
+
+    default:
+      return false;
+    }
+
+  if (!connection_tls_init (self))
+    return false;
+
+  do
+    ret = gnutls_handshake (self->tls);
+  while (ret == GNUTLS_E_INTERRUPTED);
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+      connection_tls_handshake_over (self, ret);
+      return false;
+    }
+
+  return connection_tls_handshake_finish (self);
+}
+
+static bool
+connection_alive (Connection *self)
+{
+  return buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer);
+}
+
+/**
+ * connection_calculate_events: Determine what to wait for
+ *
+ * The @client_events and @ws_events are the poll() events that we need
+ * to wait for on the two fds.  @client_revents and @ws_revents are the
+ * events which are ready to be handled without waiting at all.
+ */
+static void
+connection_calculate_events (Connection *self,
+                             short      *client_events,
+                             short      *ws_events,
+                             short      *client_revents,
+                             short      *ws_revents)
+{
+  *client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+  *ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+  *client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+  *ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+
+  if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
+    *client_revents |= POLLIN * (gnutls_record_check_pending (self->tls) > 0);
+}
+
+static void
+connection_handle_events (Connection *self,
+                          short       client_revents,
+                          short       ws_revents)
+{
+  if (self->tls)
+    {
+      if (client_revents & POLLIN)
+        buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
+
+      if (client_revents & POLLOUT)
+        buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
+    }
+  else
+    {
+      if (client_revents & POLLIN)
+        buffer_read_from_fd (&self->client_to_ws_buffer, self->client_fd);
+
+      if (client_revents & POLLOUT)
+        buffer_write_to_fd (&self->ws_to_client_buffer, self->client_fd, NULL);
+    }
+
+  if (ws_revents & POLLIN)
+    buffer_read_from_fd (&self->ws_to_client_buffer, self->ws_fd);
+
+  if (ws_revents & POLLOUT)
+    buffer_write_to_fd (&self->client_to_ws_buffer, self->ws_fd, &self->metadata_fd);
+
+  /* the metadata fd needs to go along with the first data */
+  if (self->splice_from_client && self->client_to_ws_buffer.pipe[0] == -1 && self->metadata_fd == -1)
+    self->splice_from_client = buffer_setup_pipe (&self->client_to_ws_buffer);
 }
 
 static void
 connection_thread_loop (Connection *self)
 {
-  while (buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer))
+  while (connection_alive (self))
     {
       short client_events, ws_events;
       short client_revents, ws_revents;
       int n_ready;
 
-      client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-      client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-
-      if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
-        client_revents |= POLLIN * gnutls_record_check_pending (self->tls);
+      connection_calculate_events (self, &client_events, &ws_events, &client_revents, &ws_revents);
 
       debug (POLL, "poll | client %d/x%x/x%x | ws %d/x%x/x%x |",
              self->client_fd, client_events, client_revents,
@@ -692,34 +1404,54 @@ connection_thread_loop (Connection *self)
       debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
              self->client_fd, client_revents, self->ws_fd, ws_revents);
 
-      if (self->tls)
-        {
-          if (client_revents & POLLIN)
-            buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
+      connection_handle_events (self, client_revents, ws_revents);
+    }
+}
 
-          if (client_revents & POLLOUT)
-            buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
-        }
-      else
-        {
-          if (client_revents & POLLIN)
-            buffer_read_from_fd (&self->client_to_ws_buffer, self->client_fd);
+/**
+ * connection_create_proxy_header: Put the metadata in front of the data
+ *
+ * This is the cheaper alternative to the metadata memfd: the PROXY
+ * protocol header goes into the (still empty) client-to-ws buffer, and
+ * cockpit-ws takes it apart again before it starts reading the request.
+ */
+static bool
+connection_create_proxy_header (Connection                    *self,
+                                const struct sockaddr_storage *addr)
+{
+  Buffer *buffer = &self->client_to_ws_buffer;
+  struct sockaddr_storage local;
+  socklen_t localsize = sizeof local;
 
-          if (client_revents & POLLOUT)
-            buffer_write_to_fd (&self->ws_to_client_buffer, self->client_fd, NULL);
-        }
+  if (getsockname (self->client_fd, (struct sockaddr *) &local, &localsize))
+    {
+      debug (CONNECTION, "getsockname(%i) failed: %m.  Disconnecting.", self->client_fd);
+      return false;
+    }
 
-      if (ws_revents & POLLIN)
-        buffer_read_from_fd (&self->ws_to_client_buffer, self->ws_fd);
+  assert (buffer->buffer == NULL);
+  buffer_reserve (buffer);
 
-      if (ws_revents & POLLOUT)
-        buffer_write_to_fd (&self->client_to_ws_buffer, self->ws_fd, &self->metadata_fd);
+  size_t length = cockpit_proxy_header_build ((unsigned char *) buffer->buffer, buffer->size,
+                                              (const struct sockaddr *) addr, (const struct sockaddr *) &local,
+                                              self->client_cert_filename);
+  if (length > buffer->size)
+    {
+      debug (CONNECTION, "PROXY header for fd %i does not fit into a buffer.  Disconnecting.", self->client_fd);
+      return false;
     }
+
+  buffer->end += length;
+  return true;
 }
 
 static bool
 connection_create_metadata (Connection *self)
 {
+  /* httpredirect only wants the request, and would choke on a PROXY header */
+  if (connection_needs_redirect (self))
+    return true;
+
   struct sockaddr_storage addr;
   socklen_t addrsize = sizeof addr;
   if (getpeername (self->client_fd, (struct sockaddr *) &addr, &addrsize))
@@ -728,6 +1460,9 @@ connection_create_metadata (Connection *self)
       return false;
     }
 
+  if (parameters.proxy_header)
+    return connection_create_proxy_header (self, &addr);
+
   /* maximum we're going to see */
   char ip[INET6_ADDRSTRLEN + 1 + IF_NAMESIZE + 1];
   in_port_t port;
@@ -798,117 +1533,1050 @@ connection_create_metadata (Connection *self)
   return true;
 }
 
-void
-connection_thread_main (int fd)
+static Connection *
+connection_new (int fd)
 {
-  Connection self = { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1 };
-
-  assert (!buffer_can_write (&self.client_to_ws_buffer));
-  assert (!buffer_can_write (&self.ws_to_client_buffer));
-  assert (!self.tls);
+  Connection *self = callocx (1, sizeof (Connection));
+
+  self->client_fd = fd;
+  self->ws_fd = -1;
+  self->metadata_fd = -1;
+  self->client_watch.connection = self;
+  self->ws_watch.connection = self;
+  self->client_to_ws_buffer.pipe[0] = self->client_to_ws_buffer.pipe[1] = -1;
+  self->ws_to_client_buffer.pipe[0] = self->ws_to_client_buffer.pipe[1] = -1;
+  self->client_to_ws_buffer.direction = STATS_CLIENT_TO_WS;
+  self->ws_to_client_buffer.direction = STATS_WS_TO_CLIENT;
+
+  assert (!buffer_can_write (&self->client_to_ws_buffer));
+  assert (!buffer_can_write (&self->ws_to_client_buffer));
+  assert (!self->tls);
 
 #ifdef DEBUG
-  self.client_to_ws_buffer.name = "client-to-ws";
-  self.ws_to_client_buffer.name = "ws-to-client";
+  self->client_to_ws_buffer.name = "client-to-ws";
+  self->ws_to_client_buffer.name = "ws-to-client";
 #endif
 
-  debug (CONNECTION, "New thread for fd %i", fd);
+  return self;
+}
 
-  if (connection_handshake (&self) &&
-      connection_create_metadata (&self) &&
-      connection_connect_to_wsinstance (&self))
-    connection_thread_loop (&self);
+static void
+connection_free (Connection *self)
+{
+  /* only when the workers get stopped during the handshake */
+  connection_tls_handshake_over (self, GNUTLS_E_PREMATURE_TERMINATION);
 
-  debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
+  if (self->stats)
+    stats_instance_unref (self->stats);
 
-  free (self.wsinstance);
+  free (self->wsinstance);
 
-  if (self.client_cert_filename)
-    client_certificate_unlink_and_free (parameters.cert_session_dir, self.client_cert_filename);
+  if (self->client_cert_filename)
+    client_certificate_unlink_and_free (parameters.cert_session_dir, self->client_cert_filename);
+
+  if (self->tls)
+    gnutls_deinit (self->tls);
 
-  if (self.tls)
-    gnutls_deinit (self.tls);
+  if (self->client_fd != -1)
+    close (self->client_fd);
 
-  if (self.client_fd != -1)
-    close (self.client_fd);
+  if (self->ws_fd != -1)
+    close (self->ws_fd);
 
-  if (self.ws_fd != -1)
-    close (self.ws_fd);
+  if (self->metadata_fd != -1)
+    close (self->metadata_fd);
 
-  if (self.metadata_fd != -1)
-    close (self.metadata_fd);
+  buffer_free (&self->client_to_ws_buffer);
+  buffer_free (&self->ws_to_client_buffer);
+
+  free (self);
 }
 
 /**
- * connection_crypto_init: Initialise TLS support
+ * connection_setup_splice: Avoid copying data if possible
  *
- * This should be called after server_init() in order to enable TLS
- * support for connections. If this function is not called, the server
- * will only be able to handle http requests.
- *
- * The certificate file must either contain the key as well, or end with
- * "*.crt" or "*.cert" and have a corresponding "*.key" file.
+ * If GnuTLS handed the session keys over to the kernel (kTLS), the
+ * kernel does the symmetric crypto, and we can forward data between the
+ * client and the cockpit-ws socket with splice() through a pipe, without
+ * ever copying it into our buffers.  This can be the case for only one
+ * direction.  The buffers are still used for anything that can't be
+ * spliced, like data which GnuTLS already decrypted during the
+ * handshake.
  *
- * @certfile: Server TLS certificate file; cannot be %NULL
- * @request_mode: Whether to ask for client certificates
+ * splice() can block on the sockets themselves, so they become
+ * non-blocking.  Returns %false if that fails.
  */
-void
-connection_crypto_init (const char *certificate_filename,
-                        const char *key_filename,
-                        bool allow_unencrypted,
-                        gnutls_certificate_request_t request_mode)
+static bool
+connection_setup_splice (Connection *self)
 {
-  parameters.certificate = certificate_load (certificate_filename, key_filename);
-  parameters.request_mode = request_mode;
-  /* If we aren't called, then require_https is false */
-  parameters.require_https = !allow_unencrypted;
+#ifdef HAVE_KTLS
+  if (!self->tls)
+    return true;
+
+  gnutls_transport_ktls_enable_flags_t ktls = gnutls_transport_is_ktls_enabled (self->tls);
+
+  debug (CONNECTION, "kTLS for fd %i: recv %s, send %s", self->client_fd,
+         (ktls & GNUTLS_KTLS_RECV) ? "yes" : "no", (ktls & GNUTLS_KTLS_SEND) ? "yes" : "no");
+
+  if (ktls == 0)
+    return true;
+
+  if (fcntl (self->client_fd, F_SETFL, fcntl (self->client_fd, F_GETFL) | O_NONBLOCK) != 0 ||
+      fcntl (self->ws_fd, F_SETFL, fcntl (self->ws_fd, F_GETFL) | O_NONBLOCK) != 0)
+    {
+      warn ("Failed to make connection non-blocking");
+      return false;
+    }
+
+  /* the pipe for this one gets set up in connection_handle_events() */
+  self->splice_from_client = (ktls & GNUTLS_KTLS_RECV) != 0;
+
+  if (ktls & GNUTLS_KTLS_SEND)
+    self->splice_to_client = buffer_setup_pipe (&self->ws_to_client_buffer);
+#endif
+
+  return true;
 }
 
-void
-connection_set_directories (const char *wsinstance_sockdir,
-                            const char *runtime_directory)
+/* Start accounting the traffic to the cockpit-ws instance */
+static void
+connection_start_stats (Connection *self)
 {
-  assert (parameters.wsinstance_sockdir == -1);
-  assert (parameters.cert_session_dir == -1);
+  const char *name = self->wsinstance;
 
-  assert (wsinstance_sockdir != NULL);
-  assert (runtime_directory != NULL);
+  if (name == NULL)
+    name = connection_needs_redirect (self) ? "http-redirect" : "http";
 
-  parameters.wsinstance_sockdir = open (wsinstance_sockdir, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-  if (parameters.wsinstance_sockdir == -1)
-    err (EXIT_FAILURE, "Unable to open wsinstance sockdir %s", wsinstance_sockdir);
+  self->stats = stats_instance_ref (name);
+  self->client_to_ws_buffer.stats = self->stats;
+  self->ws_to_client_buffer.stats = self->stats;
+}
 
-  int runtimedir_fd = open (runtime_directory, O_PATH | O_DIRECTORY | O_NOFOLLOW);
-  if (runtimedir_fd == -1)
-    err (EXIT_FAILURE, "Unable to open runtime directory %s", runtime_directory);
+/**
+ * connection_setup: Prepare a new connection for proxying
+ *
+ * Does the TLS handshake (if any), and connects to the correct
+ * cockpit-ws instance.  This blocks.
+ */
+static bool
+connection_setup (Connection *self)
+{
+  return connection_handshake (self) &&
+         connection_create_metadata (self) &&
+         connection_connect_to_wsinstance (self) &&
+         connection_setup_splice (self);
+}
 
-  if (mkdirat (runtimedir_fd, "clients", 0700) != 0)
-    err (EXIT_FAILURE, "mkdir: %s/clients", runtime_directory);
+void
+connection_thread_main (int fd)
+{
+  Connection *self = connection_new (fd);
 
-  parameters.cert_session_dir = openat (runtimedir_fd, "clients", O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-  if (parameters.cert_session_dir == -1)
-    err (EXIT_FAILURE, "Unable to open certificate directory %s/clients", runtime_directory);
+  debug (CONNECTION, "New thread for fd %i", fd);
 
-  close (runtimedir_fd);
+  if (connection_setup (self))
+    {
+      connection_start_stats (self);
+      connection_thread_loop (self);
+    }
+
+  debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
+
+  connection_free (self);
 }
 
-void
-connection_cleanup (void)
+/***********************************
+ *
+ * Event-driven mode
+ *
+ ***********************************/
+
+static void
+connection_set_deadline (Connection *self,
+                         int         timeout_ms)
 {
-  assert (parameters.wsinstance_sockdir != -1);
-  assert (parameters.cert_session_dir != -1);
+  int r = clock_gettime (CLOCK_MONOTONIC, &self->deadline);
+  assert (r == 0);
 
-  if (parameters.certificate)
+  self->deadline.tv_sec += timeout_ms / 1000;
+  self->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (self->deadline.tv_nsec >= 1000000000L)
     {
-      certificate_unref (parameters.certificate);
-      parameters.certificate = NULL;
+      self->deadline.tv_sec++;
+      self->deadline.tv_nsec -= 1000000000L;
     }
+}
 
-  parameters.require_https = false;
+/* the time left until the deadline of @self, as of @now */
+static int64_t
+connection_remaining_ms (Connection            *self,
+                         const struct timespec *now)
+{
+  return ((int64_t) self->deadline.tv_sec - now->tv_sec) * 1000 +
+         (self->deadline.tv_nsec - now->tv_nsec) / 1000000;
+}
 
-  close (parameters.cert_session_dir);
-  parameters.cert_session_dir = -1;
+static void
+connection_worker_watch (Connection *self,
+                         Watch      *watch,
+                         int         fd,
+                         uint32_t    events)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = watch };
+  int op;
 
-  close (parameters.wsinstance_sockdir);
-  parameters.wsinstance_sockdir = -1;
+  if (events == watch->events)
+    return;
+
+  /* don't keep fds with no events registered: we'd get woken up for
+   * EPOLLHUP over and over again otherwise
+   */
+  if (watch->events == 0)
+    op = EPOLL_CTL_ADD;
+  else if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  if (epoll_ctl (self->worker->epollfd, op, fd, &ev) != 0)
+    err (EXIT_FAILURE, "Failed to update epoll for connection fd %i", fd);
+
+  watch->events = events;
+}
+
+/* must be called with workers.mutex held */
+static void
+connection_worker_push_locked (Connection *self)
+{
+  const uint64_t one = 1;
+
+  if (self->worker == NULL)
+    self->worker = &workers.workers[workers.next_worker++ % workers.n_workers];
+
+  self->next_incoming = self->worker->incoming;
+  self->worker->incoming = self;
+  self->queued = true;
+
+  if (write (self->worker->eventfd, &one, sizeof one) < 0)
+    err (EXIT_FAILURE, "Failed to wake up worker");
+}
+
+static void
+connection_worker_push (Connection *self)
+{
+  pthread_mutex_lock (&workers.mutex);
+  connection_worker_push_locked (self);
+  pthread_mutex_unlock (&workers.mutex);
+}
+
+/* unlinks @self from a list of connections chained by next_handshake */
+static void
+connection_list_remove (Connection **list,
+                        Connection  *self)
+{
+  for (Connection **link = list; *link; link = &(*link)->next_handshake)
+    if (*link == self)
+      {
+        *link = self->next_handshake;
+        self->next_handshake = NULL;
+        break;
+      }
+}
+
+/**
+ * connection_worker_end_handshake: Give up our handshake slot
+ *
+ * If there are connections waiting for a slot, the oldest one takes it
+ * over.  Must be called from the worker thread of @self.
+ */
+static void
+connection_worker_end_handshake (Connection *self)
+{
+  if (!self->handshaking)
+    return;
+
+  self->handshaking = false;
+  connection_list_remove (&self->worker->handshakes, self);
+
+  pthread_mutex_lock (&workers.mutex);
+
+  Connection *waiting = workers.waiting_head;
+  if (waiting)
+    {
+      debug (CONNECTION, "Handshake slot goes to waiting connection fd %i", waiting->client_fd);
+
+      workers.waiting_head = waiting->next_waiting;
+      if (workers.waiting_head == NULL)
+        workers.waiting_tail = NULL;
+      waiting->next_waiting = NULL;
+      waiting->waiting = false;
+
+      /* its worker takes it from here; unless it didn't even get to it yet */
+      waiting->handshaking = true;
+      if (!waiting->queued)
+        connection_worker_push_locked (waiting);
+    }
+  else
+    workers.n_handshakes--;
+
+  pthread_mutex_unlock (&workers.mutex);
+}
+
+static void
+connection_worker_finish (Connection *self)
+{
+  debug (CONNECTION, "Connection fd %i is finished", self->client_fd);
+
+  connection_worker_end_handshake (self);
+
+  if (self->worker)
+    {
+      connection_worker_watch (self, &self->client_watch, self->client_fd, 0);
+      connection_worker_watch (self, &self->ws_watch, self->ws_fd, 0);
+    }
+
+  void *closed_data = self->closed_data;
+  connection_free (self);
+  workers.closed_func (closed_data);
+}
+
+/**
+ * connection_worker_drop_waiting: Give up on a connection in the queue
+ *
+ * Unless it just got its handshake slot, in which case it is already
+ * on its way back to us through the incoming list.
+ */
+static void
+connection_worker_drop_waiting (Connection *self)
+{
+  pthread_mutex_lock (&workers.mutex);
+
+  bool waiting = self->waiting;
+  if (waiting)
+    {
+      Connection *prev = NULL;
+
+      for (Connection *c = workers.waiting_head; c != self; c = c->next_waiting)
+        prev = c;
+
+      if (prev)
+        prev->next_waiting = self->next_waiting;
+      else
+        workers.waiting_head = self->next_waiting;
+      if (workers.waiting_tail == self)
+        workers.waiting_tail = prev;
+
+      self->next_waiting = NULL;
+      self->waiting = false;
+    }
+
+  pthread_mutex_unlock (&workers.mutex);
+
+  if (!waiting)
+    return;
+
+  connection_list_remove (&self->worker->waiting, self);
+  connection_worker_finish (self);
+}
+
+/**
+ * connection_worker_wait: Handle the client while it waits for a slot
+ *
+ * We only listen for the client going away, so that it doesn't keep its
+ * place in the queue.  A client which sent its request and then shut
+ * down its side is fine though: it just doesn't get watched any more.
+ */
+static void
+connection_worker_wait (Connection *self)
+{
+  ssize_t s;
+  char b;
+
+  self->client_revents = 0;
+
+  do
+    s = recv (self->client_fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+  while (s == -1 && errno == EINTR);
+
+  if (s > 0)
+    connection_worker_watch (self, &self->client_watch, self->client_fd, 0);
+  else if (s == 0 || errno != EAGAIN)
+    {
+      debug (CONNECTION, "client fd %i went away while waiting for a handshake slot", self->client_fd);
+      connection_worker_drop_waiting (self);
+    }
+}
+
+/**
+ * connection_worker_proxy: Run a proxying Connection until it would block
+ *
+ * This is the event-driven equivalent of one iteration of
+ * connection_thread_loop(): handle the events that epoll reported,
+ * then any events that are ready without waiting, and finally update
+ * the epoll registration for what we need to wait for next.
+ */
+static void
+connection_worker_proxy (Connection *self)
+{
+  short client_events, ws_events;
+  short client_revents = self->client_revents;
+  short ws_revents = self->ws_revents;
+
+  self->client_revents = self->ws_revents = 0;
+
+  for (;;)
+    {
+      debug (POLL, "dispatch | client %d/x%x | ws %d/x%x |",
+             self->client_fd, client_revents, self->ws_fd, ws_revents);
+
+      connection_handle_events (self, client_revents, ws_revents);
+
+      if (!connection_alive (self))
+        {
+          connection_worker_finish (self);
+          return;
+        }
+
+      connection_calculate_events (self, &client_events, &ws_events, &client_revents, &ws_revents);
+      if (!(client_revents | ws_revents))
+        break;
+    }
+
+  /* poll() and epoll() event flags have the same values */
+  connection_worker_watch (self, &self->client_watch, self->client_fd, client_events);
+  connection_worker_watch (self, &self->ws_watch, self->ws_fd, ws_events);
+}
+
+static void
+connection_worker_start_proxy (Connection *self)
+{
+  /* a worker must never block on any single connection */
+  if (fcntl (self->ws_fd, F_SETFL, fcntl (self->ws_fd, F_GETFL) | O_NONBLOCK) != 0)
+    {
+      warn ("Failed to make cockpit-ws connection non-blocking");
+      connection_worker_finish (self);
+      return;
+    }
+
+  if (!connection_setup_splice (self))
+    {
+      connection_worker_finish (self);
+      return;
+    }
+
+  self->state = CONNECTION_STATE_PROXY;
+  connection_start_stats (self);
+  connection_worker_proxy (self);
+}
+
+static void *
+connection_connect_thread_main (void *data)
+{
+  Connection *self = data;
+
+  debug (CONNECTION, "Connecting fd %i to cockpit-ws on a separate thread", self->client_fd);
+
+  if (connection_connect_to_wsinstance (self))
+    connection_worker_push (self);
+  else
+    connection_worker_finish (self);
+
+  return NULL;
+}
+
+/**
+ * connection_worker_connect: Connect a Connection to its cockpit-ws
+ *
+ * If the cockpit-ws instance is ready, this happens immediately.
+ * Otherwise, we might have to wait for it to be started, so we do that
+ * on a separate short-lived thread, which then hands the Connection
+ * back to us.
+ */
+static void
+connection_worker_connect (Connection *self)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  connection_worker_end_handshake (self);
+
+  if (!connection_create_metadata (self))
+    {
+      connection_worker_finish (self);
+      return;
+    }
+
+  if (connection_try_connect_to_wsinstance (self))
+    {
+      connection_worker_start_proxy (self);
+      return;
+    }
+
+  connection_worker_watch (self, &self->client_watch, self->client_fd, 0);
+  self->state = CONNECTION_STATE_CONNECTING;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  int r = pthread_create (&thread, &attr, connection_connect_thread_main, self);
+  if (r != 0)
+    {
+      errno = r;
+      warn ("pthread_create() failed.  dropping connection");
+      connection_worker_finish (self);
+    }
+
+  pthread_attr_destroy (&attr);
+}
+
+/**
+ * connection_worker_handshake: Make progress on the handshake
+ *
+ * This is the non-blocking, resumable equivalent of
+ * connection_handshake(), called whenever the client fd becomes ready.
+ */
+static void
+connection_worker_handshake (Connection *self)
+{
+  int ret;
+
+  self->client_revents = self->ws_revents = 0;
+
+  if (self->state == CONNECTION_STATE_FIRST_BYTE)
+    {
+      switch (connection_check_first_byte (self))
+        {
+        case FIRST_BYTE_AGAIN:
+          return;
+
+        case FIRST_BYTE_ERROR:
+          connection_worker_finish (self);
+          return;
+
+        case FIRST_BYTE_PLAIN:
+          stats_connection_plain ();
+          connection_worker_connect (self);
+          return;
+
+        case FIRST_BYTE_TLS:
+          break;
+        }
+
+      if (!connection_tls_init (self))
+        {
+          connection_worker_finish (self);
+          return;
+        }
+
+      self->state = CONNECTION_STATE_TLS_HANDSHAKE;
+      connection_set_deadline (self, TLS_HANDSHAKE_TIMEOUT_MS);
+    }
+
+  ret = gnutls_handshake (self->tls);
+
+  if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+    {
+      /* wait for whatever direction GnuTLS got blocked on */
+      connection_worker_watch (self, &self->client_watch, self->client_fd,
+                               gnutls_record_get_direction (self->tls) ? EPOLLOUT : EPOLLIN);
+      return;
+    }
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+      connection_tls_handshake_over (self, ret);
+      connection_worker_finish (self);
+      return;
+    }
+
+  if (!connection_tls_handshake_finish (self))
+    {
+      connection_worker_finish (self);
+      return;
+    }
+
+  connection_worker_connect (self);
+}
+
+static void
+connection_worker_dispatch (Connection *self)
+{
+  switch (self->state)
+    {
+    case CONNECTION_STATE_WAITING:
+      connection_worker_wait (self);
+      break;
+
+    case CONNECTION_STATE_FIRST_BYTE:
+    case CONNECTION_STATE_TLS_HANDSHAKE:
+      connection_worker_handshake (self);
+      break;
+
+    case CONNECTION_STATE_PROXY:
+      connection_worker_proxy (self);
+      break;
+
+    case CONNECTION_STATE_CONNECTING:
+      abort ();
+    }
+}
+
+static void
+connection_worker_start_connection (ConnectionWorker *worker,
+                                    Connection       *self)
+{
+  bool handshaking;
+
+  assert (self->worker == worker);
+
+  switch (self->state)
+    {
+    case CONNECTION_STATE_WAITING:
+      /* from here on, getting a slot means being pushed to us again */
+      pthread_mutex_lock (&workers.mutex);
+      self->queued = false;
+      handshaking = self->handshaking;
+      pthread_mutex_unlock (&workers.mutex);
+
+      connection_list_remove (&worker->waiting, self);
+      if (!handshaking)
+        {
+          self->next_handshake = worker->waiting;
+          worker->waiting = self;
+          connection_worker_watch (self, &self->client_watch, self->client_fd, EPOLLRDHUP);
+          break;
+        }
+
+      self->state = CONNECTION_STATE_FIRST_BYTE;
+      /* fall through */
+
+    case CONNECTION_STATE_FIRST_BYTE:
+      assert (self->handshaking);
+      self->next_handshake = worker->handshakes;
+      worker->handshakes = self;
+      connection_worker_watch (self, &self->client_watch, self->client_fd, EPOLLIN);
+      break;
+
+    case CONNECTION_STATE_CONNECTING:
+      connection_worker_start_proxy (self);
+      break;
+
+    default:
+      abort ();
+    }
+}
+
+/**
+ * connection_worker_check_deadlines: Drop handshakes which take too long
+ *
+ * This includes the time which connections spent waiting for a
+ * handshake slot, as the first byte timeout starts at accept.
+ *
+ * Returns: the number of milliseconds until the next deadline, or -1
+ */
+static int
+connection_worker_check_deadlines (ConnectionWorker *worker)
+{
+  struct timespec now;
+  Connection *self, *next;
+  int timeout = -1;
+
+  if (worker->handshakes == NULL && worker->waiting == NULL)
+    return -1;
+
+  int r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  for (self = worker->waiting; self; self = next)
+    {
+      int64_t remaining = connection_remaining_ms (self, &now);
+
+      next = self->next_handshake;
+
+      if (remaining <= 0)
+        {
+          debug (CONNECTION, "client fd %i did not get a handshake slot in time, dropping connection.",
+                 self->client_fd);
+          connection_worker_drop_waiting (self);
+          /* if it got its slot just now, come back for it right away */
+          timeout = 0;
+        }
+      else if (timeout == -1 || remaining < timeout)
+        timeout = remaining;
+    }
+
+  for (self = worker->handshakes; self; self = next)
+    {
+      int64_t remaining = connection_remaining_ms (self, &now);
+
+      next = self->next_handshake;
+
+      if (remaining <= 0)
+        {
+          debug (CONNECTION, "client fd %i did not complete the handshake in time, dropping connection.",
+                 self->client_fd);
+          connection_tls_handshake_over (self, GNUTLS_E_TIMEDOUT);
+          connection_worker_finish (self);
+        }
+      else if (timeout == -1 || remaining < timeout)
+        timeout = remaining;
+    }
+
+  return timeout;
+}
+
+/**
+ * connection_worker_take_incoming: Handle wakeup of a worker
+ *
+ * Returns: false if the worker should stop, true otherwise
+ */
+static bool
+connection_worker_take_incoming (ConnectionWorker *worker)
+{
+  Connection *incoming;
+  uint64_t value;
+  bool stopping;
+
+  if (read (worker->eventfd, &value, sizeof value) < 0 && errno != EAGAIN)
+    err (EXIT_FAILURE, "Failed to read worker eventfd");
+
+  pthread_mutex_lock (&workers.mutex);
+  incoming = worker->incoming;
+  worker->incoming = NULL;
+  stopping = workers.stopping;
+  pthread_mutex_unlock (&workers.mutex);
+
+  while (incoming)
+    {
+      Connection *self = incoming;
+      incoming = self->next_incoming;
+      self->next_incoming = NULL;
+
+      connection_worker_start_connection (worker, self);
+    }
+
+  return !stopping;
+}
+
+static void *
+connection_worker_main (void *data)
+{
+  ConnectionWorker *worker = data;
+  struct epoll_event events[64];
+
+  for (;;)
+    {
+      Connection *ready = NULL;
+      int n_ready;
+
+      n_ready = epoll_wait (worker->epollfd, events, N_ELEMENTS (events),
+                            connection_worker_check_deadlines (worker));
+      if (n_ready == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          err (EXIT_FAILURE, "Failed to epoll_wait in worker");
+        }
+
+      /* Collect the events per connection first: dispatching may free
+       * a connection that still has another event in this batch.
+       */
+      for (int i = 0; i < n_ready; i++)
+        {
+          Watch *watch = events[i].data.ptr;
+          uint32_t revents = events[i].events;
+
+          if (watch == NULL)
+            {
+              if (!connection_worker_take_incoming (worker))
+                return NULL;
+              continue;
+            }
+
+          Connection *self = watch->connection;
+
+          /* errors and hangups get handled by the next read or write */
+          if (revents & (EPOLLHUP | EPOLLERR))
+            revents |= watch->events;
+          revents &= watch->events;
+          if (revents == 0)
+            continue;
+
+          if (!(self->client_revents | self->ws_revents))
+            {
+              self->next = ready;
+              ready = self;
+            }
+
+          if (watch == &self->client_watch)
+            self->client_revents |= revents;
+          else
+            self->ws_revents |= revents;
+        }
+
+      while (ready)
+        {
+          Connection *self = ready;
+          ready = self->next;
+          self->next = NULL;
+
+          connection_worker_dispatch (self);
+        }
+    }
+}
+
+/**
+ * connection_workers_start: Enable event-driven mode
+ *
+ * Starts @n_workers threads, each of which runs an epoll loop over the
+ * connections which were assigned to it, instead of having one thread
+ * per connection.  The TLS handshake is done without blocking in that
+ * loop as well.  Only if we need to wait for a cockpit-ws instance to
+ * get started, this happens on a short-lived thread.
+ *
+ * Connections must then be handed over with connection_worker_accept().
+ *
+ * @n_workers: Number of worker threads, must be positive
+ * @max_handshakes: Maximum number of connections which are in the
+ *                  handshake at the same time, or 0 for no limit; further
+ *                  connections wait for their turn, so that established
+ *                  connections keep their CPU time during a connection
+ *                  storm
+ * @closed_func: Called (from an arbitrary thread) whenever an accepted
+ *               connection is closed, with the data that was given to
+ *               connection_worker_accept()
+ */
+void
+connection_workers_start (unsigned n_workers,
+                          unsigned max_handshakes,
+                          void (*closed_func) (void *data))
+{
+  assert (workers.n_workers == 0);
+  assert (n_workers > 0);
+
+  pthread_mutex_init (&workers.mutex, NULL);
+  workers.workers = callocx (n_workers, sizeof (ConnectionWorker));
+  workers.n_workers = n_workers;
+  workers.max_handshakes = max_handshakes;
+  workers.closed_func = closed_func;
+  workers.pid = getpid ();
+
+  for (unsigned i = 0; i < n_workers; i++)
+    {
+      ConnectionWorker *worker = &workers.workers[i];
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+      worker->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (worker->epollfd < 0)
+        err (EXIT_FAILURE, "Failed to create worker epoll fd");
+
+      worker->eventfd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (worker->eventfd < 0)
+        err (EXIT_FAILURE, "Failed to create worker eventfd");
+
+      if (epoll_ctl (worker->epollfd, EPOLL_CTL_ADD, worker->eventfd, &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll worker eventfd");
+
+      int r = pthread_create (&worker->thread, NULL, connection_worker_main, worker);
+      if (r != 0)
+        {
+          errno = r;
+          err (EXIT_FAILURE, "Failed to start worker thread");
+        }
+    }
+
+  debug (CONNECTION, "Started %u connection workers", n_workers);
+}
+
+/**
+ * connection_workers_stop: Stop the event-driven mode
+ *
+ * All connections must already be closed.
+ */
+void
+connection_workers_stop (void)
+{
+  const uint64_t one = 1;
+
+  assert (workers.n_workers > 0);
+  assert (workers.waiting_head == NULL);
+
+  pthread_mutex_lock (&workers.mutex);
+  workers.stopping = true;
+  pthread_mutex_unlock (&workers.mutex);
+
+  for (unsigned i = 0; i < workers.n_workers; i++)
+    {
+      ConnectionWorker *worker = &workers.workers[i];
+
+      /* after fork(), the threads only exist in the parent */
+      if (workers.pid == getpid ())
+        {
+          if (write (worker->eventfd, &one, sizeof one) < 0)
+            err (EXIT_FAILURE, "Failed to wake up worker");
+          pthread_join (worker->thread, NULL);
+        }
+
+      close (worker->eventfd);
+      close (worker->epollfd);
+    }
+
+  pthread_mutex_destroy (&workers.mutex);
+  free (workers.workers);
+  memset (&workers, 0, sizeof workers);
+}
+
+/**
+ * connection_worker_accept: Handle a new connection in event-driven mode
+ *
+ * Takes ownership of @fd.  If the limit of concurrent handshakes is
+ * reached, the connection waits until it's its turn.
+ *
+ * @closed_data: Passed to the closed_func once the connection is done
+ */
+void
+connection_worker_accept (int   fd,
+                          void *closed_data)
+{
+  Connection *self = connection_new (fd);
+
+  assert (workers.n_workers > 0);
+
+  self->closed_data = closed_data;
+
+  /* the first byte timeout includes any time spent waiting for a slot */
+  connection_set_deadline (self, FIRST_BYTE_TIMEOUT_MS);
+
+  /* a worker must never block on any single connection */
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) != 0)
+    {
+      warn ("Failed to make connection fd %i non-blocking", fd);
+      connection_worker_finish (self);
+      return;
+    }
+
+  pthread_mutex_lock (&workers.mutex);
+
+  if (workers.max_handshakes == 0 || workers.n_handshakes < workers.max_handshakes)
+    {
+      workers.n_handshakes++;
+      self->handshaking = true;
+      self->state = CONNECTION_STATE_FIRST_BYTE;
+    }
+  else
+    {
+      debug (CONNECTION, "Too many handshakes in progress, fd %i has to wait", fd);
+
+      if (workers.waiting_tail)
+        workers.waiting_tail->next_waiting = self;
+      else
+        workers.waiting_head = self;
+      workers.waiting_tail = self;
+      self->waiting = true;
+      self->state = CONNECTION_STATE_WAITING;
+    }
+
+  /* waiting connections go to a worker as well, which keeps an eye on them */
+  connection_worker_push_locked (self);
+
+  pthread_mutex_unlock (&workers.mutex);
+}
+
+/**
+ * connection_set_proxy_header: Choose how to send the connection metadata
+ *
+ * @enabled: Whether to send the origin address and client certificate
+ *           to cockpit-ws in a PROXY protocol v2 header in front of the
+ *           data, instead of in a memfd alongside it.  cockpit-ws must
+ *           be configured to expect that.
+ */
+void
+connection_set_proxy_header (bool enabled)
+{
+  parameters.proxy_header = enabled;
+}
+
+/**
+ * connection_crypto_init: Initialise TLS support
+ *
+ * This should be called after server_init() in order to enable TLS
+ * support for connections. If this function is not called, the server
+ * will only be able to handle http requests.
+ *
+ * The certificate file must either contain the key as well, or end with
+ * "*.crt" or "*.cert" and have a corresponding "*.key" file.
+ *
+ * TLS session tickets are always enabled.  Older clients which only
+ * support resuming by session ID additionally need a session cache.
+ *
+ * @certfile: Server TLS certificate file; cannot be %NULL
+ * @request_mode: Whether to ask for client certificates
+ * @session_cache_size: Number of sessions to remember for session ID
+ *                      based resumption, or 0 to disable this
+ */
+void
+connection_crypto_init (const char *certificate_filename,
+                        const char *key_filename,
+                        bool allow_unencrypted,
+                        gnutls_certificate_request_t request_mode,
+                        unsigned session_cache_size)
+{
+  parameters.certificate = certificate_load (certificate_filename, key_filename);
+  session_cache_init (session_cache_size);
+  parameters.request_mode = request_mode;
+  /* If we aren't called, then require_https is false */
+  parameters.require_https = !allow_unencrypted;
+}
+
+void
+connection_set_directories (const char *wsinstance_sockdir,
+                            const char *runtime_directory)
+{
+  assert (parameters.wsinstance_sockdir == -1);
+  assert (parameters.cert_session_dir == -1);
+
+  assert (wsinstance_sockdir != NULL);
+  assert (runtime_directory != NULL);
+
+  parameters.wsinstance_sockdir = open (wsinstance_sockdir, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (parameters.wsinstance_sockdir == -1)
+    err (EXIT_FAILURE, "Unable to open wsinstance sockdir %s", wsinstance_sockdir);
+
+  int runtimedir_fd = open (runtime_directory, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+  if (runtimedir_fd == -1)
+    err (EXIT_FAILURE, "Unable to open runtime directory %s", runtime_directory);
+
+  if (mkdirat (runtimedir_fd, "clients", 0700) != 0)
+    err (EXIT_FAILURE, "mkdir: %s/clients", runtime_directory);
+
+  parameters.cert_session_dir = openat (runtimedir_fd, "clients", O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (parameters.cert_session_dir == -1)
+    err (EXIT_FAILURE, "Unable to open certificate directory %s/clients", runtime_directory);
+
+  close (runtimedir_fd);
+}
+
+void
+connection_cleanup (void)
+{
+  assert (parameters.wsinstance_sockdir != -1);
+  assert (parameters.cert_session_dir != -1);
+
+  if (parameters.certificate)
+    {
+      certificate_unref (parameters.certificate);
+      parameters.certificate = NULL;
+      session_cache_cleanup ();
+    }
+
+  parameters.require_https = false;
+
+  close (parameters.cert_session_dir);
+  parameters.cert_session_dir = -1;
+
+  close (parameters.wsinstance_sockdir);
+  parameters.wsinstance_sockdir = -1;
+
+  buffer_pool_cleanup ();
 }
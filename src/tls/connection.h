@@ -24,16 +24,32 @@
 
 #include <gnutls/gnutls.h>
 
+/* Plaintext size of the TLS records we send at the start of a transfer:
+ * one fits into a single TCP segment (leaving room for IPv6 and TCP
+ * options), so the browser can process it right away instead of waiting
+ * for the rest of a 16 KiB record.  After about an initial TCP congestion
+ * window worth of data, we switch to full-size records, which have less
+ * overhead.  After a pause, we start small again.
+ */
+#define TLS_RECORD_SMALL 1369
+#define TLS_RECORD_FULL 16384
+#define TLS_RECORD_WARMUP_BYTES 16384
+#define TLS_RECORD_IDLE_MS 1000
+
 /* init/teardown */
 void
 connection_set_directories (const char *wsinstance_sockdir,
                             const char *runtime_directory);
 
+void
+connection_set_proxy_header (bool enabled);
+
 void
 connection_crypto_init (const char *certificate_filename,
                         const char *key_filename,
                         bool allow_unencrypted,
-                        gnutls_certificate_request_t request_mode);
+                        gnutls_certificate_request_t request_mode,
+                        unsigned session_cache_size);
 
 void
 connection_cleanup (void);
@@ -41,3 +57,16 @@ connection_cleanup (void);
 /* handle a new connection */
 void
 connection_thread_main (int fd);
+
+/* event-driven mode */
+void
+connection_workers_start (unsigned n_workers,
+                          unsigned max_handshakes,
+                          void (*closed_func) (void *data));
+
+void
+connection_workers_stop (void);
+
+void
+connection_worker_accept (int   fd,
+                          void *closed_data);
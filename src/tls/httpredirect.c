@@ -17,158 +17,420 @@
  * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
  */
 
+/*
+ * Redirects plain http requests to https.  The connection proxies the
+ * client to one end of a socketpair, like it would to a cockpit-ws
+ * instance; a single thread serves the other ends of all of them in an
+ * epoll loop.  It parses the request line and Host: header as the data
+ * comes in, answers with one writev(), and drops requests which take
+ * too long, so that health checks and scanners on the plain port cost
+ * next to nothing.
+ */
+
 #include "config.h"
 
 #include "httpredirect.h"
 
-#include <sys/socket.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
-#include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-static char *
-read_line (FILE *stream,
-           char *buffer,
-           size_t sizeof_buffer,
-           size_t *offset)
-{
-  if (*offset >= sizeof_buffer)
-    return NULL;
+#include "common/cockpitmemory.h"
+
+#include "utils.h"
 
-  char *line = fgets (buffer + *offset, sizeof_buffer - *offset, stream);
+/* the request line and all headers must fit into this */
+#define REQUEST_MAX 10000
 
-  if (line == NULL)
-    return NULL;
+/* how long a client may take to send its request */
+#define REQUEST_TIMEOUT_MS 10000
+
+#define MAX_EVENTS 64
+
+#define HOST_HEADER "Host:"
+
+static const char redirect_head[] = "HTTP/1.1 301 Moved Permanently\r\n"
+                                    "Content-Type: text/html\r\n"
+                                    "Location: https://";
+static const char redirect_tail[] = "\r\n\r\n";
+static const char error_reply[] = "HTTP/1.1 400 Client Error\r\n"
+                                  "\r\n"
+                                  "Incorrect request.\r\n";
+
+typedef struct _Redirect Redirect;
+
+/* the state of one request */
+struct _Redirect {
+  int fd;
+  struct timespec deadline;
+
+  /* received so far; complete lines get parsed right away */
+  char *buffer;
+  size_t length;
+  size_t parsed;
+  bool have_request_line;
+
+  /* offsets into buffer */
+  size_t path, path_len;
+  size_t host, host_len;
+  bool have_host;
+
+  /* all redirects in order of their deadline, protected by mutex */
+  Redirect *prev, *next;
+};
+
+/* redirector state (singleton), started with the first redirect */
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  int epollfd;
+  int wakeup_fd; /* for when the first deadline appears */
+  Redirect *head, *tail;
+} redirector;
+
+static void
+redirect_free (Redirect *self)
+{
+  pthread_mutex_lock (&mutex);
+  if (self->prev)
+    self->prev->next = self->next;
+  else
+    redirector.head = self->next;
+  if (self->next)
+    self->next->prev = self->prev;
+  else
+    redirector.tail = self->prev;
+  pthread_mutex_unlock (&mutex);
 
-  /* Make sure we're terminated with \r\n or \n */
-  size_t line_length = strcspn (line, "\r\n");
-  const char *ending = line + line_length;
-  if (strcmp (ending, "\r\n") != 0 && strcmp (ending, "\n") != 0)
-    return NULL;
+  /* this also removes it from the epoll */
+  close (self->fd);
+  free (self->buffer);
+  free (self);
+}
 
-  /* Discard the ending */
-  line[line_length++] = '\0';
+/* Sends @iov, and closes the connection.  The reply is much smaller than
+ * the socket buffer, so one non-blocking write is enough. */
+static void
+redirect_reply (Redirect           *self,
+                const struct iovec *iov,
+                int                 iovcnt)
+{
+  if (writev (self->fd, iov, iovcnt) < 0)
+    debug (CONNECTION, "httpredirect: failed to send reply: %m");
 
-  *offset += line_length;
+  redirect_free (self);
+}
 
-  return line;
+static void
+redirect_error (Redirect *self)
+{
+  struct iovec iov = { (void *) error_reply, sizeof error_reply - 1 };
+  redirect_reply (self, &iov, 1);
 }
 
+/* Parses the line at @line, of @length without the line ending.
+ * Returns: false if the request is invalid */
 static bool
-write_error (FILE *output)
+redirect_parse_line (Redirect *self,
+                     size_t    line,
+                     size_t    length)
 {
-  fprintf (output, "HTTP/1.1 400 Client Error\r\n"
-                   "\r\n"
-                   "Incorrect request.\r\n");
+  const char *start = self->buffer + line;
+  const char *end = start + length;
 
-  return false;
+  if (!self->have_request_line)
+    {
+      /* METHOD SP path SP version */
+      const char *path = memchr (start, ' ', length);
+      if (path == NULL)
+        return false;
+      path++;
+
+      const char *end_path = memchr (path, ' ', end - path);
+      if (end_path == NULL)
+        return false;
+
+      self->path = path - self->buffer;
+      self->path_len = end_path - path;
+      self->have_request_line = true;
+    }
+  else if (length >= strlen (HOST_HEADER) && memcmp (start, HOST_HEADER, strlen (HOST_HEADER)) == 0)
+    {
+      if (self->have_host)
+        return false;
+
+      const char *host = start + strlen (HOST_HEADER);
+      while (host < end && (*host == ' ' || *host == '\t'))
+        host++;
+
+      self->host = host - self->buffer;
+      self->host_len = end - host;
+      self->have_host = true;
+    }
+
+  return true;
 }
 
+/* Parses all complete lines.  Returns: true once the request is done */
 static bool
-http_redirect (FILE *input,
-               FILE *output)
+redirect_parse (Redirect *self,
+                bool     *out_valid)
 {
-  char buffer[10000];
-  size_t offset = 0;
-
-  char *request_line = read_line (input, buffer, sizeof buffer, &offset);
-  if (request_line == NULL)
-    return write_error (output);
-
-  char *path = strchr (request_line, ' ');
-  if (path == NULL)
-    return write_error (output);
-  path++;
-
-  char *end_path = strchr (path, ' ');
-  if (end_path == NULL)
-    return write_error (output);
-  *end_path = '\0';
-
-  const char *host = NULL;
-  const char *header;
-  do
+  char *newline;
+
+  *out_valid = true;
+
+  while ((newline = memchr (self->buffer + self->parsed, '\n', self->length - self->parsed)))
     {
-      header = read_line (input, buffer, sizeof buffer, &offset);
-      if (header == NULL)
-        return write_error (output);
+      size_t line = self->parsed;
+      size_t length = newline - (self->buffer + line);
 
-#define HOST_HEADER "Host:"
-      if (strncmp (header, HOST_HEADER, strlen (HOST_HEADER)) == 0)
+      self->parsed += length + 1;
+
+      /* lines end with \r\n or \n, and there must not be any other \r */
+      if (length > 0 && self->buffer[line + length - 1] == '\r')
+        length--;
+      if (memchr (self->buffer + line, '\r', length))
         {
-          if (host != NULL)
-            return write_error (output);
+          *out_valid = false;
+          return true;
+        }
 
-          host = header + strlen (HOST_HEADER);
-          host += strspn (host, " \t");
+      /* the empty line after the headers */
+      if (length == 0 && self->have_request_line)
+        {
+          *out_valid = self->have_host;
+          return true;
+        }
+
+      if (!redirect_parse_line (self, line, length))
+        {
+          *out_valid = false;
+          return true;
         }
     }
-  while (header[0] != '\0');
 
-  if (!host)
-    return write_error (output);
+  /* no room for the rest of the request */
+  if (self->length == REQUEST_MAX)
+    {
+      *out_valid = false;
+      return true;
+    }
 
-  fprintf (output, "HTTP/1.1 301 Moved Permanently\r\n"
-                   "Content-Type: text/html\r\n"
-                   "Location: https://%s%s\r\n"
-                   "\r\n", host, path);
+  return false;
+}
 
-  return true;
+static void
+redirect_handle (Redirect *self)
+{
+  bool valid;
+  ssize_t r;
+
+  for (;;)
+    {
+      r = read (self->fd, self->buffer + self->length, REQUEST_MAX - self->length);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            return;
+          debug (CONNECTION, "httpredirect: failed to read request: %m");
+          redirect_free (self);
+          return;
+        }
+
+      /* the connection went away, or stopped sending before the request was complete */
+      if (r == 0)
+        {
+          redirect_error (self);
+          return;
+        }
+
+      self->length += r;
+
+      if (redirect_parse (self, &valid))
+        break;
+    }
+
+  if (!valid)
+    {
+      redirect_error (self);
+      return;
+    }
+
+  struct iovec iov[] = {
+    { (void *) redirect_head, sizeof redirect_head - 1 },
+    { self->buffer + self->host, self->host_len },
+    { self->buffer + self->path, self->path_len },
+    { (void *) redirect_tail, sizeof redirect_tail - 1 },
+  };
+  redirect_reply (self, iov, N_ELEMENTS (iov));
+}
+
+static int64_t
+timespec_diff_ms (const struct timespec *a,
+                  const struct timespec *b)
+{
+  return ((int64_t) a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+/* Drops all redirects past their deadline.
+ * Returns: the epoll_wait() timeout until the next one */
+static int
+redirector_expire (void)
+{
+  struct timespec now;
+  int timeout = -1;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock (&mutex);
+
+  while (redirector.head)
+    {
+      Redirect *self = redirector.head;
+      int64_t remaining = timespec_diff_ms (&self->deadline, &now);
+
+      if (remaining > 0)
+        {
+          timeout = remaining;
+          break;
+        }
+
+      debug (CONNECTION, "httpredirect: request on fd %i timed out", self->fd);
+      pthread_mutex_unlock (&mutex);
+      redirect_free (self);
+      pthread_mutex_lock (&mutex);
+    }
+
+  pthread_mutex_unlock (&mutex);
+
+  return timeout;
 }
 
 static void *
-http_redirect_start (void *arg)
+redirector_thread (void *data)
 {
-  FILE *stream = arg;
+  struct epoll_event events[MAX_EVENTS];
 
-  http_redirect (stream, stream);
+  for (;;)
+    {
+      int n = epoll_wait (redirector.epollfd, events, MAX_EVENTS, redirector_expire ());
+      if (n < 0 && errno != EINTR)
+        err (EXIT_FAILURE, "httpredirect: epoll_wait failed");
 
-  fclose (stream);
+      for (int i = 0; i < n; i++)
+        {
+          uint64_t value;
+
+          if (events[i].data.ptr == NULL)
+            {
+              if (read (redirector.wakeup_fd, &value, sizeof value) < 0 && errno != EAGAIN)
+                err (EXIT_FAILURE, "httpredirect: failed to read eventfd");
+            }
+          else
+            redirect_handle (events[i].data.ptr);
+        }
+    }
 
   return NULL;
 }
 
+static void
+redirector_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  redirector.epollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (redirector.epollfd < 0)
+    err (EXIT_FAILURE, "httpredirect: failed to create epoll fd");
+
+  redirector.wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (redirector.wakeup_fd < 0)
+    err (EXIT_FAILURE, "httpredirect: failed to create eventfd");
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl (redirector.epollfd, EPOLL_CTL_ADD, redirector.wakeup_fd, &ev) != 0)
+    err (EXIT_FAILURE, "httpredirect: failed to epoll eventfd");
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  int r = pthread_create (&thread, &attr, redirector_thread, NULL);
+  if (r != 0)
+    {
+      errno = r;
+      err (EXIT_FAILURE, "httpredirect: failed to start thread");
+    }
+
+  pthread_attr_destroy (&attr);
+}
+
+/**
+ * http_redirect_connect: Create a connection to the redirector
+ *
+ * Returns: the client end of a socketpair, or -1 on failure; the
+ * redirector answers the http request which gets written to it
+ */
 int
 http_redirect_connect (void)
 {
   int sv[2];
-  int r = socketpair (AF_UNIX, SOCK_STREAM, 0, sv);
-  if (r != 0)
+
+  pthread_once (&started, redirector_start);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
     return -1;
 
-  /* At this point we're going to succeed and return sv[1] to the
-   * caller.  We need to make sure that sv[0] gets closed one way or
-   * another:
-   *  - if we fail to create the stream, close()
-   *  - if we fail to spawn the thread, fclose()
-   *  - otherwise, the thread calls fclose()
-   */
-  FILE *stream = fdopen (sv[0], "r+");
-  if (stream == NULL)
-    close (sv[0]);
-  else
+  if (fcntl (sv[0], F_SETFL, O_NONBLOCK) != 0)
     {
-      pthread_attr_t attr;
-      pthread_t thread;
+      close (sv[0]);
+      close (sv[1]);
+      return -1;
+    }
 
-      pthread_attr_init (&attr);
-      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  Redirect *self = callocx (1, sizeof (Redirect));
+  self->fd = sv[0];
+  self->buffer = mallocx (REQUEST_MAX);
+  clock_gettime (CLOCK_MONOTONIC, &self->deadline);
+  self->deadline.tv_sec += REQUEST_TIMEOUT_MS / 1000;
+
+  /* all have the same timeout, so the newest one always goes last; only
+   * the first one changes how long the redirector may sleep */
+  static const uint64_t one = 1;
+  pthread_mutex_lock (&mutex);
+  bool first = redirector.tail == NULL;
+  self->prev = redirector.tail;
+  if (first)
+    redirector.head = self;
+  else
+    redirector.tail->next = self;
+  redirector.tail = self;
+  pthread_mutex_unlock (&mutex);
 
-      if (pthread_create (&thread, &attr, &http_redirect_start, stream))
-        fclose (stream);
+  if (first && write (redirector.wakeup_fd, &one, sizeof one) != sizeof one)
+    warn ("httpredirect: failed to wake up");
 
-      pthread_attr_destroy (&attr);
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = self };
+  if (epoll_ctl (redirector.epollfd, EPOLL_CTL_ADD, self->fd, &ev) != 0)
+    {
+      redirect_free (self);
+      close (sv[1]);
+      return -1;
     }
 
   return sv[1];
 }
-
-#ifdef HTTP_REDIRECT_STANDALONE
-int
-main (void)
-{
-  return http_redirect (stdin, stdout) ? 0 : 1;
-}
-#endif
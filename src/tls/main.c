@@ -23,11 +23,14 @@
 #include <err.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 #include <common/cockpitconf.h>
 #include <common/cockpitwebcertificate.h>
 #include "utils.h"
+#include "admission.h"
+#include "buffer-pool.h"
 #include "server.h"
 #include "connection.h"
 
@@ -36,10 +39,29 @@ struct arguments {
   uint16_t port;
   bool no_tls;
   int idle_timeout;
+  int workers;
+  int max_handshakes;
+  int session_cache;
+  int buffer_pool;
+  const char *stats_socket;
+  int processes;
+  bool cpu_affinity;
+  AdmissionLimits admission;
 };
 
 #define OPT_NO_TLS 1000
 #define OPT_IDLE_TIMEOUT 1001
+#define OPT_WORKERS 1002
+#define OPT_MAX_HANDSHAKES 1003
+#define OPT_SESSION_CACHE 1004
+#define OPT_BUFFER_POOL 1005
+#define OPT_STATS_SOCKET 1006
+#define OPT_PROCESSES 1007
+#define OPT_CPU_AFFINITY 1008
+#define OPT_MAX_CONNECTIONS 1009
+#define OPT_MAX_CONNECTIONS_PER_SOURCE 1010
+#define OPT_MAX_ACCEPT_RATE 1011
+#define OPT_MAX_ACCEPT_RATE_PER_SOURCE 1012
 
 static int
 arg_parse_int (char *arg, struct argp_state *state, int min, int max, const char *error_msg)
@@ -69,6 +91,45 @@ parse_opt (int key, char *arg, struct argp_state *state)
       case OPT_IDLE_TIMEOUT:
         arguments->idle_timeout = arg_parse_int (arg, state, 0, INT_MAX, "Invalid idle timeout");
         break;
+      case OPT_WORKERS:
+        if (arg)
+          arguments->workers = arg_parse_int (arg, state, 1, 1024, "Invalid number of workers");
+        else
+          arguments->workers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+        break;
+      case OPT_MAX_HANDSHAKES:
+        arguments->max_handshakes = arg_parse_int (arg, state, 0, INT_MAX, "Invalid maximum number of handshakes");
+        break;
+      case OPT_SESSION_CACHE:
+        arguments->session_cache = arg_parse_int (arg, state, 0, 1 << 20, "Invalid session cache size");
+        break;
+      case OPT_BUFFER_POOL:
+        arguments->buffer_pool = arg_parse_int (arg, state, 0, INT_MAX, "Invalid buffer pool size");
+        break;
+      case OPT_STATS_SOCKET:
+        arguments->stats_socket = arg;
+        break;
+      case OPT_PROCESSES:
+        if (arg)
+          arguments->processes = arg_parse_int (arg, state, 1, 1024, "Invalid number of processes");
+        else
+          arguments->processes = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+        break;
+      case OPT_CPU_AFFINITY:
+        arguments->cpu_affinity = true;
+        break;
+      case OPT_MAX_CONNECTIONS:
+        arguments->admission.max_connections = arg_parse_int (arg, state, 0, INT_MAX, "Invalid maximum number of connections");
+        break;
+      case OPT_MAX_CONNECTIONS_PER_SOURCE:
+        arguments->admission.max_connections_per_source = arg_parse_int (arg, state, 0, INT_MAX, "Invalid maximum number of connections");
+        break;
+      case OPT_MAX_ACCEPT_RATE:
+        arguments->admission.max_rate = arg_parse_int (arg, state, 0, INT_MAX, "Invalid maximum accept rate");
+        break;
+      case OPT_MAX_ACCEPT_RATE_PER_SOURCE:
+        arguments->admission.max_rate_per_source = arg_parse_int (arg, state, 0, INT_MAX, "Invalid maximum accept rate");
+        break;
       default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -79,6 +140,17 @@ static struct argp_option options[] = {
   {"no-tls", OPT_NO_TLS, 0, 0,  "Don't use TLS" },
   {"port", 'p', "PORT", 0, "Local port to bind to (9090 if unset)" },
   {"idle-timeout", OPT_IDLE_TIMEOUT, "SECONDS", 0, "Time after which to exit if there are no connections; 0 to run forever (default: 90)" },
+  {"workers", OPT_WORKERS, "N", OPTION_ARG_OPTIONAL, "Handle connections in N event-driven worker threads instead of one thread each (default N: number of CPUs)" },
+  {"max-handshakes", OPT_MAX_HANDSHAKES, "N", 0, "With --workers, only handshake N connections at the same time; 0 for no limit (default: 0)" },
+  {"session-cache", OPT_SESSION_CACHE, "N", 0, "Remember N TLS sessions for clients which can't use session tickets; 0 to disable (default: 0)" },
+  {"buffer-pool", OPT_BUFFER_POOL, "N", 0, "Keep up to N unused buffers of each size for reuse (default: 64)" },
+  {"stats-socket", OPT_STATS_SOCKET, "PATH", 0, "Serve runtime statistics as JSON on a unix socket at PATH" },
+  {"processes", OPT_PROCESSES, "N", OPTION_ARG_OPTIONAL, "Accept connections in N processes which share the port (default N: number of CPUs)" },
+  {"cpu-affinity", OPT_CPU_AFFINITY, 0, 0, "With --processes, pin each process to one CPU" },
+  {"max-connections", OPT_MAX_CONNECTIONS, "N", 0, "Reject connections beyond N concurrent ones; 0 for no limit (default: 0)" },
+  {"max-connections-per-source", OPT_MAX_CONNECTIONS_PER_SOURCE, "N", 0, "Reject connections beyond N concurrent ones from the same IP address or IPv6 /64; 0 for no limit (default: 0)" },
+  {"max-accept-rate", OPT_MAX_ACCEPT_RATE, "N", 0, "Reject connections beyond N new ones per second; 0 for no limit (default: 0)" },
+  {"max-accept-rate-per-source", OPT_MAX_ACCEPT_RATE_PER_SOURCE, "N", 0, "Reject connections beyond N new ones per second from the same source; 0 for no limit (default: 0)" },
   { 0 }
 };
 
@@ -99,15 +171,36 @@ main (int argc, char **argv)
   arguments.no_tls = false;
   arguments.port = 9090;
   arguments.idle_timeout = 90;
+  arguments.workers = 0;
+  arguments.max_handshakes = 0;
+  arguments.session_cache = 0;
+  arguments.buffer_pool = -1;
+  arguments.stats_socket = NULL;
+  arguments.processes = 1;
+  arguments.cpu_affinity = false;
+  arguments.admission = (AdmissionLimits) { 0, };
 
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
+  if (arguments.max_handshakes > 0 && arguments.workers == 0)
+    errx (EXIT_FAILURE, "--max-handshakes requires --workers");
+
+  if (arguments.cpu_affinity && arguments.processes < 2)
+    errx (EXIT_FAILURE, "--cpu-affinity requires --processes");
+
   runtimedir = secure_getenv ("RUNTIME_DIRECTORY");
   if (!runtimedir)
     errx (EXIT_FAILURE, "$RUNTIME_DIRECTORY environment variable must be set to a private directory");
 
+  if (arguments.buffer_pool >= 0)
+    buffer_pool_set_max_idle (arguments.buffer_pool);
+
+  admission_set_limits (&arguments.admission);
+
   server_init ("/run/cockpit/wsinstance", runtimedir, arguments.idle_timeout, arguments.port);
 
+  connection_set_proxy_header (cockpit_conf_bool ("WebService", "ProxyProtocol", false));
+
   if (!arguments.no_tls)
     {
       char *error = NULL;
@@ -122,7 +215,8 @@ main (int argc, char **argv)
 
       connection_crypto_init ("/run/cockpit/tls/server/cert",
                               "/run/cockpit/tls/server/key",
-                              allow_unencrypted, client_cert_mode);
+                              allow_unencrypted, client_cert_mode,
+                              arguments.session_cache);
 
       /* There's absolutely no need to keep these around */
       if (unlink ("/run/cockpit/tls/server/cert") != 0)
@@ -132,6 +226,20 @@ main (int argc, char **argv)
         err (EXIT_FAILURE, "unlink: /run/cockpit/tls/server/key");
     }
 
+  if (arguments.processes > 1 &&
+      !server_start_processes (arguments.processes, arguments.cpu_affinity))
+    {
+      /* supervisor: the whole group reached the idle timeout */
+      server_cleanup ();
+      return 0;
+    }
+
+  if (arguments.stats_socket)
+    server_listen_stats (arguments.stats_socket);
+
+  if (arguments.workers > 0)
+    server_start_workers (arguments.workers, arguments.max_handshakes);
+
   server_run ();
   server_cleanup ();
 
@@ -24,28 +24,67 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "common/cockpitmemory.h"
+
 #include "connection.h"
+#include "socket-io.h"
+#include "stats.h"
+#include "admission.h"
 #include "utils.h"
 
+/* With --processes, the state that all processes of the group share */
+typedef struct {
+  /* connections in all processes; plus GROUP_STOPPING once the group
+   * reached its idle timeout, after which nobody accepts anymore */
+  atomic_uint connections;
+  /* how many connections have ended so far */
+  atomic_uint ended;
+} ServerGroup;
+
+#define GROUP_STOPPING (1u << 31)
+
 /* cockpit-tls TCP server state (singleton) */
 static struct {
   /* only used from main thread */
   bool initialized;
   int first_listener;
   int last_listener;
+  bool own_listener; /* not from systemd */
   int epollfd;
+  unsigned n_workers;
+  int stats_listener;
+  char *stats_path;
+
+  /* with --processes; process_index is -1 in the supervisor */
+  ServerGroup *group;
+  int group_idle_fd; /* eventfd, signalled when the group has no connections */
+  int group_stop_fd; /* eventfd, signalled when the processes should exit */
+
+  /* given up for accepting and dropping connections when out of fds */
+  int reserve_fd;
+  int process_index;
 
   /* rw, protected by mutex */
   pthread_mutex_t connection_mutex;
@@ -84,31 +123,155 @@ check_sd_listen_pid (void)
   return true;
 }
 
+/**
+ * server_group_connection_start: Account for a connection in the group
+ *
+ * Returns: false if the group is shutting down; then we must not accept
+ * any more connections, and leave them to the next socket activation.
+ */
+static bool
+server_group_connection_start (void)
+{
+  if (server.group == NULL)
+    return true;
+
+  if (atomic_fetch_add (&server.group->connections, 1) & GROUP_STOPPING)
+    {
+      atomic_fetch_sub (&server.group->connections, 1);
+      return false;
+    }
+
+  return true;
+}
+
+static void
+server_group_connection_end (void)
+{
+  static const uint64_t one = 1;
+
+  if (server.group == NULL)
+    return;
+
+  atomic_fetch_add (&server.group->ended, 1);
+
+  /* the last one in the group tells the supervisor to start the idle timer */
+  if (atomic_fetch_sub (&server.group->connections, 1) == 1)
+    if (write (server.group_idle_fd, &one, sizeof one) != sizeof one)
+      warn ("failed to signal idle process group");
+}
+
+/**
+ * server_group_connection_cancel: Take back server_group_connection_start()
+ *
+ * For when accept() did not give us a connection after all.  That is no
+ * reason to restart the idle timer, unless another connection ended in
+ * the meantime, and left it to us to do so.
+ *
+ * @ended: The number of ended connections before starting
+ */
+static void
+server_group_connection_cancel (unsigned ended)
+{
+  static const uint64_t one = 1;
+
+  if (server.group == NULL)
+    return;
+
+  if (atomic_fetch_sub (&server.group->connections, 1) == 1 &&
+      atomic_load (&server.group->ended) != ended)
+    if (write (server.group_idle_fd, &one, sizeof one) != sizeof one)
+      warn ("failed to signal idle process group");
+}
+
+/**
+ * server_connection_closed: Account for a connection that went away
+ *
+ * Called from the connection's thread, or from a worker thread.
+ *
+ * @data: The connection's #AdmissionSource
+ */
+static void
+server_connection_closed (void *data)
+{
+  admission_release (data);
+
+  pthread_mutex_lock (&server.connection_mutex);
+
+  server.connection_count--;
+
+  debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
+
+  if (server.connection_count == 0 && server.idle_timerfd != -1)
+    {
+      debug (CONNECTION, "  -> setting idle timeout");
+      timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+    }
+
+  pthread_mutex_unlock (&server.connection_mutex);
+
+  /* only after the above, so that a stopping process does not see us */
+  server_group_connection_end ();
+}
+
+typedef struct {
+  int fd;
+  AdmissionSource *source;
+} ServerThreadData;
+
 static void *
 server_connection_thread_start_routine (void *data)
 {
-  int fd = (uintptr_t) data;
+  ServerThreadData *thread_data = data;
+  AdmissionSource *source = thread_data->source;
 
-  connection_thread_main (fd);
+  connection_thread_main (thread_data->fd);
+  free (thread_data);
 
   /* teardown */
-  {
-    pthread_mutex_lock (&server.connection_mutex);
+  server_connection_closed (source);
+
+  return NULL;
+}
 
-    server.connection_count--;
+/* Close a connection that we don't want to serve, as cheaply as possible:
+ * the reset avoids the FIN handshake and TIME_WAIT state */
+static void
+server_drop_connection (int fd)
+{
+  const struct linger linger = { .l_onoff = 1, .l_linger = 0 };
 
-    debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
+  setsockopt (fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+  close (fd);
+}
 
-    if (server.connection_count == 0 && server.idle_timerfd != -1)
-      {
-        debug (CONNECTION, "  -> setting idle timeout");
-        timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
-      }
+/* When out of file descriptors, the listening socket stays readable, and
+ * we would spin.  Take the pending connection off with our reserve fd. */
+static void
+server_shed_connection (int listen_fd)
+{
+  if (server.reserve_fd == -1)
+    return;
 
-    pthread_mutex_unlock (&server.connection_mutex);
-  }
+  close (server.reserve_fd);
 
-  return NULL;
+  int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd >= 0)
+    {
+      server_drop_connection (fd);
+      admission_count_rejected (ADMISSION_REJECTED_NO_FDS);
+    }
+
+  server.reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* The group is shutting down: the listeners are level-triggered, and
+ * would keep waking us up for connections which we leave alone now */
+static void
+server_stop_listening (void)
+{
+  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+    if (epoll_ctl (server.epollfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT)
+      warn ("failed to remove listening fd %i from epoll", fd);
 }
 
 /**
@@ -119,23 +282,54 @@ server_connection_thread_start_routine (void *data)
 static void
 handle_accept (int listen_fd)
 {
+  struct sockaddr_storage peer;
+  socklen_t peer_len = sizeof peer;
+  AdmissionSource *source;
+  AdmissionResult result;
   int fd;
   pthread_attr_t attr;
   pthread_t thread;
+  unsigned ended;
 
   debug (CONNECTION, "epoll_wait event on server listen fd %i", listen_fd);
 
-  /* accept and create new connection */
-  fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  ended = server.group ? atomic_load (&server.group->ended) : 0;
+  if (!server_group_connection_start ())
+    {
+      debug (SERVER, "process group is stopping, not accepting anymore");
+      server_stop_listening ();
+      return;
+    }
+
+  /* accept and create new connection; with --processes, another one of
+   * them might have been faster (EAGAIN) */
+  fd = accept4 (listen_fd, (struct sockaddr *) &peer, &peer_len, SOCK_CLOEXEC);
   if (fd < 0)
     {
-      if (errno != EINTR)
+      int e = errno;
+
+      server_group_connection_cancel (ended);
+      errno = e;
+      if (errno == EMFILE || errno == ENFILE)
+        server_shed_connection (listen_fd);
+      else if (errno != EINTR && errno != EAGAIN)
         warn ("failed to accept connection");
       return;
     }
 
+  result = admission_check ((struct sockaddr *) &peer, &source);
+  if (result != ADMISSION_ACCEPTED)
+    {
+      debug (CONNECTION, "Rejecting connection fd %i: %s", fd, admission_result_name (result));
+      server_drop_connection (fd);
+      server_group_connection_end ();
+      return;
+    }
+
   debug (CONNECTION, "New connection accepted, fd %i", fd);
 
+  stats_connection_accepted ();
+
   {
     pthread_mutex_lock (&server.connection_mutex);
 
@@ -153,23 +347,132 @@ handle_accept (int listen_fd)
     pthread_mutex_unlock (&server.connection_mutex);
   }
 
+  if (server.n_workers > 0)
+    {
+      connection_worker_accept (fd, source);
+      return;
+    }
+
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
 
+  ServerThreadData *thread_data = mallocx (sizeof (ServerThreadData));
+  thread_data->fd = fd;
+  thread_data->source = source;
+
   int r = pthread_create (&thread, &attr,
                           server_connection_thread_start_routine,
-                          (void *) (uintptr_t) fd);
+                          thread_data);
 
   if (r != 0)
     {
       errno = r;
       warn ("pthread_create() failed.  dropping connection");
-      close (fd);
+      free (thread_data);
+      server_drop_connection (fd);
+      server_connection_closed (source);
     }
 
   pthread_attr_destroy (&attr);
 }
 
+/**
+ * handle_stats: Handle event on the stats socket
+ *
+ * Sends the current statistics as JSON and closes the connection.  This
+ * is quick enough to do right here on the main thread, as long as we
+ * never wait for the client: the reply has to fit into the socket buffer
+ * in one go, otherwise the client gets dropped.
+ */
+static void
+handle_stats (void)
+{
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *stream;
+
+  int fd = accept4 (server.stats_listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0)
+    {
+      if (errno != EINTR)
+        warn ("failed to accept stats connection");
+      return;
+    }
+
+  stream = open_memstream (&buffer, &size);
+  if (stream == NULL)
+    err (EXIT_FAILURE, "open_memstream");
+
+  stats_print (stream, server_num_connections ());
+
+  if (fclose (stream) != 0)
+    err (EXIT_FAILURE, "Failed to print statistics");
+
+  ssize_t s = send (fd, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (s != (ssize_t) size)
+    debug (SERVER, "failed to send statistics to fd %i, dropping it: %s",
+           fd, s < 0 ? strerror (errno) : "short write");
+
+  free (buffer);
+  close (fd);
+}
+
+/* Listen to @port on all IPv4 addresses */
+static int
+listen_to_port (uint16_t port,
+                bool     reuseport)
+{
+  struct sockaddr_in sa_serv;
+  int optval = 1;
+
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    err (EXIT_FAILURE, "failed to create server listening fd");
+
+  memset (&sa_serv, '\0', sizeof (sa_serv));
+  sa_serv.sin_family = AF_INET;
+  sa_serv.sin_addr.s_addr = INADDR_ANY;
+  sa_serv.sin_port = htons (port);
+
+  if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (void *) &optval, sizeof (int)) < 0)
+    err (EXIT_FAILURE, "failed to set socket option");
+  if (reuseport && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (void *) &optval, sizeof (int)) < 0)
+    err (EXIT_FAILURE, "failed to set SO_REUSEPORT");
+  if (bind (fd, (struct sockaddr *) &sa_serv, sizeof (sa_serv)) < 0)
+    err (EXIT_FAILURE, "failed to bind to port %hu", port);
+  if (listen (fd, 1024) < 0)
+    err (EXIT_FAILURE, "failed to listen to server port");
+
+  return fd;
+}
+
+/* Create server.epollfd, and add the listening fds and the idle timer */
+static void
+server_setup_epoll (uint32_t listener_flags)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  server.epollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (server.epollfd < 0)
+    err (EXIT_FAILURE, "Failed to create epoll fd");
+
+  ev.events = EPOLLIN | listener_flags;
+  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+    {
+      ev.data.fd = fd;
+      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll server listening fd");
+    }
+
+  ev.events = EPOLLIN;
+  if (server.idle_timerfd != -1)
+    {
+      ev.data.fd = server.idle_timerfd;
+      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.idle_timerfd, &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll idle timerfd");
+    }
+}
+
 /***********************************
  *
  * Public API
@@ -196,11 +499,18 @@ server_init (const char *wsinstance_sockdir,
              uint16_t port)
 {
   const char *env_listen_fds;
-  struct epoll_event ev = { .events = EPOLLIN };
 
   assert (!server.initialized);
   server.initialized = true;
   server.idle_timerfd = -1;
+  server.stats_listener = -1;
+  server.group_idle_fd = -1;
+  server.group_stop_fd = -1;
+  server.process_index = -1;
+
+  server.reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (server.reserve_fd == -1)
+    err (EXIT_FAILURE, "failed to open /dev/null");
 
   connection_set_directories (wsinstance_sockdir, cert_session_dir);
 
@@ -221,40 +531,13 @@ server_init (const char *wsinstance_sockdir,
     }
   else
     {
-      struct sockaddr_in sa_serv;
-      int optval = 1;
-
       /* Listen to our port; on the command line and our API we just support one */
-      server.first_listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-      if (server.first_listener < 0)
-        err (EXIT_FAILURE, "failed to create server listening fd");
+      server.first_listener = listen_to_port (port, false);
       server.last_listener = server.first_listener;
-
-      memset (&sa_serv, '\0', sizeof (sa_serv));
-      sa_serv.sin_family = AF_INET;
-      sa_serv.sin_addr.s_addr = INADDR_ANY;
-      sa_serv.sin_port = htons (port);
-
-      if (setsockopt (server.first_listener, SOL_SOCKET, SO_REUSEADDR, (void *) &optval, sizeof (int)) < 0)
-        err (EXIT_FAILURE, "failed to set socket option");
-      if (bind (server.first_listener, (struct sockaddr *) &sa_serv, sizeof (sa_serv)) < 0)
-        err (EXIT_FAILURE, "failed to bind to port %hu", port);
-      if (listen (server.first_listener, 1024) < 0)
-        err (EXIT_FAILURE, "failed to listen to server port");
+      server.own_listener = true;
       debug (SERVER, "Server ready. Listening on port %hu, fd %i", port, server.first_listener);
     }
 
-  /* epoll the listening fds */
-  server.epollfd = epoll_create1 (EPOLL_CLOEXEC);
-  if (server.epollfd < 0)
-    err (EXIT_FAILURE, "Failed to create epoll fd");
-  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
-    {
-      ev.data.fd = fd;
-      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
-        err (EXIT_FAILURE, "Failed to epoll server listening fd");
-    }
-
   /* we use timerfd for idle timeout.  epoll that too. */
   if (idle_timeout > 0)
     {
@@ -265,11 +548,386 @@ server_init (const char *wsinstance_sockdir,
       server.idle_timeout.it_value.tv_sec = idle_timeout;
       if (timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL) != 0)
         err (EXIT_FAILURE, "Failed to set timerfd");
+    }
 
-      ev.data.fd = server.idle_timerfd;
-      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.idle_timerfd, &ev) < 0)
-        err (EXIT_FAILURE, "Failed to epoll idle timerfd");
+  /* epoll the listening fds */
+  server_setup_epoll (0);
+}
+
+/**
+ * server_start_workers: Handle connections in event-driven mode
+ *
+ * This should be called after server_init().  Instead of running each
+ * connection in its own thread, multiplex the established connections
+ * over a fixed number of worker threads, each running an epoll loop.
+ *
+ * In this mode, the TLS handshakes are done in the event loops as well.
+ *
+ * @n_workers: Number of worker threads; usually the number of CPUs
+ * @max_handshakes: Maximum number of concurrent handshakes, or 0 for no limit
+ */
+void
+server_start_workers (unsigned n_workers,
+                      unsigned max_handshakes)
+{
+  assert (server.initialized);
+  assert (server.n_workers == 0);
+  assert (n_workers > 0);
+
+  connection_workers_start (n_workers, max_handshakes, server_connection_closed);
+  server.n_workers = n_workers;
+}
+
+/* In a freshly forked process of the group: make it serve its share */
+static void
+server_become_process (unsigned  index,
+                       int      *listeners,
+                       unsigned  n_listeners,
+                       int       cpu)
+{
+  uint32_t listener_flags = 0;
+
+  server.process_index = index;
+
+  /* the supervisor takes care of the idle timeout of the whole group */
+  if (server.idle_timerfd != -1)
+    {
+      close (server.idle_timerfd);
+      server.idle_timerfd = -1;
     }
+
+  if (cpu >= 0)
+    {
+      cpu_set_t set;
+
+      CPU_ZERO (&set);
+      CPU_SET (cpu, &set);
+      if (sched_setaffinity (0, sizeof set, &set) < 0)
+        warn ("failed to set CPU affinity of process %u", index);
+    }
+
+  if (listeners)
+    {
+      /* keep our own reuseport socket, and let the kernel know which
+       * CPU we are on, so that it prefers us for connections whose
+       * packets arrive there */
+      for (unsigned i = 0; i < n_listeners; i++)
+        if (i != index)
+          close (listeners[i]);
+
+      server.first_listener = server.last_listener = listeners[index];
+
+      if (cpu >= 0 && setsockopt (server.first_listener, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu) < 0)
+        warn ("failed to set SO_INCOMING_CPU");
+    }
+  else
+    {
+      /* share the socket activated listeners; wake up only one of us
+       * for each connection, and let the others not block in accept() */
+      for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+        if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0)
+          err (EXIT_FAILURE, "failed to make listening fd non-blocking");
+
+      listener_flags = EPOLLEXCLUSIVE;
+    }
+
+  close (server.epollfd);
+  server_setup_epoll (listener_flags);
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = server.group_stop_fd };
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.group_stop_fd, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll stop eventfd");
+
+  debug (SERVER, "process %u: pid %i, listening on fds %i to %i, cpu %i",
+         index, getpid (), server.first_listener, server.last_listener, cpu);
+}
+
+/* In the supervisor: wait until the group is idle for long enough */
+static void
+server_supervise (const pid_t *pids,
+                  unsigned     n_processes,
+                  int          sigchld_fd)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  close (server.epollfd);
+  server.epollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (server.epollfd < 0)
+    err (EXIT_FAILURE, "Failed to create epoll fd");
+
+  int fds[] = { server.idle_timerfd, server.group_idle_fd, sigchld_fd };
+  for (unsigned i = 0; i < N_ELEMENTS (fds); i++)
+    {
+      ev.data.fd = fds[i];
+      if (fds[i] != -1 && epoll_ctl (server.epollfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+        err (EXIT_FAILURE, "Failed to epoll supervisor fd");
+    }
+
+  for (;;)
+    {
+      uint64_t value;
+      int ret = epoll_wait (server.epollfd, &ev, 1, -1);
+
+      if (ret < 0)
+        {
+          if (errno != EINTR)
+            err (EXIT_FAILURE, "Failed to epoll_wait");
+          continue;
+        }
+
+      if (ev.data.fd == server.idle_timerfd)
+        {
+          unsigned expected = 0;
+
+          if (read (server.idle_timerfd, &value, sizeof value) < 0 && errno != EAGAIN)
+            err (EXIT_FAILURE, "failed to read timerfd");
+
+          /* a connection might have come in since the timer expired */
+          if (atomic_compare_exchange_strong (&server.group->connections, &expected, GROUP_STOPPING))
+            {
+              debug (SERVER, "process group reached the idle timeout");
+              break;
+            }
+
+          /* it tells us when it ends; unless accept() failed, and it was none */
+          timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+        }
+      else if (ev.data.fd == server.group_idle_fd)
+        {
+          if (read (server.group_idle_fd, &value, sizeof value) < 0 && errno != EAGAIN)
+            err (EXIT_FAILURE, "failed to read eventfd");
+
+          if (server.idle_timerfd != -1 && atomic_load (&server.group->connections) == 0)
+            timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+        }
+      else
+        {
+          struct signalfd_siginfo info;
+
+          if (read (sigchld_fd, &info, sizeof info) < 0 && errno != EAGAIN)
+            err (EXIT_FAILURE, "failed to read signalfd");
+
+          /* several SIGCHLDs can get merged; only reap our own children */
+          for (unsigned i = 0; i < n_processes; i++)
+            if (pids[i] > 0 && waitpid (pids[i], NULL, WNOHANG) == pids[i])
+              {
+                for (unsigned j = 0; j < n_processes; j++)
+                  if (j != i)
+                    kill (pids[j], SIGTERM);
+                errx (EXIT_FAILURE, "process %u (pid %i) exited unexpectedly", i, pids[i]);
+              }
+        }
+    }
+
+  /* nobody accepts connections anymore; let all processes shut down */
+  static const uint64_t one = 1;
+  if (write (server.group_stop_fd, &one, sizeof one) != sizeof one)
+    err (EXIT_FAILURE, "failed to stop process group");
+
+  for (unsigned i = 0; i < n_processes; i++)
+    if (waitpid (pids[i], NULL, 0) < 0)
+      warn ("failed to wait for process %u", i);
+}
+
+/**
+ * server_start_processes: Handle connections in several processes
+ *
+ * This should be called after server_init() and connection_crypto_init(),
+ * and before anything else which starts threads or opens sockets, like
+ * server_start_workers() or server_listen_stats().  It forks off
+ * @n_processes copies of the server, which accept connections
+ * independently of each other, and thus scale beyond the single thread
+ * that accepts connections and does the handshakes.
+ *
+ * If we created the listening socket ourselves, each process gets its own
+ * SO_REUSEPORT socket for the same port, so that the kernel distributes the
+ * connections between them.  Socket activated listeners get shared, and the
+ * processes take turns with EPOLLEXCLUSIVE.
+ *
+ * With @cpu_affinity, each process gets pinned to one CPU, and asks the
+ * kernel to prefer it for connections whose packets arrive on that CPU.
+ *
+ * The original process stays behind as a supervisor, which implements
+ * the idle timeout for the whole group: once that expires, server_run()
+ * returns in all processes.
+ *
+ * Returns: true in each of the new processes, which should then continue
+ * with setting up and running the server as usual; false in the original
+ * process, once all processes are idle and got stopped.
+ */
+bool
+server_start_processes (unsigned n_processes,
+                        bool     cpu_affinity)
+{
+  int *listeners = NULL;
+  int *cpus = NULL;
+  pid_t *pids;
+  sigset_t sigchld, old_mask;
+  int sigchld_fd;
+  int optval = 1;
+
+  assert (server.initialized);
+  assert (server.group == NULL);
+  assert (server.n_workers == 0 && server.stats_listener == -1);
+  assert (server.connection_count == 0);
+  assert (n_processes > 1);
+
+  server.group = mmap (NULL, sizeof (ServerGroup), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (server.group == MAP_FAILED)
+    err (EXIT_FAILURE, "failed to map shared process group state");
+  atomic_init (&server.group->connections, 0);
+
+  server.group_idle_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  server.group_stop_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (server.group_idle_fd < 0 || server.group_stop_fd < 0)
+    err (EXIT_FAILURE, "failed to create eventfd");
+
+  if (server.own_listener)
+    {
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof addr;
+
+      /* join the existing socket into a reuseport group; for port 0 we
+       * need the one that it actually got */
+      if (setsockopt (server.first_listener, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) < 0)
+        err (EXIT_FAILURE, "failed to set SO_REUSEPORT");
+      if (getsockname (server.first_listener, (struct sockaddr *) &addr, &addrlen) < 0)
+        err (EXIT_FAILURE, "failed to get address of listening socket");
+
+      listeners = callocx (n_processes, sizeof (int));
+      listeners[0] = server.first_listener;
+      for (unsigned i = 1; i < n_processes; i++)
+        listeners[i] = listen_to_port (ntohs (addr.sin_port), true);
+    }
+
+  if (cpu_affinity)
+    {
+      cpu_set_t allowed;
+      unsigned n_cpus = 0;
+
+      if (sched_getaffinity (0, sizeof allowed, &allowed) < 0)
+        err (EXIT_FAILURE, "failed to get CPU affinity");
+
+      /* more processes than CPUs wrap around */
+      cpus = callocx (n_processes, sizeof (int));
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET (cpu, &allowed))
+          for (unsigned i = n_cpus++; i < n_processes; i += CPU_COUNT (&allowed))
+            cpus[i] = cpu;
+    }
+
+  /* block SIGCHLD before forking, so that we don't miss any */
+  sigemptyset (&sigchld);
+  sigaddset (&sigchld, SIGCHLD);
+  if (sigprocmask (SIG_BLOCK, &sigchld, &old_mask) < 0)
+    err (EXIT_FAILURE, "failed to block SIGCHLD");
+  sigchld_fd = signalfd (-1, &sigchld, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (sigchld_fd < 0)
+    err (EXIT_FAILURE, "failed to create signalfd");
+
+  pid_t supervisor = getpid ();
+  pids = callocx (n_processes, sizeof (pid_t));
+
+  for (unsigned i = 0; i < n_processes; i++)
+    {
+      pids[i] = fork ();
+      if (pids[i] < 0)
+        err (EXIT_FAILURE, "failed to fork process %u", i);
+
+      if (pids[i] == 0)
+        {
+          /* don't outlive the supervisor */
+          if (prctl (PR_SET_PDEATHSIG, SIGTERM) < 0)
+            err (EXIT_FAILURE, "failed to set parent death signal");
+          if (getppid () != supervisor)
+            errx (EXIT_FAILURE, "supervisor went away");
+
+          close (sigchld_fd);
+          sigprocmask (SIG_SETMASK, &old_mask, NULL);
+
+          server_become_process (i, listeners, n_processes, cpus ? cpus[i] : -1);
+
+          free (listeners);
+          free (cpus);
+          free (pids);
+          return true;
+        }
+    }
+
+  /* the processes have the listening sockets now */
+  if (listeners)
+    for (unsigned i = 0; i < n_processes; i++)
+      close (listeners[i]);
+  else
+    for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+      close (fd);
+  server.first_listener = 0;
+  server.last_listener = -1;
+
+  server_supervise (pids, n_processes, sigchld_fd);
+
+  close (sigchld_fd);
+  sigprocmask (SIG_SETMASK, &old_mask, NULL);
+
+  free (listeners);
+  free (cpus);
+  free (pids);
+  return false;
+}
+
+/**
+ * server_listen_stats: Serve statistics on a unix socket
+ *
+ * This should be called after server_init().  Every connection to the
+ * socket at @path receives one JSON object with the current counters
+ * from stats_print(), and gets closed again.  The socket is only
+ * accessible to our own user.
+ *
+ * With server_start_processes(), call this in each of the processes;
+ * each one appends its index to @path, as in "stats.0".
+ *
+ * @path: Where to create the socket; an existing one gets replaced
+ */
+void
+server_listen_stats (const char *path)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+  mode_t old_umask;
+  char *process_path = NULL;
+
+  assert (server.initialized);
+  assert (server.stats_listener == -1);
+
+  if (server.process_index >= 0)
+    {
+      asprintfx (&process_path, "%s.%i", path, server.process_index);
+      path = process_path;
+    }
+
+  server.stats_listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server.stats_listener == -1)
+    err (EXIT_FAILURE, "failed to create stats socket");
+
+  /* replace stale sockets from a previous run */
+  if (unlink (path) != 0 && errno != ENOENT)
+    err (EXIT_FAILURE, "failed to remove old stats socket %s", path);
+
+  old_umask = umask (0177);
+  if (af_unix_bindat (server.stats_listener, AT_FDCWD, path) != 0)
+    err (EXIT_FAILURE, "failed to bind stats socket %s", path);
+  umask (old_umask);
+
+  if (listen (server.stats_listener, 16) < 0)
+    err (EXIT_FAILURE, "failed to listen to stats socket");
+
+  ev.data.fd = server.stats_listener;
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.stats_listener, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll stats socket");
+
+  server.stats_path = strdupx (path);
+
+  debug (SERVER, "Serving statistics on %s, fd %i", path, server.stats_listener);
+  free (process_path);
 }
 
 int
@@ -294,14 +952,36 @@ server_cleanup (void)
   if (server.idle_timerfd != -1)
     close (server.idle_timerfd);
 
+  if (server.reserve_fd != -1)
+    close (server.reserve_fd);
+
+  if (server.group != NULL)
+    {
+      close (server.group_idle_fd);
+      close (server.group_stop_fd);
+      munmap (server.group, sizeof (ServerGroup));
+    }
+
+  if (server.stats_listener != -1)
+    {
+      close (server.stats_listener);
+      unlink (server.stats_path);
+      free (server.stats_path);
+    }
+
   for (int fd = server.first_listener; fd <= server.last_listener; fd++)
     close (fd);
 
   close (server.epollfd);
 
+  if (server.n_workers > 0)
+    connection_workers_stop ();
+
   pthread_mutex_destroy (&server.connection_mutex);
 
   connection_cleanup ();
+  admission_cleanup ();
+  stats_cleanup ();
 
   memset (&server, 0, sizeof server);
 }
@@ -312,8 +992,8 @@ server_cleanup (void)
  * @timeout: number of milliseconds to wait for an event to happen; after that,
  * the function will return false. -1 will to block until an event occurs.
  *
- * This can be an event on a listening socket, or the idle timeout if no
- * clients are connected.
+ * This can be an event on a listening socket (including the stats
+ * socket), or the idle timeout if no clients are connected.
  *
  * Returns: false on timeout, true if some (other) event was handled.
  */
@@ -340,6 +1020,19 @@ server_poll_event (int timeout)
           return false;
         }
 
+      if (fd == server.group_stop_fd)
+        {
+          /* the process group hit the idle timeout */
+          debug (SERVER, "server_poll_event(): process group stopped, returning immediately");
+          return false;
+        }
+
+      if (fd == server.stats_listener)
+        {
+          handle_stats ();
+          return true;
+        }
+
       assert (server.first_listener <= fd && fd <= server.last_listener);
 
       handle_accept (fd);
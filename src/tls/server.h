@@ -30,6 +30,17 @@ server_init (const char *wsinstance_sockdir,
              int idle_timeout,
              uint16_t port);
 
+void
+server_start_workers (unsigned n_workers,
+                      unsigned max_handshakes);
+
+bool
+server_start_processes (unsigned n_processes,
+                        bool     cpu_affinity);
+
+void
+server_listen_stats (const char *path);
+
 void
 server_run (void);
 
@@ -0,0 +1,396 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file deals with TLS session resumption, so that a client which
+ * opens many short-lived connections (like browsers do for loading
+ * package resources) only pays for the asymmetric crypto once.
+ *
+ * TLS 1.3 resumption (and TLS 1.2 when the client supports it) uses
+ * session tickets.  They are encrypted with a key that only ever exists
+ * in the memory of this process, and of the ones forked from it with
+ * --processes, so that a client can resume its session on any of them.
+ * GnuTLS derives the actual ticket encryption keys from it in a way
+ * which rotates them by itself, and we additionally replace the master
+ * key itself periodically, so that no key is used for an unbounded time.
+ *
+ * Optionally, there's also a classic TLS 1.2 session cache keyed by the
+ * session ID, shared between all connections of one process.  It is a
+ * fixed-size direct-mapped table: a colliding entry simply replaces the
+ * old one.
+ */
+
+#include "config.h"
+
+#include "session-cache.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/cockpitmemory.h"
+
+#include "utils.h"
+
+/* how often to replace the session ticket master key */
+#define TICKET_KEY_LIFETIME (6 * 60 * 60)
+
+#define SESSION_ID_MAX 32
+
+/* what gnutls_session_ticket_key_generate() makes */
+#define TICKET_KEY_SIZE 64
+
+/* The session ticket master key.  This lives in a shared anonymous
+ * mapping, so that it stays the same across fork(), including when one
+ * of the processes replaces it.
+ */
+typedef struct {
+  pthread_mutex_t mutex; /* process-shared */
+  unsigned char key[TICKET_KEY_SIZE];
+  time_t created;
+  pid_t owner; /* the process which made it, and outlives the others */
+} TicketKey;
+
+typedef struct {
+  unsigned char id[SESSION_ID_MAX];
+  unsigned id_size;
+  gnutls_datum_t data; /* .data == NULL if unused */
+} SessionCacheEntry;
+
+/* session resumption state (singleton) */
+static struct {
+  /* all protected by mutex */
+  pthread_mutex_t mutex;
+  bool initialized;
+
+  TicketKey *ticket_key;
+
+  SessionCacheEntry *entries;
+  unsigned n_entries;
+
+  unsigned long full_handshakes;
+  unsigned long resumed_handshakes;
+} cache = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static time_t
+now_seconds (void)
+{
+  struct timespec now;
+  int r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return now.tv_sec;
+}
+
+static void
+ticket_key_lock (TicketKey *self)
+{
+  int r = pthread_mutex_lock (&self->mutex);
+
+  /* another process died while replacing the key; just make a new one */
+  if (r == EOWNERDEAD)
+    {
+      self->created = 0;
+      pthread_mutex_consistent (&self->mutex);
+    }
+  else
+    assert (r == 0);
+}
+
+/* must be called with ticket_key_lock() held */
+static void
+ticket_key_rotate (TicketKey *self)
+{
+  gnutls_datum_t key;
+
+  int r = gnutls_session_ticket_key_generate (&key);
+  if (r != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "Failed to generate session ticket key: %s", gnutls_strerror (r));
+
+  assert (key.size == sizeof self->key);
+  memcpy (self->key, key.data, sizeof self->key);
+  gnutls_memset (key.data, 0, key.size);
+  gnutls_free (key.data);
+
+  self->created = now_seconds ();
+
+  debug (SERVER, "Generated new session ticket key");
+}
+
+static TicketKey *
+ticket_key_new (void)
+{
+  pthread_mutexattr_t attr;
+
+  TicketKey *self = mmap (NULL, sizeof (TicketKey), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (self == MAP_FAILED)
+    err (EXIT_FAILURE, "Failed to allocate session ticket key");
+
+  /* the key must not end up on disk or in core dumps */
+  if (mlock (self, sizeof (TicketKey)) != 0)
+    debug (SERVER, "Failed to lock session ticket key into memory: %m");
+  madvise (self, sizeof (TicketKey), MADV_DONTDUMP);
+
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init (&self->mutex, &attr);
+  pthread_mutexattr_destroy (&attr);
+
+  ticket_key_rotate (self);
+  self->owner = getpid ();
+
+  return self;
+}
+
+static void
+ticket_key_free (TicketKey *self)
+{
+  /* a forked process only lets go of its mapping: the others might still
+   * be using the key, and its mutex */
+  if (self->owner == getpid ())
+    {
+      pthread_mutex_destroy (&self->mutex);
+      gnutls_memset (self->key, 0, sizeof self->key);
+    }
+
+  munmap (self, sizeof (TicketKey));
+}
+
+static SessionCacheEntry *
+session_cache_lookup (const gnutls_datum_t *key)
+{
+  /* FNV-1a */
+  unsigned hash = 2166136261u;
+
+  for (unsigned i = 0; i < key->size; i++)
+    hash = (hash ^ key->data[i]) * 16777619u;
+
+  return &cache.entries[hash % cache.n_entries];
+}
+
+static int
+session_cache_store (void                 *user_data,
+                     gnutls_datum_t        key,
+                     gnutls_datum_t        data)
+{
+  if (key.size > SESSION_ID_MAX)
+    return -1;
+
+  pthread_mutex_lock (&cache.mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (&key);
+
+  free (entry->data.data);
+  memcpy (entry->id, key.data, key.size);
+  entry->id_size = key.size;
+  entry->data.data = mallocx (data.size);
+  entry->data.size = data.size;
+  memcpy (entry->data.data, data.data, data.size);
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  return 0;
+}
+
+static gnutls_datum_t
+session_cache_retrieve (void           *user_data,
+                        gnutls_datum_t  key)
+{
+  gnutls_datum_t result = { NULL, 0 };
+
+  if (key.size > SESSION_ID_MAX)
+    return result;
+
+  pthread_mutex_lock (&cache.mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (&key);
+
+  if (entry->data.data && entry->id_size == key.size && memcmp (entry->id, key.data, key.size) == 0)
+    {
+      /* GnuTLS frees this with gnutls_free() */
+      result.data = gnutls_malloc (entry->data.size);
+      if (result.data)
+        {
+          memcpy (result.data, entry->data.data, entry->data.size);
+          result.size = entry->data.size;
+        }
+    }
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  return result;
+}
+
+static int
+session_cache_remove (void           *user_data,
+                      gnutls_datum_t  key)
+{
+  int result = -1;
+
+  if (key.size > SESSION_ID_MAX)
+    return result;
+
+  pthread_mutex_lock (&cache.mutex);
+
+  SessionCacheEntry *entry = session_cache_lookup (&key);
+
+  if (entry->data.data && entry->id_size == key.size && memcmp (entry->id, key.data, key.size) == 0)
+    {
+      free (entry->data.data);
+      entry->data.data = NULL;
+      entry->data.size = 0;
+      result = 0;
+    }
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  return result;
+}
+
+/**
+ * session_cache_init: Enable TLS session resumption
+ *
+ * Generates the first session ticket key.  Processes that get forked
+ * after this share it.
+ *
+ * @max_entries: Size of the session ID cache, or 0 to only use session
+ *               tickets
+ */
+void
+session_cache_init (unsigned max_entries)
+{
+  pthread_mutex_lock (&cache.mutex);
+
+  assert (!cache.initialized);
+  cache.initialized = true;
+
+  cache.ticket_key = ticket_key_new ();
+
+  if (max_entries > 0)
+    {
+      cache.entries = callocx (max_entries, sizeof (SessionCacheEntry));
+      cache.n_entries = max_entries;
+    }
+
+  cache.full_handshakes = 0;
+  cache.resumed_handshakes = 0;
+
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+void
+session_cache_cleanup (void)
+{
+  pthread_mutex_lock (&cache.mutex);
+
+  assert (cache.initialized);
+  cache.initialized = false;
+
+  ticket_key_free (cache.ticket_key);
+  cache.ticket_key = NULL;
+
+  for (unsigned i = 0; i < cache.n_entries; i++)
+    free (cache.entries[i].data.data);
+  free (cache.entries);
+  cache.entries = NULL;
+  cache.n_entries = 0;
+
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+/**
+ * session_cache_setup: Enable resumption for a new server session
+ *
+ * Call this right after setting up @session, before the handshake.
+ */
+void
+session_cache_setup (gnutls_session_t session)
+{
+  int r;
+
+  assert (cache.initialized);
+
+  TicketKey *ticket_key = cache.ticket_key;
+  ticket_key_lock (ticket_key);
+
+  if (now_seconds () - ticket_key->created >= TICKET_KEY_LIFETIME)
+    ticket_key_rotate (ticket_key);
+
+  /* this copies the key */
+  r = gnutls_session_ticket_enable_server (session, &(gnutls_datum_t) { ticket_key->key, sizeof ticket_key->key });
+
+  pthread_mutex_unlock (&ticket_key->mutex);
+
+  if (r != GNUTLS_E_SUCCESS)
+    warnx ("Failed to enable session tickets: %s", gnutls_strerror (r));
+
+  if (cache.n_entries > 0)
+    {
+      gnutls_db_set_retrieve_function (session, session_cache_retrieve);
+      gnutls_db_set_store_function (session, session_cache_store);
+      gnutls_db_set_remove_function (session, session_cache_remove);
+      gnutls_db_set_ptr (session, NULL);
+    }
+}
+
+/**
+ * session_cache_handshake_done: Count a successful handshake
+ */
+void
+session_cache_handshake_done (gnutls_session_t session)
+{
+  bool resumed = gnutls_session_is_resumed (session);
+
+  debug (CONNECTION, "TLS session was %s", resumed ? "resumed" : "not resumed");
+
+  pthread_mutex_lock (&cache.mutex);
+
+  if (resumed)
+    cache.resumed_handshakes++;
+  else
+    cache.full_handshakes++;
+
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+/**
+ * session_cache_get_counts: Number of full and resumed handshakes
+ *
+ * The difference between these is the amount of asymmetric crypto that
+ * session resumption saved us.
+ */
+void
+session_cache_get_counts (unsigned long *out_full,
+                          unsigned long *out_resumed)
+{
+  pthread_mutex_lock (&cache.mutex);
+  *out_full = cache.full_handshakes;
+  *out_resumed = cache.resumed_handshakes;
+  pthread_mutex_unlock (&cache.mutex);
+}
@@ -32,6 +32,8 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "common/cockpitmemory.h"
+
 #include "socket-io.h"
 #include "testing.h"
 #include "utils.h"
@@ -145,7 +147,7 @@ spawn_cockpit_ws (const char *ws_path, int fd,
     }
 }
 
-/* keep this in sync with src/ws/cockpit-wsinstance-https-factory@.service.in */
+/* keep this in sync with src/systemd/cockpit-wsinstance-https-factory.service.in */
 /* this is blocking! if this program ever stops being an unit-test only thing
 * and gets used in production, rewrite as proper child process */
 static void
@@ -182,19 +184,44 @@ static void *
 handle_alternate_thread (void *fd_as_ptr)
 {
   int fd = (intptr_t) fd_as_ptr;
+  unsigned char buffer[64 * 1024];
+  size_t received = 0;
   ssize_t s;
-  char b;
 
   do
     s = write (fd, "hello", 5);
   while (s == -1 && errno == EINTR);
   assert (s == 5);
 
+  /* a client which sends anything does a bulk transfer: we expect
+   * ALTERNATE_BULK_SIZE bytes of the pattern, and send them back,
+   * followed by EOF */
+  for (;;)
+    {
+      do
+        s = read (fd, buffer, sizeof buffer);
+      while (s == -1 && errno == EINTR);
+      assert (s >= 0);
 
-  do
-    s = read (fd, &b, 1);
-  while (s == -1 && errno == EINTR);
-  assert (s == 0);
+      if (s == 0)
+        break;
+
+      for (ssize_t i = 0; i < s; i++)
+        assert (buffer[i] == ALTERNATE_BULK_BYTE (received + i));
+      received += s;
+      assert (received <= ALTERNATE_BULK_SIZE);
+
+      if (received == ALTERNATE_BULK_SIZE)
+        {
+          char *data = mallocx (ALTERNATE_BULK_SIZE);
+
+          for (size_t i = 0; i < ALTERNATE_BULK_SIZE; i++)
+            data[i] = ALTERNATE_BULK_BYTE (i);
+          if (!send_all (fd, data, ALTERNATE_BULK_SIZE, 30 * 1000000))
+            errx (EXIT_FAILURE, "failed to send bulk data");
+          free (data);
+        }
+    }
 
   close (fd);
 
@@ -0,0 +1,374 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runtime counters of cockpit-tls, for finding out what it is doing in
+ * production.  Connections report into this from whatever thread they
+ * run on; stats_print() dumps everything as a JSON object, which the
+ * server hands out on its optional stats socket.
+ */
+
+#include "config.h"
+
+#include "stats.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gnutls/gnutls.h>
+
+#include "common/cockpitmemory.h"
+
+#include "admission.h"
+#include "buffer-pool.h"
+#include "session-cache.h"
+#include "utils.h"
+
+/* upper bounds of the handshake duration histogram buckets, in ms;
+ * everything above the last one goes into an extra bucket */
+static const unsigned handshake_buckets_ms[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+#define N_HANDSHAKE_BUCKETS (N_ELEMENTS (handshake_buckets_ms) + 1)
+
+/* distinct GnuTLS errors to count separately; the rest goes into "other" */
+#define MAX_HANDSHAKE_ERRORS 32
+
+static const char * const direction_names[STATS_N_DIRECTIONS] = { "client-to-ws", "ws-to-client" };
+
+struct _StatsInstance {
+  char *wsinstance;
+  unsigned connections;
+  _Atomic uint64_t bytes[STATS_N_DIRECTIONS];
+  StatsInstance *next;
+};
+
+typedef struct {
+  int code;
+  uint64_t count;
+} HandshakeError;
+
+/* protects stats, except for the atomic counters which get bumped for
+ * every read and write */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* statistics state (singleton) */
+static struct {
+  _Atomic uint64_t accepted;
+  _Atomic uint64_t plain;
+
+  uint64_t handshakes_started;
+  uint64_t handshakes_succeeded;
+  unsigned handshaking;
+  uint64_t handshake_histogram[N_HANDSHAKE_BUCKETS];
+  uint64_t handshake_total_ms;
+  HandshakeError handshake_errors[MAX_HANDSHAKE_ERRORS];
+  unsigned n_handshake_errors;
+  uint64_t handshake_errors_other;
+
+  _Atomic uint64_t bytes[STATS_N_DIRECTIONS];
+  _Atomic uint64_t buffer_full[STATS_N_DIRECTIONS];
+
+  /* with at least one proxying connection */
+  StatsInstance *instances;
+} stats;
+
+void
+stats_connection_accepted (void)
+{
+  atomic_fetch_add_explicit (&stats.accepted, 1, memory_order_relaxed);
+}
+
+void
+stats_connection_plain (void)
+{
+  atomic_fetch_add_explicit (&stats.plain, 1, memory_order_relaxed);
+}
+
+/**
+ * stats_handshake_started: Account for a TLS handshake
+ *
+ * @out_start: Where to store the current time, for passing it on to
+ *             stats_handshake_finished()
+ *
+ * Every call of this must be followed by exactly one call of
+ * stats_handshake_finished().
+ */
+void
+stats_handshake_started (struct timespec *out_start)
+{
+  int r = clock_gettime (CLOCK_MONOTONIC, out_start);
+  assert (r == 0);
+
+  pthread_mutex_lock (&mutex);
+  stats.handshakes_started++;
+  stats.handshaking++;
+  pthread_mutex_unlock (&mutex);
+}
+
+static void
+stats_count_handshake_error (int code)
+{
+  for (unsigned i = 0; i < stats.n_handshake_errors; i++)
+    if (stats.handshake_errors[i].code == code)
+      {
+        stats.handshake_errors[i].count++;
+        return;
+      }
+
+  if (stats.n_handshake_errors < MAX_HANDSHAKE_ERRORS)
+    stats.handshake_errors[stats.n_handshake_errors++] = (HandshakeError) { code, 1 };
+  else
+    stats.handshake_errors_other++;
+}
+
+/**
+ * stats_handshake_finished: Account for the end of a TLS handshake
+ *
+ * @start: The time from stats_handshake_started()
+ * @result: GNUTLS_E_SUCCESS, or the GnuTLS error which made it fail
+ *
+ * Only successful handshakes go into the duration histogram.
+ */
+void
+stats_handshake_finished (const struct timespec *start,
+                          int                    result)
+{
+  struct timespec now;
+  int r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  uint64_t ms = ((int64_t) now.tv_sec - start->tv_sec) * 1000 +
+                (now.tv_nsec - start->tv_nsec) / 1000000;
+
+  unsigned bucket = 0;
+  while (bucket < N_ELEMENTS (handshake_buckets_ms) && ms > handshake_buckets_ms[bucket])
+    bucket++;
+
+  pthread_mutex_lock (&mutex);
+
+  assert (stats.handshaking > 0);
+  stats.handshaking--;
+
+  if (result == GNUTLS_E_SUCCESS)
+    {
+      stats.handshakes_succeeded++;
+      stats.handshake_histogram[bucket]++;
+      stats.handshake_total_ms += ms;
+    }
+  else
+    stats_count_handshake_error (result);
+
+  pthread_mutex_unlock (&mutex);
+}
+
+/**
+ * stats_instance_ref: Account for a connection to a cockpit-ws instance
+ *
+ * @wsinstance: The name of the instance: "http", or the fingerprint of
+ *              the client certificate
+ *
+ * Returns: the counters to pass to stats_add_bytes(); give them back
+ * with stats_instance_unref() when the connection goes away.
+ */
+StatsInstance *
+stats_instance_ref (const char *wsinstance)
+{
+  StatsInstance *instance;
+
+  pthread_mutex_lock (&mutex);
+
+  for (instance = stats.instances; instance; instance = instance->next)
+    if (strcmp (instance->wsinstance, wsinstance) == 0)
+      break;
+
+  if (instance == NULL)
+    {
+      instance = callocx (1, sizeof (StatsInstance));
+      instance->wsinstance = strdupx (wsinstance);
+      instance->next = stats.instances;
+      stats.instances = instance;
+    }
+
+  instance->connections++;
+
+  pthread_mutex_unlock (&mutex);
+
+  return instance;
+}
+
+void
+stats_instance_unref (StatsInstance *instance)
+{
+  pthread_mutex_lock (&mutex);
+
+  assert (instance->connections > 0);
+
+  /* don't let the list grow with every certificate that was ever seen */
+  if (--instance->connections == 0)
+    {
+      for (StatsInstance **link = &stats.instances; *link; link = &(*link)->next)
+        if (*link == instance)
+          {
+            *link = instance->next;
+            break;
+          }
+
+      free (instance->wsinstance);
+      free (instance);
+    }
+
+  pthread_mutex_unlock (&mutex);
+}
+
+/**
+ * stats_add_bytes: Account for forwarded data
+ *
+ * @instance: The counters of the cockpit-ws instance, or %NULL if the
+ *            connection is not proxying yet
+ *
+ * This is called for every read and write, so it doesn't take the lock;
+ * the caller's reference keeps @instance alive.
+ */
+void
+stats_add_bytes (StatsInstance  *instance,
+                 StatsDirection  direction,
+                 size_t          bytes)
+{
+  atomic_fetch_add_explicit (&stats.bytes[direction], bytes, memory_order_relaxed);
+  if (instance)
+    atomic_fetch_add_explicit (&instance->bytes[direction], bytes, memory_order_relaxed);
+}
+
+/**
+ * stats_buffer_full: Account for a stall
+ *
+ * Called whenever a buffer fills up, so that we have to stop reading
+ * until the other side catches up.
+ */
+void
+stats_buffer_full (StatsDirection direction)
+{
+  atomic_fetch_add_explicit (&stats.buffer_full[direction], 1, memory_order_relaxed);
+}
+
+static void
+print_directions (FILE                   *stream,
+                  const char             *key,
+                  const _Atomic uint64_t  values[STATS_N_DIRECTIONS])
+{
+  fprintf (stream, ", \"%s\": {", key);
+  for (unsigned i = 0; i < STATS_N_DIRECTIONS; i++)
+    fprintf (stream, "%s\"%s\": %" PRIu64, i ? ", " : "", direction_names[i],
+             (uint64_t) atomic_load_explicit (&values[i], memory_order_relaxed));
+  fputc ('}', stream);
+}
+
+/**
+ * stats_print: Write all counters as a JSON object
+ *
+ * @n_connections: The number of connections the server currently has
+ */
+void
+stats_print (FILE     *stream,
+             unsigned  n_connections)
+{
+  BufferPoolStats pool[BUFFER_POOL_N_CLASSES];
+  unsigned long sessions_full, sessions_resumed;
+  uint64_t rejected[ADMISSION_N_RESULTS];
+  unsigned proxying = 0;
+
+  buffer_pool_get_stats (pool);
+  session_cache_get_counts (&sessions_full, &sessions_resumed);
+  admission_get_rejected (rejected);
+
+  pthread_mutex_lock (&mutex);
+
+  for (StatsInstance *instance = stats.instances; instance; instance = instance->next)
+    proxying += instance->connections;
+
+  fprintf (stream, "{\"connections\": {\"active\": %u, \"handshaking\": %u, \"proxying\": %u, "
+           "\"accepted\": %" PRIu64 ", \"plain\": %" PRIu64 ", \"rejected\": {",
+           n_connections, stats.handshaking, proxying,
+           (uint64_t) atomic_load_explicit (&stats.accepted, memory_order_relaxed),
+           (uint64_t) atomic_load_explicit (&stats.plain, memory_order_relaxed));
+  for (AdmissionResult i = ADMISSION_ACCEPTED + 1; i < ADMISSION_N_RESULTS; i++)
+    fprintf (stream, "%s\"%s\": %" PRIu64, i == ADMISSION_ACCEPTED + 1 ? "" : ", ",
+             admission_result_name (i), rejected[i]);
+  fprintf (stream, "}}");
+
+  fprintf (stream, ", \"handshakes\": {\"started\": %" PRIu64 ", \"succeeded\": %" PRIu64
+           ", \"full\": %lu, \"resumed\": %lu, \"total-ms\": %" PRIu64 ", \"duration-ms\": {",
+           stats.handshakes_started, stats.handshakes_succeeded,
+           sessions_full, sessions_resumed, stats.handshake_total_ms);
+  for (unsigned i = 0; i < N_ELEMENTS (handshake_buckets_ms); i++)
+    fprintf (stream, "\"%u\": %" PRIu64 ", ", handshake_buckets_ms[i], stats.handshake_histogram[i]);
+  fprintf (stream, "\"+Inf\": %" PRIu64 "}, \"errors\": {", stats.handshake_histogram[N_HANDSHAKE_BUCKETS - 1]);
+  for (unsigned i = 0; i < stats.n_handshake_errors; i++)
+    {
+      const char *name = gnutls_strerror_name (stats.handshake_errors[i].code);
+      if (name)
+        fprintf (stream, "\"%s\": %" PRIu64 ", ", name, stats.handshake_errors[i].count);
+      else
+        fprintf (stream, "\"%d\": %" PRIu64 ", ", stats.handshake_errors[i].code, stats.handshake_errors[i].count);
+    }
+  fprintf (stream, "\"other\": %" PRIu64 "}}", stats.handshake_errors_other);
+
+  print_directions (stream, "bytes", stats.bytes);
+  print_directions (stream, "buffer-full", stats.buffer_full);
+
+  fprintf (stream, ", \"wsinstances\": {");
+  for (StatsInstance *instance = stats.instances; instance; instance = instance->next)
+    {
+      fprintf (stream, "%s\"%s\": {\"connections\": %u", instance == stats.instances ? "" : ", ",
+               instance->wsinstance, instance->connections);
+      print_directions (stream, "bytes", instance->bytes);
+      fputc ('}', stream);
+    }
+  fputc ('}', stream);
+
+  pthread_mutex_unlock (&mutex);
+
+  fprintf (stream, ", \"buffer-pool\": [");
+  for (unsigned i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    fprintf (stream, "%s{\"size\": %u, \"in-use\": %u, \"idle\": %u, \"high-water\": %u}",
+             i ? ", " : "", pool[i].size, pool[i].in_use, pool[i].idle, pool[i].high_water);
+  fprintf (stream, "]}\n");
+}
+
+/**
+ * stats_cleanup: Reset all counters
+ *
+ * There must not be any connections left.
+ */
+void
+stats_cleanup (void)
+{
+  pthread_mutex_lock (&mutex);
+
+  assert (stats.instances == NULL);
+  assert (stats.handshaking == 0);
+
+  memset (&stats, 0, sizeof stats);
+
+  pthread_mutex_unlock (&mutex);
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+typedef enum {
+  STATS_CLIENT_TO_WS,
+  STATS_WS_TO_CLIENT,
+  STATS_N_DIRECTIONS
+} StatsDirection;
+
+/* the counters of one cockpit-ws instance */
+typedef struct _StatsInstance StatsInstance;
+
+void
+stats_connection_accepted (void);
+
+void
+stats_connection_plain (void);
+
+void
+stats_handshake_started (struct timespec *out_start);
+
+void
+stats_handshake_finished (const struct timespec *start,
+                          int                    result);
+
+StatsInstance *
+stats_instance_ref (const char *wsinstance);
+
+void
+stats_instance_unref (StatsInstance *instance);
+
+void
+stats_add_bytes (StatsInstance  *instance,
+                 StatsDirection  direction,
+                 size_t          bytes);
+
+void
+stats_buffer_full (StatsDirection direction);
+
+void
+stats_print (FILE     *stream,
+             unsigned  n_connections);
+
+void
+stats_cleanup (void);
@@ -27,18 +27,28 @@
 #include <netinet/in.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gnutls/x509.h>
 
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
+
+#include "admission.h"
+#include "buffer-pool.h"
 #include "connection.h"
+#include "session-cache.h"
+#include "socket-io.h"
 #include "testing.h"
 #include "server.h"
 #include "utils.h"
 #include "testlib/cockpittest.h"
 #include "common/cockpithacks-glib.h"
+#include "common/cockpitjson.h"
 
 #define SOCKET_ACTIVATION_HELPER BUILDDIR "/socket-activation-helper"
 #define COCKPIT_WS BUILDDIR "/cockpit-ws"
@@ -56,6 +66,8 @@ typedef struct {
   gchar *ws_socket_dir;
   gchar *runtime_dir;
   gchar *clients_dir;
+  gchar *stats_socket;
+  gchar *config_dir;
   gchar *cgroup_line;
   GPid ws_spawner;
   struct sockaddr_in server_addr;
@@ -69,6 +81,12 @@ typedef struct {
   const char *client_crt;
   const char *client_key;
   const char *client_fingerprint;
+  unsigned workers;
+  unsigned max_handshakes;
+  unsigned session_cache;
+  bool stats;
+  bool proxy_header;
+  AdmissionLimits admission;
 } TestFixture;
 
 static const TestFixture fixture_separate_crt_key = {
@@ -107,6 +125,127 @@ static const TestFixture fixture_run_idle = {
   .idle_timeout = 1,
 };
 
+static const TestFixture fixture_processes = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .idle_timeout = 1,
+};
+
+static const TestFixture fixture_workers = {
+  .workers = 2,
+};
+
+static const TestFixture fixture_workers_handshake_limit = {
+  .workers = 2,
+  .max_handshakes = 1,
+};
+
+static const TestFixture fixture_workers_crt_key = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 2,
+};
+
+static const TestFixture fixture_workers_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+  .workers = 2,
+};
+
+static const TestFixture fixture_workers_alternate_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = ALTERNATE_CERTFILE,
+  .client_key = ALTERNATE_KEYFILE,
+  .client_fingerprint = ALTERNATE_FINGERPRINT,
+  .workers = 2,
+};
+
+static const TestFixture fixture_session_cache = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .session_cache = 10,
+};
+
+static const TestFixture fixture_workers_session_cache = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .session_cache = 10,
+  .workers = 2,
+};
+
+static const TestFixture fixture_stats = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .stats = true,
+};
+
+static const TestFixture fixture_admission = {
+  .stats = true,
+  .admission = { .max_connections_per_source = 2 },
+};
+
+static const TestFixture fixture_admission_rate = {
+  .stats = true,
+  .admission = { .max_connections_per_source = 1, .max_rate = 2 },
+};
+
+static const TestFixture fixture_workers_admission = {
+  .workers = 2,
+  .stats = true,
+  .admission = { .max_connections_per_source = 2 },
+};
+
+static const TestFixture fixture_workers_stats = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .stats = true,
+  .workers = 2,
+};
+
+static const TestFixture fixture_proxy_header = {
+  .proxy_header = true,
+};
+
+static const TestFixture fixture_proxy_header_crt_key = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .proxy_header = true,
+};
+
+static const TestFixture fixture_workers_proxy_header_crt_key = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 2,
+  .proxy_header = true,
+};
+
+static const TestFixture fixture_proxy_header_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+  .proxy_header = true,
+};
+
+static const TestFixture fixture_workers_proxy_header_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+  .workers = 2,
+  .proxy_header = true,
+};
+
 /* for forking test cases, where server's SIGCHLD handling gets in the way */
 static void
 block_sigchld (void)
@@ -151,6 +290,20 @@ check_for_certfile (TestCase *tc,
   return false;
 }
 
+/* count all client certificate files, for any cgroup */
+static unsigned
+count_certfiles (TestCase *tc)
+{
+  g_autoptr(GDir) dir = g_dir_open (tc->clients_dir, 0, NULL);
+  g_assert (dir != NULL);
+
+  unsigned count = 0;
+  while (g_dir_read_name (dir))
+    count++;
+
+  return count;
+}
+
 static int
 do_connect (TestCase *tc)
 {
@@ -376,8 +529,21 @@ setup (TestCase *tc, gconstpointer data)
   if (fixture && fixture->client_fingerprint)
     tc->cgroup_line = g_strdup_printf ("0::/system.slice/system-cockpithttps.slice/cockpit-wsinstance-https@%s.service\n", fixture->client_fingerprint);
 
+  /* the cockpit-ws instances need to expect the PROXY header */
+  g_auto(GStrv) sah_envp = g_get_environ ();
+  if (fixture && fixture->proxy_header)
+    {
+      tc->config_dir = g_dir_make_tmp ("server.config.XXXXXX", NULL);
+      g_assert (tc->config_dir);
+      g_autofree gchar *cockpit_dir = g_build_filename (tc->config_dir, "cockpit", NULL);
+      g_assert_cmpint (g_mkdir (cockpit_dir, 0700), ==, 0);
+      g_autofree gchar *conf = g_build_filename (cockpit_dir, "cockpit.conf", NULL);
+      g_assert (g_file_set_contents (conf, "[WebService]\nProxyProtocol = true\n", -1, NULL));
+      sah_envp = g_environ_setenv (sah_envp, "XDG_CONFIG_DIRS", tc->config_dir, TRUE);
+    }
+
   gchar* sah_argv[] = { SOCKET_ACTIVATION_HELPER, COCKPIT_WS, tc->ws_socket_dir, NULL };
-  if (!g_spawn_async (NULL, sah_argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &tc->ws_spawner, &error))
+  if (!g_spawn_async (NULL, sah_argv, sah_envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &tc->ws_spawner, &error))
     g_error ("Failed to spawn " SOCKET_ACTIVATION_HELPER ": %s", error->message);
 
   /* wait until socket activation helper is ready */
@@ -391,11 +557,25 @@ setup (TestCase *tc, gconstpointer data)
     }
   close (socket_dir_fd);
 
+  if (fixture)
+    admission_set_limits (&fixture->admission);
+
   /* Let the kernel assign a port */
   server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, 0);
+  connection_set_proxy_header (fixture && fixture->proxy_header);
 
   if (fixture && fixture->certfile)
-    connection_crypto_init (fixture->certfile, fixture->keyfile, false, fixture->cert_request_mode);
+    connection_crypto_init (fixture->certfile, fixture->keyfile, false, fixture->cert_request_mode,
+                            fixture->session_cache);
+
+  if (fixture && fixture->workers)
+    server_start_workers (fixture->workers, fixture->max_handshakes);
+
+  if (fixture && fixture->stats)
+    {
+      tc->stats_socket = g_build_filename (tc->runtime_dir, "stats.sock", NULL);
+      server_listen_stats (tc->stats_socket);
+    }
 
   /* Figure out the socket address we ought to connect to */
   socklen_t addrlen = sizeof tc->server_addr;
@@ -438,6 +618,17 @@ teardown (TestCase *tc, gconstpointer data)
   g_free (tc->ws_socket_dir);
 
   g_free (tc->cgroup_line);
+  g_free (tc->stats_socket);
+
+  if (tc->config_dir)
+    {
+      g_autofree gchar *cockpit_dir = g_build_filename (tc->config_dir, "cockpit", NULL);
+      g_autofree gchar *conf = g_build_filename (cockpit_dir, "cockpit.conf", NULL);
+      g_assert_cmpint (g_unlink (conf), ==, 0);
+      g_assert_cmpint (g_rmdir (cockpit_dir), ==, 0);
+      g_assert_cmpint (g_rmdir (tc->config_dir), ==, 0);
+      g_free (tc->config_dir);
+    }
 
   g_assert_cmpint (g_rmdir (tc->clients_dir), ==, 0);
   g_free (tc->clients_dir);
@@ -603,6 +794,44 @@ test_tls_redirect (TestCase *tc, gconstpointer data)
   cockpit_assert_strmatch (res, "HTTP/1.1 301 Moved Permanently*");
 }
 
+static void
+test_tls_redirect_incremental (TestCase *tc, gconstpointer data)
+{
+  static const char * const pieces[] = {
+    "GE", "T /path?query HT", "TP/1.1\r", "\nHo", "st:  some.remote:1234\r\n", "Accept: */*\r\n", "\r\n"
+  };
+  char buf[4096];
+  int fd;
+
+  /* Make sure we connect on something other than localhost */
+  tc->server_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK + 1);
+
+  /* the request trickles in */
+  fd = do_connect (tc);
+  for (unsigned i = 0; i < N_ELEMENTS (pieces); i++)
+    {
+      send_request (fd, pieces[i]);
+      server_poll_event (50);
+    }
+  for (int timeout = 0; timeout < 100 && recv (fd, buf, 100, MSG_PEEK | MSG_DONTWAIT) < 50; ++timeout)
+    server_poll_event (100);
+  g_assert_cmpstr (recv_reply (fd, buf, sizeof buf), ==,
+                   "HTTP/1.1 301 Moved Permanently\r\n"
+                   "Content-Type: text/html\r\n"
+                   "Location: https://some.remote:1234/path?query\r\n"
+                   "\r\n");
+
+  /* a second Host: header is invalid */
+  fd = do_connect (tc);
+  send_request (fd, "GET / HTTP/1.1\nHost: a\nHost: b\n\n");
+  for (int timeout = 0; timeout < 100 && recv (fd, buf, 100, MSG_PEEK | MSG_DONTWAIT) < 40; ++timeout)
+    server_poll_event (100);
+  g_assert_cmpint (recv (fd, buf, sizeof buf - 1, MSG_DONTWAIT), ==, 47);
+  buf[47] = '\0';
+  cockpit_assert_strmatch (buf, "HTTP/1.1 400 Client Error\r\n*");
+  close (fd);
+}
+
 static void
 test_tls_client_cert (TestCase *tc, gconstpointer data)
 {
@@ -716,6 +945,8 @@ test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
             }
 
           g_assert (check_for_certfile (tc, NULL));
+          /* all connections share the same file */
+          g_assert_cmpuint (count_certfiles (tc), ==, 1);
         }
 
       /* close the connections again, all but the last one */
@@ -767,6 +998,263 @@ test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
   g_assert_cmpint (status, ==, 0);
 }
 
+/* stands in for https-factory.sock, and counts the requests */
+typedef struct {
+  int dirfd;
+  int listen_fd;
+  gint requests;
+  gint stop;
+} FakeFactory;
+
+static gpointer
+fake_factory_thread (gpointer data)
+{
+  FakeFactory *factory = data;
+
+  while (!g_atomic_int_get (&factory->stop))
+    {
+      struct pollfd pfd = { .fd = factory->listen_fd, .events = POLLIN };
+      if (poll (&pfd, 1, 100) <= 0)
+        continue;
+
+      int fd = accept4 (factory->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      g_assert_cmpint (fd, >=, 0);
+
+      char instance[100];
+      g_assert (recv_alnum (fd, instance, sizeof instance, 10 * 1000000));
+      g_assert_cmpstr (instance, ==, ALTERNATE_FINGERPRINT);
+      g_atomic_int_inc (&factory->requests);
+
+      /* take a while to start the instance, so that the other connections pile up */
+      g_usleep (500000);
+      renameat (factory->dirfd, "alternate.sock.stopped", factory->dirfd, "https@" ALTERNATE_FINGERPRINT ".sock");
+
+      g_assert (send_all (fd, "done", 4, 10 * 1000000));
+      close (fd);
+    }
+
+  return NULL;
+}
+
+static void
+test_tls_client_cert_activation (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  const unsigned n_connections = 20;
+  FakeFactory factory = { 0 };
+  GThread *thread;
+  pid_t pid;
+  int status = -1;
+
+  if (cockpit_test_skip_slow ())
+    return;
+
+  /* the instance isn't running yet, and the factory is ours */
+  factory.dirfd = open (tc->ws_socket_dir, O_RDONLY | O_DIRECTORY);
+  g_assert_cmpint (factory.dirfd, >=, 0);
+  g_assert_no_errno (renameat (factory.dirfd, "https@" ALTERNATE_FINGERPRINT ".sock",
+                               factory.dirfd, "alternate.sock.stopped"));
+  g_assert_no_errno (unlinkat (factory.dirfd, "https-factory.sock", 0));
+  factory.listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (factory.listen_fd, >=, 0);
+  g_assert_no_errno (af_unix_bindat (factory.listen_fd, factory.dirfd, "https-factory.sock"));
+  g_assert_no_errno (listen (factory.listen_fd, 32));
+  thread = g_thread_new ("fake-factory", fake_factory_thread, &factory);
+
+  block_sigchld ();
+
+  /* do the connections in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      int fds[n_connections];
+      gnutls_session_t sessions[n_connections];
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred,
+                                                             fixture->client_crt,
+                                                             fixture->client_key,
+                                                             GNUTLS_X509_FMT_PEM),
+                       ==, GNUTLS_E_SUCCESS);
+
+      /* all of them need the instance while it is still being started */
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          fds[i] = do_connect (tc);
+          g_assert_cmpint (fds[i], >, 0);
+
+          g_assert_cmpint (gnutls_init (&sessions[i], GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+          gnutls_transport_set_int (sessions[i], fds[i]);
+          g_assert_cmpint (gnutls_set_default_priority (sessions[i]), ==, GNUTLS_E_SUCCESS);
+          g_assert_cmpint (gnutls_credentials_set (sessions[i], GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+          gnutls_handshake_set_timeout (sessions[i], 5000);
+          g_assert_cmpint (gnutls_handshake (sessions[i]), ==, GNUTLS_E_SUCCESS);
+        }
+
+      /* ... and all of them get to talk to it */
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          char buffer[6];
+          ssize_t s;
+
+          do
+            s = gnutls_record_recv (sessions[i], buffer, sizeof buffer);
+          while (s == GNUTLS_E_INTERRUPTED);
+          g_assert_cmpint (s, ==, 5);
+          g_assert (memcmp (buffer, "hello", 5) == 0);
+        }
+
+      for (unsigned i = 0; i < n_connections; ++i)
+        {
+          g_assert_cmpint (gnutls_bye (sessions[i], GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+          close (fds[i]);
+        }
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 200 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+
+  g_atomic_int_set (&factory.stop, 1);
+  g_thread_join (thread);
+  close (factory.listen_fd);
+
+  /* only the first connection asked for it */
+  g_assert_cmpint (factory.requests, ==, 1);
+
+  g_assert_no_errno (faccessat (factory.dirfd, "https@" ALTERNATE_FINGERPRINT ".sock", F_OK, 0));
+  close (factory.dirfd);
+}
+
+/*
+ * Sends ALTERNATE_BULK_SIZE bytes to the alternate instance, which then
+ * sends them back.  With kTLS, that goes through the spliced path in
+ * both directions, otherwise through our ring buffers.
+ *
+ * With check_records, also check how the download got split into TLS
+ * records.  gnutls_record_recv() never returns data from more than one
+ * record, so each read is (at most) one record.
+ */
+static void
+do_bulk_transfer (TestCase          *tc,
+                  const TestFixture *fixture,
+                  bool               check_records)
+{
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+
+  /* do the connection in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_certificate_credentials_t xcred;
+      gnutls_session_t session;
+      unsigned char buffer[32 * 1024];
+      unsigned n_full_records = 0;
+      size_t done;
+      ssize_t s;
+      int fd;
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred,
+                                                             fixture->client_crt,
+                                                             fixture->client_key,
+                                                             GNUTLS_X509_FMT_PEM),
+                       ==, GNUTLS_E_SUCCESS);
+
+      fd = do_connect (tc);
+      g_assert_cmpint (fd, >, 0);
+
+      g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+      gnutls_transport_set_int (session, fd);
+      g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+      gnutls_handshake_set_timeout (session, 5000);
+      g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+
+      do
+        s = gnutls_record_recv (session, buffer, sizeof buffer);
+      while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+      g_assert_cmpint (s, ==, 5);
+      g_assert (memcmp (buffer, "hello", 5) == 0);
+
+      /* upload, in pieces which don't line up with anything */
+      for (done = 0; done < ALTERNATE_BULK_SIZE; done += s)
+        {
+          size_t size = MIN (ALTERNATE_BULK_SIZE - done, 10000);
+
+          for (size_t i = 0; i < size; i++)
+            buffer[i] = ALTERNATE_BULK_BYTE (done + i);
+          do
+            s = gnutls_record_send (session, buffer, size);
+          while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+          g_assert_cmpint (s, ==, size);
+        }
+
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+      /* with kTLS, the kernel decides about the records */
+      if (gnutls_transport_is_ktls_enabled (session) != 0)
+        check_records = false;
+#endif
+
+      /* download */
+      for (done = 0; done < ALTERNATE_BULK_SIZE; done += s)
+        {
+          do
+            s = gnutls_record_recv (session, buffer, sizeof buffer);
+          while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
+          g_assert_cmpint (s, >, 0);
+          g_assert_cmpuint (done + s, <=, ALTERNATE_BULK_SIZE);
+
+          for (ssize_t i = 0; i < s; i++)
+            if (buffer[i] != ALTERNATE_BULK_BYTE (done + i))
+              g_error ("unexpected data at offset %zu", done + i);
+
+          if (check_records)
+            {
+              g_assert_cmpint (s, <=, TLS_RECORD_FULL);
+              /* small records until the warmup is over (the "hello" counts too) */
+              if (done + 5 < TLS_RECORD_WARMUP_BYTES)
+                g_assert_cmpint (s, <=, TLS_RECORD_SMALL);
+              if (s == TLS_RECORD_FULL)
+                n_full_records++;
+            }
+        }
+
+      /* ... and then full ones */
+      if (check_records)
+        g_assert_cmpuint (n_full_records, >, 0);
+
+      g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+      close (fd);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 300 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (100);
+  g_assert_cmpint (status, ==, 0);
+}
+
+static void
+test_tls_bulk_transfer (TestCase *tc, gconstpointer data)
+{
+  do_bulk_transfer (tc, data, false);
+}
+
+static void
+test_tls_record_sizes (TestCase *tc, gconstpointer data)
+{
+  do_bulk_transfer (tc, data, true);
+}
+
 static void
 test_mixed_protocols (TestCase *tc, gconstpointer data)
 {
@@ -776,6 +1264,236 @@ test_mixed_protocols (TestCase *tc, gconstpointer data)
   assert_http (tc);
 }
 
+static void
+test_buffer_pool (TestCase *tc, gconstpointer data)
+{
+  BufferPoolStats stats[BUFFER_POOL_N_CLASSES];
+  unsigned in_use;
+
+  assert_http (tc);
+  assert_https (tc, data, 1);
+
+  /* all buffers go back to the pool once the data is through */
+  for (int timeout = 0; timeout < 100; ++timeout)
+    {
+      buffer_pool_get_stats (stats);
+      in_use = stats[0].in_use + stats[1].in_use;
+      if (in_use == 0)
+        break;
+      server_poll_event (100);
+    }
+
+  g_assert_cmpuint (in_use, ==, 0);
+  g_assert_cmpuint (stats[0].size, ==, BUFFER_POOL_SMALL);
+  g_assert_cmpuint (stats[0].high_water, >, 0);
+  g_assert_cmpuint (stats[0].idle, ==, stats[0].high_water);
+}
+
+static JsonObject *
+get_stats (TestCase *tc)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  g_autoptr(GString) data = g_string_new (NULL);
+  g_autoptr(GError) error = NULL;
+  char buf[4096];
+  ssize_t len;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd, >, 0);
+  g_strlcpy (addr.sun_path, tc->stats_socket, sizeof addr.sun_path);
+  g_assert_no_errno (connect (fd, (struct sockaddr *) &addr, sizeof addr));
+
+  /* the server answers from its main loop */
+  g_assert (server_poll_event (1000));
+
+  while ((len = read (fd, buf, sizeof buf)) > 0)
+    g_string_append_len (data, buf, len);
+  g_assert_cmpint (len, ==, 0);
+  close (fd);
+
+  JsonObject *stats = cockpit_json_parse_object (data->str, data->len, &error);
+  g_assert_no_error (error);
+
+  return stats;
+}
+
+static void
+test_stats (TestCase *tc, gconstpointer data)
+{
+  assert_http (tc);
+  assert_https (tc, data, 1);
+
+  g_autoptr(JsonObject) stats = get_stats (tc);
+
+  JsonObject *connections = json_object_get_object_member (stats, "connections");
+  g_assert_cmpint (json_object_get_int_member (connections, "accepted"), ==, 2);
+  g_assert_cmpint (json_object_get_int_member (connections, "plain"), ==, 1);
+
+  JsonObject *handshakes = json_object_get_object_member (stats, "handshakes");
+  g_assert_cmpint (json_object_get_int_member (handshakes, "started"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (handshakes, "succeeded"), ==, 1);
+
+  /* both requests got their replies through */
+  JsonObject *bytes = json_object_get_object_member (stats, "bytes");
+  g_assert_cmpint (json_object_get_int_member (bytes, "client-to-ws"), >, 0);
+  g_assert_cmpint (json_object_get_int_member (bytes, "ws-to-client"), >=, 100);
+
+  JsonArray *pool = json_object_get_array_member (stats, "buffer-pool");
+  g_assert_cmpuint (json_array_get_length (pool), ==, BUFFER_POOL_N_CLASSES);
+}
+
+static void
+test_workers_handshake_limit (TestCase *tc, gconstpointer data)
+{
+  char buf[4096];
+
+  /* this one never sends anything, so it keeps the only handshake slot... */
+  int blocking_fd = do_connect (tc);
+  g_assert_cmpint (blocking_fd, >, 0);
+
+  /* ... and this one has to wait for its turn */
+  int fd = do_connect (tc);
+  send_request (fd, "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n");
+
+  for (int i = 0; i < 10; i++)
+    server_poll_event (50);
+  g_assert_cmpint (recv (fd, buf, sizeof buf, MSG_PEEK | MSG_DONTWAIT), ==, -1);
+  g_assert_cmpint (errno, ==, EAGAIN);
+
+  /* giving up the slot lets the second connection through */
+  close (blocking_fd);
+  for (int timeout = 0; timeout < 100 && recv (fd, buf, 100, MSG_PEEK | MSG_DONTWAIT) < 100; ++timeout)
+    server_poll_event (100);
+  recv_reply (fd, buf, sizeof buf);
+  /* This succeeds (200 OK) when building in-tree, but fails with dist-check due to missing doc root */
+  if (strstr (buf, "200 OK"))
+    cockpit_assert_strmatch (buf, "HTTP/1.1 200 OK*");
+  else
+    cockpit_assert_strmatch (buf, "HTTP/1.1 404 Not Found*");
+}
+
+static void
+test_workers_handshake_limit_hangup (TestCase *tc, gconstpointer data)
+{
+  int fds[5];
+
+  /* keeps the only handshake slot */
+  int blocking_fd = do_connect (tc);
+  g_assert_cmpint (blocking_fd, >, 0);
+
+  for (unsigned i = 0; i < N_ELEMENTS (fds); i++)
+    {
+      fds[i] = do_connect (tc);
+      g_assert_cmpint (fds[i], >, 0);
+    }
+  for (int timeout = 0; timeout < 100 && server_num_connections () < 1 + N_ELEMENTS (fds); ++timeout)
+    server_poll_event (50);
+  g_assert_cmpuint (server_num_connections (), ==, 1 + N_ELEMENTS (fds));
+
+  /* clients which give up waiting don't keep their place in the queue */
+  for (unsigned i = 0; i < N_ELEMENTS (fds); i++)
+    close (fds[i]);
+  for (int timeout = 0; timeout < 100 && server_num_connections () > 1; ++timeout)
+    server_poll_event (50);
+  g_assert_cmpuint (server_num_connections (), ==, 1);
+
+  close (blocking_fd);
+}
+
+/* Does a HTTPS request in a forked client; returns whether the session got resumed */
+static bool
+do_resumable_request (TestCase *tc,
+                      bool use_tickets,
+                      gnutls_datum_t *session_data)
+{
+  const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+  char buf[4096];
+  gnutls_session_t session;
+  gnutls_certificate_credentials_t xcred;
+  bool resumed;
+  ssize_t len;
+  int fd = do_connect (tc);
+
+  g_assert_cmpint (fd, >, 0);
+
+  g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT | (use_tickets ? 0 : GNUTLS_NO_TICKETS)), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (session, fd);
+  /* session IDs are only used for resumption up to TLS 1.2 */
+  g_assert_cmpint (gnutls_priority_set_direct (session, use_tickets ? "NORMAL" : "NORMAL:-VERS-TLS1.3", NULL),
+                   ==, GNUTLS_E_SUCCESS);
+  gnutls_handshake_set_timeout (session, 5000);
+  g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+  if (session_data->data)
+    g_assert_cmpint (gnutls_session_set_data (session, session_data->data, session_data->size), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+  resumed = gnutls_session_is_resumed (session);
+
+  len = gnutls_record_send (session, request, sizeof (request));
+  g_assert_cmpint (len, ==, sizeof (request));
+  len = gnutls_record_recv (session, buf, sizeof (buf) - 1);
+  g_assert_cmpint (len, >=, 100);
+
+  /* with TLS 1.3, the ticket arrives after the handshake */
+  if (!session_data->data)
+    g_assert_cmpint (gnutls_session_get_data2 (session, session_data), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  close (fd);
+
+  return resumed;
+}
+
+static void
+assert_session_resumption (TestCase *tc,
+                           bool use_tickets)
+{
+  unsigned long full, resumed;
+  int status = -1;
+  pid_t pid;
+
+  block_sigchld ();
+
+  /* do the connections in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_datum_t session_data = { NULL, 0 };
+
+      g_assert_false (do_resumable_request (tc, use_tickets, &session_data));
+      g_assert (session_data.data);
+      g_assert_true (do_resumable_request (tc, use_tickets, &session_data));
+
+      gnutls_free (session_data.data);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (200);
+  g_assert_cmpint (status, ==, 0);
+
+  session_cache_get_counts (&full, &resumed);
+  g_assert_cmpuint (full, ==, 1);
+  g_assert_cmpuint (resumed, ==, 1);
+}
+
+static void
+test_tls_resume_ticket (TestCase *tc, gconstpointer data)
+{
+  assert_session_resumption (tc, true);
+}
+
+static void
+test_tls_resume_session_id (TestCase *tc, gconstpointer data)
+{
+  assert_session_resumption (tc, false);
+}
+
 static void
 test_run_idle (TestCase *tc, gconstpointer data)
 {
@@ -787,6 +1505,137 @@ test_run_idle (TestCase *tc, gconstpointer data)
   server_run ();
 }
 
+static void
+test_processes (TestCase *tc, gconstpointer data)
+{
+  int status = -1;
+  pid_t pid;
+
+  block_sigchld ();
+
+  /* keeps the group busy until the client is done, so that it does not
+   * reach the idle timeout before the client even started */
+  int idle_fd = do_connect (tc);
+  g_assert_cmpint (idle_fd, >, 0);
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_datum_t session_data = { NULL, 0 };
+
+      /* the connections get spread over the processes; resuming works
+       * everywhere, as they share the session ticket key */
+      g_assert_false (do_resumable_request (tc, true, &session_data));
+      for (int i = 0; i < 10; i++)
+        g_assert_true (do_resumable_request (tc, true, &session_data));
+
+      gnutls_free (session_data.data);
+      close (idle_fd);
+      exit (0);
+    }
+
+  close (idle_fd);
+
+  if (server_start_processes (3, false))
+    {
+      /* one of the processes: returns once the whole group is idle */
+      server_run ();
+      _exit (0);
+    }
+
+  /* the supervisor only returns after the group reached the idle timeout */
+  g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+  g_assert_cmpint (status, ==, 0);
+}
+
+static void
+test_admission (TestCase *tc, gconstpointer data)
+{
+  char c;
+
+  /* fill up the limit for localhost */
+  int fd1 = do_connect (tc);
+  int fd2 = do_connect (tc);
+  g_assert_cmpint (fd1, >, 0);
+  g_assert_cmpint (fd2, >, 0);
+  for (int retries = 0; retries < 10 && server_num_connections () < 2; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 2);
+
+  /* the next one gets reset right away */
+  int fd3 = do_connect (tc);
+  g_assert_cmpint (fd3, >, 0);
+  g_assert (server_poll_event (1000));
+  g_assert_cmpint (recv (fd3, &c, 1, 0), ==, -1);
+  g_assert_cmpint (errno, ==, ECONNRESET);
+  close (fd3);
+  g_assert_cmpuint (server_num_connections (), ==, 2);
+
+  /* once one goes away, there is room again */
+  close (fd1);
+  for (int retries = 0; retries < 10 && server_num_connections () == 2; ++retries)
+    server_poll_event (100);
+  assert_http (tc);
+  close (fd2);
+
+  g_autoptr(JsonObject) stats = get_stats (tc);
+  JsonObject *connections = json_object_get_object_member (stats, "connections");
+  g_assert_cmpint (json_object_get_int_member (connections, "accepted"), ==, 3);
+  JsonObject *rejected = json_object_get_object_member (connections, "rejected");
+  g_assert_cmpint (json_object_get_int_member (rejected, "source-connections"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (rejected, "connections"), ==, 0);
+}
+
+static void
+test_admission_rate (TestCase *tc, gconstpointer data)
+{
+  char buf[4096];
+  char c;
+
+  /* localhost uses up its limit */
+  int fd1 = do_connect (tc);
+  g_assert_cmpint (fd1, >, 0);
+  for (int retries = 0; retries < 10 && server_num_connections () < 1; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 1);
+
+  /* and keeps on trying, more often than the global rate allows */
+  for (int i = 0; i < 5; i++)
+    {
+      int fd = do_connect (tc);
+      g_assert_cmpint (fd, >, 0);
+      g_assert (server_poll_event (1000));
+      g_assert_cmpint (recv (fd, &c, 1, 0), ==, -1);
+      g_assert_cmpint (errno, ==, ECONNRESET);
+      close (fd);
+    }
+
+  /* that must not lock out another source */
+  const struct sockaddr_in other = { .sin_family = AF_INET, .sin_addr.s_addr = htonl (INADDR_LOOPBACK + 1) };
+  int fd2 = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd2, >, 0);
+  g_assert_no_errno (bind (fd2, (const struct sockaddr *) &other, sizeof other));
+  g_assert_no_errno (connect (fd2, (struct sockaddr *) &tc->server_addr, sizeof tc->server_addr));
+  send_request (fd2, "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n");
+  for (int timeout = 0; timeout < 100 && recv (fd2, buf, 100, MSG_PEEK | MSG_DONTWAIT) < 50; ++timeout)
+    server_poll_event (100);
+  const char *res = recv_reply (fd2, buf, sizeof buf);
+  /* This succeeds (200 OK) when building in-tree, but fails with dist-check due to missing doc root */
+  if (strstr (res, "200 OK"))
+    cockpit_assert_strmatch (res, "HTTP/1.1 200 OK*");
+  else
+    cockpit_assert_strmatch (res, "HTTP/1.1 404 Not Found*");
+  close (fd1);
+
+  g_autoptr(JsonObject) stats = get_stats (tc);
+  JsonObject *connections = json_object_get_object_member (stats, "connections");
+  JsonObject *rejected = json_object_get_object_member (connections, "rejected");
+  g_assert_cmpint (json_object_get_int_member (rejected, "source-connections"), ==, 5);
+  g_assert_cmpint (json_object_get_int_member (rejected, "rate"), ==, 0);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -812,16 +1661,78 @@ main (int argc, char *argv[])
               setup, test_tls_client_cert_parallel, teardown);
   g_test_add ("/server/tls/client-cert-parallel/alternate", TestCase, &fixture_alternate_client_cert,
               setup, test_tls_client_cert_parallel, teardown);
+  g_test_add ("/server/tls/client-cert-activation", TestCase, &fixture_alternate_client_cert,
+              setup, test_tls_client_cert_activation, teardown);
+  g_test_add ("/server/tls/bulk-transfer", TestCase, &fixture_alternate_client_cert,
+              setup, test_tls_bulk_transfer, teardown);
+  g_test_add ("/server/tls/record-sizes", TestCase, &fixture_alternate_client_cert,
+              setup, test_tls_record_sizes, teardown);
   g_test_add ("/server/tls/no-server-cert", TestCase, NULL,
               setup, test_tls_no_server_cert, teardown);
   g_test_add ("/server/tls/redirect", TestCase, &fixture_separate_crt_key,
               setup, test_tls_redirect, teardown);
+  g_test_add ("/server/tls/redirect/incremental", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_redirect_incremental, teardown);
   g_test_add ("/server/tls/blocked-handshake", TestCase, &fixture_separate_crt_key,
               setup, test_tls_blocked_handshake, teardown);
   g_test_add ("/server/mixed-protocols", TestCase, &fixture_separate_crt_key,
               setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/tls/resume/ticket", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_resume_ticket, teardown);
+  g_test_add ("/server/tls/resume/session-id", TestCase, &fixture_session_cache,
+              setup, test_tls_resume_session_id, teardown);
+  g_test_add ("/server/buffer-pool", TestCase, &fixture_separate_crt_key,
+              setup, test_buffer_pool, teardown);
+  g_test_add ("/server/stats", TestCase, &fixture_stats,
+              setup, test_stats, teardown);
+  g_test_add ("/server/admission", TestCase, &fixture_admission,
+              setup, test_admission, teardown);
+  g_test_add ("/server/admission/rate", TestCase, &fixture_admission_rate,
+              setup, test_admission_rate, teardown);
+  g_test_add ("/server/proxy-header/no-tls/many-serial", TestCase, &fixture_proxy_header,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/proxy-header/tls/client-cert", TestCase, &fixture_proxy_header_client_cert,
+              setup, test_tls_client_cert, teardown);
+  g_test_add ("/server/proxy-header/tls/redirect", TestCase, &fixture_proxy_header_crt_key,
+              setup, test_tls_redirect, teardown);
   g_test_add ("/server/run-idle", TestCase, &fixture_run_idle,
               setup, test_run_idle, teardown);
+  g_test_add ("/server/processes", TestCase, &fixture_processes,
+              setup, test_processes, teardown);
+  g_test_add ("/server/workers/no-tls/many-serial", TestCase, &fixture_workers,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/workers/no-tls/many-parallel", TestCase, &fixture_workers,
+              setup, test_no_tls_many_parallel, teardown);
+  g_test_add ("/server/workers/tls/client-cert-parallel", TestCase, &fixture_workers_client_cert,
+              setup, test_tls_client_cert_parallel, teardown);
+  g_test_add ("/server/workers/tls/client-cert-activation", TestCase, &fixture_workers_alternate_client_cert,
+              setup, test_tls_client_cert_activation, teardown);
+  g_test_add ("/server/workers/tls/bulk-transfer", TestCase, &fixture_workers_alternate_client_cert,
+              setup, test_tls_bulk_transfer, teardown);
+  g_test_add ("/server/workers/tls/record-sizes", TestCase, &fixture_workers_alternate_client_cert,
+              setup, test_tls_record_sizes, teardown);
+  g_test_add ("/server/workers/tls/blocked-handshake", TestCase, &fixture_workers_crt_key,
+              setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/workers/mixed-protocols", TestCase, &fixture_workers_crt_key,
+              setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/workers/handshake-limit", TestCase, &fixture_workers_handshake_limit,
+              setup, test_workers_handshake_limit, teardown);
+  g_test_add ("/server/workers/handshake-limit/hangup", TestCase, &fixture_workers_handshake_limit,
+              setup, test_workers_handshake_limit_hangup, teardown);
+  g_test_add ("/server/workers/buffer-pool", TestCase, &fixture_workers_crt_key,
+              setup, test_buffer_pool, teardown);
+  g_test_add ("/server/workers/proxy-header/tls/client-cert", TestCase, &fixture_workers_proxy_header_client_cert,
+              setup, test_tls_client_cert, teardown);
+  g_test_add ("/server/workers/proxy-header/tls/redirect", TestCase, &fixture_workers_proxy_header_crt_key,
+              setup, test_tls_redirect, teardown);
+  g_test_add ("/server/workers/stats", TestCase, &fixture_workers_stats,
+              setup, test_stats, teardown);
+  g_test_add ("/server/workers/admission", TestCase, &fixture_workers_admission,
+              setup, test_admission, teardown);
+  g_test_add ("/server/workers/tls/resume/ticket", TestCase, &fixture_workers_crt_key,
+              setup, test_tls_resume_ticket, teardown);
+  g_test_add ("/server/workers/tls/resume/session-id", TestCase, &fixture_workers_session_cache,
+              setup, test_tls_resume_session_id, teardown);
 
   return g_test_run ();
 }
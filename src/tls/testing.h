@@ -21,3 +21,7 @@
 
 #define CLIENT_CERT_FINGERPRINT "64b541b74b5c45cac5842677ff22619c0bed9b2bf8e91f65b1379141df0cba17"
 #define ALTERNATE_FINGERPRINT "8206a4f89a4ed1e734190a13c0b6a403b01ace0599f4bcb291884d000a5c9ec7"
+
+/* the alternate instance receives and then sends back this much data */
+#define ALTERNATE_BULK_SIZE (4 * 1024 * 1024)
+#define ALTERNATE_BULK_BYTE(i) ((unsigned char) ((i) % 251))
@@ -20,18 +20,50 @@
 #include "config.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
+
+#include "common/cockpitmemory.h"
 
 #include "socket-io.h"
 #include "utils.h"
 
 #define UNIT_MAX 256
 
+/* how long to wait for the fingerprint, and then for the job */
+#define RECEIVE_TIMEOUT_USEC (10 * 1000000)
+#define JOB_TIMEOUT_USEC (20 * 1000000)
+
+/* in daemon mode, exit after this long without any request */
+#define IDLE_TIMEOUT_USEC (90 * 1000000ull)
+
+static void
+format_unit_name (char       *unit,
+                  size_t      size,
+                  const char *instance)
+{
+  /* can't fail, because instance is small */
+  int r = snprintf (unit, size, "cockpit-wsinstance-https@%s.socket", instance);
+  assert (0 < r && r < size);
+}
+
+/***********************************
+ *
+ * One process per request
+ *
+ ***********************************/
+
 static int
 match_job_removed (sd_bus_message *message,
                    void           *user_data,
@@ -59,8 +91,8 @@ match_job_removed (sd_bus_message *message,
   return 0;
 }
 
-int
-main (void)
+static int
+run_single_request (void)
 {
   char instance[WSINSTANCE_MAX];
   sd_bus_error error = SD_BUS_ERROR_NULL;
@@ -68,13 +100,9 @@ main (void)
   char unit[UNIT_MAX + 1];
   sd_bus_message *reply = NULL;
   const char *job_path = NULL;
-  char **fdnames;
   int r;
 
-  if (sd_listen_fds_with_names (false, &fdnames) != 1 || strcmp (fdnames[0], "connection") != 0)
-    errx (EXIT_FAILURE, "Must be spawned from a systemd service on a socket with Accept=yes %s", fdnames[0]);
-
-  if (!recv_alnum (SD_LISTEN_FDS_START, instance, sizeof instance, 10 * 1000000))
+  if (!recv_alnum (SD_LISTEN_FDS_START, instance, sizeof instance, RECEIVE_TIMEOUT_USEC))
     errx (EXIT_FAILURE, "Didn't receive fingerprint");
 
   r = sd_bus_open_system (&bus);
@@ -101,9 +129,7 @@ main (void)
   if (r < 0)
     errx (EXIT_FAILURE, "Failed to install match rule: %s", strerror (-r));
 
-  /* can't fail, because instance is small */
-  r = snprintf (unit, sizeof unit, "cockpit-wsinstance-https@%s.socket", instance);
-  assert (0 < r && r < sizeof unit);
+  format_unit_name (unit, sizeof unit, instance);
 
   debug (FACTORY, "Requesting start of unit %s", unit);
   r = sd_bus_call_method (bus,
@@ -128,7 +154,7 @@ main (void)
 
   struct timespec start = { 0, 0 };
   uint64_t remaining;
-  while (job_path && get_remaining_timeout (&start, &remaining, 20 * 1000000))
+  while (job_path && get_remaining_timeout (&start, &remaining, JOB_TIMEOUT_USEC))
     {
       debug (FACTORY, "sd_bus_wait(%llu)", (long long) remaining);
       r = sd_bus_wait (bus, remaining);
@@ -150,3 +176,368 @@ main (void)
 
   return 0;
 }
+
+/***********************************
+ *
+ * Daemon mode
+ *
+ ***********************************/
+
+/* a connection to the factory socket, asking for one instance */
+typedef struct _Request Request;
+struct _Request {
+  int fd;
+  char instance[WSINSTANCE_MAX];
+  size_t length;
+
+  sd_event_source *io; /* while receiving the fingerprint */
+  sd_event_source *timeout;
+  sd_bus_slot *start_unit; /* while waiting for the StartUnit reply */
+  char *job_path; /* afterwards, while waiting for the job */
+
+  Request *next;
+};
+
+/* daemon mode state (singleton) */
+static struct {
+  sd_event *event;
+  sd_bus *bus;
+  sd_event_source *idle_timeout;
+  Request *requests;
+} factory;
+
+static int
+daemon_idle_timeout (sd_event_source *source,
+                     uint64_t         usec,
+                     void            *user_data)
+{
+  debug (FACTORY, "No requests for a while; exiting");
+
+  return sd_event_exit (factory.event, 0);
+}
+
+static void
+daemon_update_idle_timeout (void)
+{
+  uint64_t now;
+  int r;
+
+  if (factory.requests)
+    {
+      sd_event_source_set_enabled (factory.idle_timeout, SD_EVENT_OFF);
+      return;
+    }
+
+  r = sd_event_now (factory.event, CLOCK_MONOTONIC, &now);
+  assert (r >= 0);
+
+  if (factory.idle_timeout == NULL)
+    r = sd_event_add_time (factory.event, &factory.idle_timeout, CLOCK_MONOTONIC,
+                           now + IDLE_TIMEOUT_USEC, 0, daemon_idle_timeout, NULL);
+  else if ((r = sd_event_source_set_time (factory.idle_timeout, now + IDLE_TIMEOUT_USEC)) >= 0)
+    r = sd_event_source_set_enabled (factory.idle_timeout, SD_EVENT_ONESHOT);
+
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to set up idle timeout: %s", strerror (-r));
+}
+
+/* Closes the connection; without a reply, if we don't have one yet */
+static void
+request_free (Request *self)
+{
+  for (Request **r = &factory.requests; *r; r = &(*r)->next)
+    if (*r == self)
+      {
+        *r = self->next;
+        break;
+      }
+
+  sd_event_source_unref (self->io);
+  sd_event_source_unref (self->timeout);
+  sd_bus_slot_unref (self->start_unit);
+  free (self->job_path);
+  close (self->fd);
+  free (self);
+
+  daemon_update_idle_timeout ();
+}
+
+static int
+request_timeout (sd_event_source *source,
+                 uint64_t         usec,
+                 void            *user_data)
+{
+  Request *self = user_data;
+
+  warnx ("Timed out handling request%s%s", self->job_path ? " for job " : "",
+         self->job_path ? self->job_path : "");
+  request_free (self);
+
+  return 0;
+}
+
+static void
+request_set_timeout (Request  *self,
+                     uint64_t  timeout_usec)
+{
+  uint64_t now;
+  int r;
+
+  r = sd_event_now (factory.event, CLOCK_MONOTONIC, &now);
+  assert (r >= 0);
+
+  if (self->timeout == NULL)
+    r = sd_event_add_time (factory.event, &self->timeout, CLOCK_MONOTONIC,
+                           now + timeout_usec, 0, request_timeout, self);
+  else
+    r = sd_event_source_set_time (self->timeout, now + timeout_usec);
+
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to set up request timeout: %s", strerror (-r));
+}
+
+static int
+request_start_unit_reply (sd_bus_message *reply,
+                          void           *user_data,
+                          sd_bus_error   *error)
+{
+  Request *self = user_data;
+  const char *job_path;
+
+  self->start_unit = sd_bus_slot_unref (self->start_unit);
+
+  if (sd_bus_message_is_method_error (reply, NULL))
+    {
+      warnx ("Method call failed: %s", sd_bus_message_get_error (reply)->message);
+      request_free (self);
+      return 0;
+    }
+
+  if (sd_bus_message_read (reply, "o", &job_path) < 0)
+    {
+      warnx ("Invalid message response");
+      request_free (self);
+      return 0;
+    }
+
+  debug (FACTORY, "  -> job for %s is %s", self->instance, job_path);
+  self->job_path = strdupx (job_path);
+  request_set_timeout (self, JOB_TIMEOUT_USEC);
+
+  return 0;
+}
+
+static void
+request_start_unit (Request *self)
+{
+  char unit[UNIT_MAX + 1];
+  int r;
+
+  format_unit_name (unit, sizeof unit, self->instance);
+
+  debug (FACTORY, "Requesting start of unit %s", unit);
+  r = sd_bus_call_method_async (factory.bus, &self->start_unit,
+                                "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                                "org.freedesktop.systemd1.Manager", "StartUnit",
+                                request_start_unit_reply, self, "ss", unit, "replace");
+  if (r < 0)
+    {
+      warnx ("Failed to call StartUnit: %s", strerror (-r));
+      request_free (self);
+    }
+}
+
+/* Same protocol as recv_alnum(): an alphanumeric string, followed by EOF */
+static int
+request_readable (sd_event_source *source,
+                  int              fd,
+                  uint32_t         revents,
+                  void            *user_data)
+{
+  Request *self = user_data;
+  ssize_t s;
+
+  s = recv (self->fd, self->instance + self->length, sizeof self->instance - self->length, MSG_DONTWAIT);
+  if (s == -1)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        return 0;
+
+      warn ("Failed to receive fingerprint");
+      request_free (self);
+      return 0;
+    }
+
+  if (s > 0)
+    {
+      self->length += s;
+
+      if (self->length == sizeof self->instance)
+        {
+          warnx ("Didn't receive fingerprint: too long");
+          request_free (self);
+        }
+
+      return 0;
+    }
+
+  /* EOF */
+  self->instance[self->length] = '\0';
+  self->io = sd_event_source_unref (self->io);
+
+  for (size_t i = 0; i < self->length; i++)
+    if (!isalnum (self->instance[i]))
+      self->length = 0;
+
+  if (self->length == 0)
+    {
+      warnx ("Didn't receive fingerprint");
+      request_free (self);
+      return 0;
+    }
+
+  request_start_unit (self);
+  return 0;
+}
+
+static int
+daemon_accept (sd_event_source *source,
+               int              fd,
+               uint32_t         revents,
+               void            *user_data)
+{
+  Request *self;
+  int r;
+
+  int connection_fd = accept4 (fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (connection_fd == -1)
+    {
+      if (errno != EINTR && errno != EAGAIN)
+        warn ("Failed to accept connection");
+      return 0;
+    }
+
+  debug (FACTORY, "New request on fd %i", connection_fd);
+
+  self = callocx (1, sizeof (Request));
+  self->fd = connection_fd;
+  self->next = factory.requests;
+  factory.requests = self;
+  daemon_update_idle_timeout ();
+
+  r = sd_event_add_io (factory.event, &self->io, self->fd, EPOLLIN, request_readable, self);
+  if (r < 0)
+    {
+      warnx ("Failed to watch connection: %s", strerror (-r));
+      request_free (self);
+      return 0;
+    }
+
+  request_set_timeout (self, RECEIVE_TIMEOUT_USEC);
+
+  return 0;
+}
+
+static int
+daemon_job_removed (sd_bus_message *message,
+                    void           *user_data,
+                    sd_bus_error   *error)
+{
+  const char *result;
+  const char *path;
+
+  if (sd_bus_message_read (message, "uoss", NULL, &path, NULL, &result) < 0)
+    return 0;
+
+  debug (FACTORY, "Received JobRemoved signal: path: %s, result: %s", path, result);
+
+  /* systemd merges StartUnit calls for the same unit into one job, so
+   * several requests may be waiting for this one */
+  for (Request *request = factory.requests, *next; request; request = next)
+    {
+      next = request->next;
+
+      if (request->job_path && strcmp (request->job_path, path) == 0)
+        {
+          debug (FACTORY, "  -> sending result for %s.", request->instance);
+          send_all (request->fd, result, strlen (result), 5 * 1000000);
+          request_free (request);
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * run_daemon: Handle many requests in one process
+ *
+ * Keeps one connection to the system bus with the JobRemoved match for
+ * all requests, so that starting an instance only costs the StartUnit
+ * call itself.  Requests are handled concurrently, and each gets its
+ * own reply, so for cockpit-tls this is the same as one process per
+ * request.  Exits after being idle for a while; the socket stays with
+ * systemd, and the next request activates us again.
+ */
+static int
+run_daemon (int listen_fd)
+{
+  int r;
+
+  r = sd_event_default (&factory.event);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to create event loop: %s", strerror (-r));
+
+  r = sd_bus_open_system (&factory.bus);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to connect to system bus: %s", strerror (-r));
+
+  r = sd_bus_attach_event (factory.bus, factory.event, SD_EVENT_PRIORITY_NORMAL);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to attach bus to event loop: %s", strerror (-r));
+
+  r = sd_bus_match_signal_async (factory.bus, NULL,
+                                 "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                                 "org.freedesktop.systemd1.Manager", "JobRemoved",
+                                 daemon_job_removed, NULL, NULL);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to install match rule: %s", strerror (-r));
+
+  r = sd_event_add_io (factory.event, NULL, listen_fd, EPOLLIN, daemon_accept, NULL);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Failed to watch listening socket: %s", strerror (-r));
+
+  daemon_update_idle_timeout ();
+
+  debug (FACTORY, "Waiting for requests");
+  r = sd_event_loop (factory.event);
+  if (r < 0)
+    errx (EXIT_FAILURE, "Event loop failed: %s", strerror (-r));
+
+  while (factory.requests)
+    request_free (factory.requests);
+
+  sd_event_source_unref (factory.idle_timeout);
+  sd_bus_flush_close_unref (factory.bus);
+  sd_event_unref (factory.event);
+
+  return 0;
+}
+
+int
+main (void)
+{
+  char **fdnames;
+
+  if (sd_listen_fds_with_names (false, &fdnames) != 1)
+    errx (EXIT_FAILURE, "Must be spawned from a systemd service on a socket");
+
+  /* Accept=yes: one connection per process */
+  if (strcmp (fdnames[0], "connection") == 0)
+    return run_single_request ();
+
+  /* Accept=no: the listening socket */
+  if (sd_is_socket (SD_LISTEN_FDS_START, AF_UNIX, SOCK_STREAM, 1) > 0)
+    return run_daemon (SD_LISTEN_FDS_START);
+
+  errx (EXIT_FAILURE, "Must be spawned from a systemd service on a stream socket, not %s", fdnames[0]);
+}
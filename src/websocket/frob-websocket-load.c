@@ -0,0 +1,445 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for cockpit-ws or test-server: opens a number of
+ * WebSocket connections, each with an echo channel, and sends messages
+ * on them for a while, either at a fixed rate or keeping a window of
+ * them in flight. Then reports the throughput, and the latency from
+ * sending a message until its echo came back.
+ *
+ * Each message starts with the time it was sent, so nothing needs to
+ * be remembered about those in flight.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittransport.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  WebSocketConnection *web_socket;
+  gchar *channel;
+  GBytes *prefix;
+  gboolean ready;
+  guint64 sent;
+  guint64 in_flight;
+} Client;
+
+static gint opt_connections = 10;
+static gint opt_size = 1024;
+static gint opt_rate = 0;
+static gint opt_window = 1;
+static gint opt_duration = 10;
+static gchar *opt_payload = NULL;
+static gchar *opt_origin = NULL;
+static gchar **opt_headers = NULL;
+
+static Client *clients = NULL;
+static gint clients_ready = 0;
+
+static GMainLoop *loop = NULL;
+static gboolean sending = FALSE;
+static gboolean failed = FALSE;
+static gint64 start_time = 0;
+static gint64 last_received = 0;
+static guint rate_timeout = 0;
+
+static guint64 total_sent = 0;
+static guint64 total_received = 0;
+static guint64 bytes_received = 0;
+static GArray *latencies = NULL;
+
+static void
+send_message (Client *client)
+{
+  GString *string;
+  GBytes *payload;
+
+  string = g_string_sized_new (opt_size + 1);
+  g_string_printf (string, "%" G_GINT64_FORMAT " ", g_get_monotonic_time ());
+  while (string->len < opt_size)
+    g_string_append_c (string, 'x');
+
+  payload = g_string_free_to_bytes (string);
+  web_socket_connection_send (client->web_socket, WEB_SOCKET_DATA_TEXT, client->prefix, payload);
+  g_bytes_unref (payload);
+
+  client->sent++;
+  client->in_flight++;
+  total_sent++;
+}
+
+static void
+send_control (Client *client,
+              GBytes *command)
+{
+  static GBytes *control_prefix = NULL;
+
+  if (!control_prefix)
+    control_prefix = g_bytes_new_static ("\n", 1);
+
+  web_socket_connection_send (client->web_socket, WEB_SOCKET_DATA_TEXT, control_prefix, command);
+  g_bytes_unref (command);
+}
+
+static void
+maybe_finish (void)
+{
+  gint i;
+
+  if (sending)
+    return;
+
+  for (i = 0; i < opt_connections; i++)
+    {
+      if (clients[i].in_flight > 0)
+        return;
+    }
+
+  g_main_loop_quit (loop);
+}
+
+static gboolean
+on_rate_timeout (gpointer user_data)
+{
+  gint64 elapsed = g_get_monotonic_time () - start_time;
+  guint64 due = (guint64)opt_rate * elapsed / G_USEC_PER_SEC;
+  gint i;
+
+  for (i = 0; i < opt_connections; i++)
+    {
+      while (clients[i].sent < due)
+        send_message (clients + i);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+on_drain_timeout (gpointer user_data)
+{
+  g_printerr ("frob-websocket-load: gave up waiting for replies\n");
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static gboolean
+on_duration_timeout (gpointer user_data)
+{
+  g_printerr ("frob-websocket-load: done sending, waiting for replies\n");
+  sending = FALSE;
+  if (rate_timeout)
+    g_source_remove (rate_timeout);
+  rate_timeout = 0;
+
+  /* Don't wait forever for replies that got lost */
+  g_timeout_add_seconds (10, on_drain_timeout, NULL);
+  maybe_finish ();
+  return FALSE;
+}
+
+static void
+start_sending (void)
+{
+  gint i, j;
+
+  g_printerr ("frob-websocket-load: %d connections ready, sending for %d seconds\n",
+              opt_connections, opt_duration);
+
+  sending = TRUE;
+  start_time = g_get_monotonic_time ();
+  g_timeout_add_seconds (opt_duration, on_duration_timeout, NULL);
+
+  if (opt_rate > 0)
+    {
+      rate_timeout = g_timeout_add (10, on_rate_timeout, NULL);
+    }
+  else
+    {
+      for (i = 0; i < opt_connections; i++)
+        {
+          for (j = 0; j < opt_window; j++)
+            send_message (clients + i);
+        }
+    }
+}
+
+static void
+receive_control (Client *client,
+                 GBytes *payload)
+{
+  const gchar *command;
+  const gchar *channel;
+  const gchar *problem;
+  JsonObject *options;
+  JsonObject *init;
+
+  if (!cockpit_transport_parse_command (payload, &command, &channel, &options))
+    {
+      failed = TRUE;
+      g_main_loop_quit (loop);
+      return;
+    }
+
+  if (g_str_equal (command, "init") && !channel)
+    {
+      init = cockpit_transport_build_json ("command", "init", NULL);
+      json_object_set_int_member (init, "version", 1);
+      send_control (client, cockpit_json_write_bytes (init));
+      json_object_unref (init);
+
+      send_control (client, cockpit_transport_build_control ("command", "open",
+                                                             "channel", client->channel,
+                                                             "payload", opt_payload,
+                                                             NULL));
+    }
+  else if (g_str_equal (command, "ready") && g_strcmp0 (channel, client->channel) == 0)
+    {
+      client->ready = TRUE;
+      if (++clients_ready == opt_connections)
+        start_sending ();
+    }
+  else if (g_str_equal (command, "close"))
+    {
+      if (!cockpit_json_get_string (options, "problem", NULL, &problem))
+        problem = NULL;
+      g_printerr ("frob-websocket-load: %s closed: %s\n", channel ? channel : "connection",
+                  problem ? problem : "no problem");
+      failed = TRUE;
+      g_main_loop_quit (loop);
+    }
+
+  json_object_unref (options);
+}
+
+static void
+on_web_socket_message (WebSocketConnection *web_socket,
+                       WebSocketDataType type,
+                       GBytes *message,
+                       gpointer user_data)
+{
+  Client *client = user_data;
+  gchar *channel = NULL;
+  GBytes *payload;
+  const gchar *data;
+  gint64 latency;
+  gint64 sent;
+  gsize len;
+
+  payload = cockpit_transport_parse_frame (message, &channel);
+  if (!payload)
+    return;
+
+  if (!channel)
+    {
+      receive_control (client, payload);
+    }
+  else if (g_str_equal (channel, client->channel) && client->in_flight > 0)
+    {
+      /* The time it was sent comes first, see send_message() */
+      data = g_bytes_get_data (payload, &len);
+      sent = g_ascii_strtoll (data, NULL, 10);
+
+      last_received = g_get_monotonic_time ();
+      latency = last_received - sent;
+      g_array_append_val (latencies, latency);
+
+      client->in_flight--;
+      total_received++;
+      bytes_received += len;
+
+      if (sending && opt_rate == 0)
+        send_message (client);
+      else
+        maybe_finish ();
+    }
+
+  g_bytes_unref (payload);
+  g_free (channel);
+}
+
+static void
+on_web_socket_close (WebSocketConnection *web_socket,
+                     gpointer user_data)
+{
+  Client *client = user_data;
+  gushort code;
+
+  /* Only expected once we're done */
+  if (g_main_loop_is_running (loop))
+    {
+      code = web_socket_connection_get_close_code (web_socket);
+      g_printerr ("frob-websocket-load: %s closed early: %d %s\n", client->channel, code,
+                  code ? web_socket_connection_get_close_data (web_socket) : "");
+      failed = TRUE;
+      g_main_loop_quit (loop);
+    }
+}
+
+static gint
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  gint64 la = *(const gint64 *)a;
+  gint64 lb = *(const gint64 *)b;
+  return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static gdouble
+percentile_ms (gdouble percent)
+{
+  guint index = (latencies->len - 1) * percent / 100;
+  return g_array_index (latencies, gint64, index) / 1000.0;
+}
+
+static void
+report (void)
+{
+  gdouble seconds;
+
+  if (total_received == 0)
+    {
+      g_print ("no replies received\n");
+      return;
+    }
+
+  seconds = (gdouble)(last_received - start_time) / G_USEC_PER_SEC;
+  g_array_sort (latencies, compare_latency);
+
+  g_print ("connections: %d, message size: %d bytes, %s\n", opt_connections, opt_size,
+           opt_rate ? "fixed rate" : "window");
+  g_print ("messages:    %" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT " received in %.2f s\n",
+           total_sent, total_received, seconds);
+  g_print ("throughput:  %.0f messages/s, %.2f MB/s each way\n",
+           total_received / seconds, bytes_received / seconds / (1024 * 1024));
+  g_print ("latency:     p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           percentile_ms (50), percentile_ms (99), percentile_ms (100));
+
+  if (total_received < total_sent)
+    g_print ("missing:     %" G_GUINT64_FORMAT " messages\n", total_sent - total_received);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  const gchar *protocols[] = { "cockpit1", NULL };
+  GOptionContext *options;
+  GError *error = NULL;
+  gchar **parts;
+  Client *client;
+  gint i, j;
+
+  GOptionEntry entries[] = {
+    { "connections", 'c', 0, G_OPTION_ARG_INT, &opt_connections, "Number of WebSocket connections", "count" },
+    { "size", 's', 0, G_OPTION_ARG_INT, &opt_size, "Message size in bytes", "bytes" },
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &opt_rate, "Messages per second per connection, rather than a window", "rate" },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &opt_window, "Messages in flight per connection", "count" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration, "How long to send for", "seconds" },
+    { "payload", 0, 0, G_OPTION_ARG_STRING, &opt_payload, "Channel payload type that echoes, default: echo", "type" },
+    { "origin", 0, 0, G_OPTION_ARG_STRING, &opt_origin, "Web Socket Origin", "url" },
+    { "header", 'H', 0, G_OPTION_ARG_STRING_ARRAY, &opt_headers, "Extra request header, such as a Cookie", "'Name: value'" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  options = g_option_context_new ("URL");
+  g_option_context_set_summary (options, "Example: frob-websocket-load -c 50 -H 'Cookie: cockpit=...' ws://localhost:9090/cockpit/socket");
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-websocket-load: %s\n", error->message);
+      return 2;
+    }
+
+  if (argc != 2)
+    {
+      g_printerr ("frob-websocket-load: specify the url to connect to\n");
+      return 2;
+    }
+
+  if (opt_connections <= 0 || opt_size < 32 || opt_rate < 0 || opt_window <= 0 || opt_duration <= 0)
+    {
+      g_printerr ("frob-websocket-load: invalid options, and the size must be at least 32 bytes\n");
+      return 2;
+    }
+
+  if (!opt_payload)
+    opt_payload = g_strdup ("echo");
+
+  loop = g_main_loop_new (NULL, FALSE);
+  latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+  clients = g_new0 (Client, opt_connections);
+
+  for (i = 0; i < opt_connections; i++)
+    {
+      client = clients + i;
+
+      /* Connections with the same cookie share one session, and its channel ids */
+      client->channel = g_strdup_printf ("load-%d", i);
+      client->prefix = g_bytes_new_take (g_strdup_printf ("%s\n", client->channel),
+                                         strlen (client->channel) + 1);
+
+      client->web_socket = web_socket_client_new (argv[1], opt_origin, protocols);
+      for (j = 0; opt_headers && opt_headers[j]; j++)
+        {
+          parts = g_strsplit (opt_headers[j], ":", 2);
+          if (parts[0] && parts[1])
+            web_socket_client_include_header (WEB_SOCKET_CLIENT (client->web_socket),
+                                              g_strstrip (parts[0]), g_strstrip (parts[1]));
+          g_strfreev (parts);
+        }
+
+      g_signal_connect (client->web_socket, "message", G_CALLBACK (on_web_socket_message), client);
+      g_signal_connect (client->web_socket, "close", G_CALLBACK (on_web_socket_close), client);
+    }
+
+  g_main_loop_run (loop);
+
+  if (!failed && clients_ready == opt_connections)
+    report ();
+
+  for (i = 0; i < opt_connections; i++)
+    {
+      client = clients + i;
+      g_signal_handlers_disconnect_by_data (client->web_socket, client);
+      if (web_socket_connection_get_ready_state (client->web_socket) == WEB_SOCKET_STATE_OPEN)
+        web_socket_connection_close (client->web_socket, WEB_SOCKET_CLOSE_NORMAL, NULL);
+      g_object_unref (client->web_socket);
+      g_bytes_unref (client->prefix);
+      g_free (client->channel);
+    }
+
+  g_free (clients);
+  g_array_free (latencies, TRUE);
+  g_main_loop_unref (loop);
+  g_option_context_free (options);
+  g_strfreev (opt_headers);
+  g_free (opt_payload);
+  g_free (opt_origin);
+
+  return failed ? 1 : 0;
+}
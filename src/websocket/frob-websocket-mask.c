@@ -0,0 +1,117 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for the WebSocket masking implementations: unmasks
+ * payloads of the given size, the way incoming frames get unmasked, and
+ * prints the throughput of each implementation next to the scalar loop.
+ */
+
+#include "config.h"
+
+#include "websocketprivate.h"
+
+static const gchar *implementations[] = { "scalar", "word", "sse2", "avx2" };
+
+static gdouble
+run_benchmark (WebSocketMaskFunc func,
+               guint8 *buffer,
+               gsize size,
+               gint seconds)
+{
+  const guint8 key[] = { 0x37, 0xfa, 0x21, 0x3d };
+  gint64 start, now, end;
+  guint64 bytes = 0;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  end = start + seconds * G_USEC_PER_SEC;
+
+  do
+    {
+      /* Like an incoming frame, moved to where the mask was */
+      for (i = 0; i < 100; i++)
+        func (key, buffer, buffer + 4, size);
+      bytes += 100 * size;
+      now = g_get_monotonic_time ();
+    }
+  while (now < end);
+
+  return (gdouble)bytes / (now - start); /* bytes per µs, that is MB/s */
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  WebSocketMaskFunc func;
+  gint seconds = 1;
+  gint size = 64 * 1024;
+  gdouble scalar = 0;
+  gdouble rate;
+  guint8 *buffer;
+  guint i;
+
+  GOptionEntry entries[] = {
+    { "size", 0, 0, G_OPTION_ARG_INT, &size, "Payload size in bytes", "bytes" },
+    { "seconds", 0, 0, G_OPTION_ARG_INT, &seconds, "How long to run each implementation", "seconds" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-websocket-mask: %s\n", error->message);
+      return 2;
+    }
+
+  if (size <= 0 || seconds <= 0)
+    {
+      g_printerr ("frob-websocket-mask: size and seconds must be positive\n");
+      return 2;
+    }
+
+  /* Misaligned on purpose, as the payload comes after a frame header */
+  buffer = g_malloc (size + 4 + 3);
+  for (i = 0; i < size + 4 + 3; i++)
+    buffer[i] = g_random_int ();
+
+  for (i = 0; i < G_N_ELEMENTS (implementations); i++)
+    {
+      func = _web_socket_mask_lookup (implementations[i]);
+      if (!func)
+        {
+          g_print ("%-8s not supported\n", implementations[i]);
+          continue;
+        }
+
+      rate = run_benchmark (func, buffer + 3, size, seconds);
+      if (i == 0)
+        scalar = rate;
+      g_print ("%-8s %10.1f MB/s  %5.1fx%s\n", implementations[i], rate, rate / scalar,
+               func == _web_socket_mask_lookup (NULL) ? "  (default)" : "");
+    }
+
+  g_free (buffer);
+  g_option_context_free (options);
+  return 0;
+}
@@ -27,6 +27,7 @@
 #include "testlib/mock-pressure.h"
 
 #include <string.h>
+#include <sys/socket.h>
 
 typedef struct {
   WebSocketConnection *client;
@@ -447,6 +448,56 @@ test_header_empty (void)
   g_hash_table_unref (headers);
 }
 
+static void
+test_mask (gconstpointer data)
+{
+  const gchar *implementation = data;
+  const guint8 key[] = { 0x12, 0x34, 0x56, 0x78 };
+  WebSocketMaskFunc func;
+  guint8 input[300];
+  guint8 expect[300];
+  guint8 buffer[300];
+  gsize offset;
+  gsize len;
+  gsize n;
+
+  func = _web_socket_mask_lookup (implementation);
+  if (!func)
+    {
+      g_test_skip ("not supported on this CPU");
+      return;
+    }
+
+  for (n = 0; n < sizeof (input); n++)
+    input[n] = g_random_int ();
+
+  /* All the alignments, and lengths around the block sizes */
+  for (offset = 0; offset < 36; offset++)
+    {
+      for (len = 0; len < sizeof (input) - offset - 4; len++)
+        {
+          for (n = 0; n < len; n++)
+            expect[n] = input[offset + 4 + n] ^ key[n & 3];
+
+          /* In place */
+          memcpy (buffer, input, sizeof (buffer));
+          func (key, buffer + offset + 4, buffer + offset + 4, len);
+          g_assert (memcmp (buffer + offset + 4, expect, len) == 0);
+          g_assert (memcmp (buffer, input, offset + 4) == 0);
+          g_assert (memcmp (buffer + offset + 4 + len, input + offset + 4 + len,
+                            sizeof (buffer) - offset - 4 - len) == 0);
+
+          /* Moved to where the mask was, like incoming frames */
+          memcpy (buffer, input, sizeof (buffer));
+          func (key, buffer + offset, buffer + offset + 4, len);
+          g_assert (memcmp (buffer + offset, expect, len) == 0);
+          g_assert (memcmp (buffer, input, offset) == 0);
+          g_assert (memcmp (buffer + offset + 4 + len, input + offset + 4 + len,
+                            sizeof (buffer) - offset - 4 - len) == 0);
+        }
+    }
+}
+
 static gboolean
 on_error_not_reached (WebSocketConnection *ws,
                       GError *error,
@@ -664,6 +715,138 @@ test_send_big_packets (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_message_hold (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  g_assert (received != NULL);
+  g_ptr_array_add (received, g_bytes_ref (message));
+}
+
+static void
+test_send_many_messages (Test *test,
+                         gconstpointer data)
+{
+  GPtrArray *received;
+  GBytes *sent;
+  const gchar *contents;
+  gchar *expect;
+  gsize len;
+  guint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_message_hold), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Lots of small messages, and some big ones, many of which arrive in one read */
+  for (i = 0; i < 2000; i++)
+    {
+      len = (i % 100 == 0) ? 50 * 1000 + i : (i % 200) + 1;
+      sent = g_bytes_new_take (g_strnfill (len, 'a' + i % 26), len);
+      web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      g_bytes_unref (sent);
+    }
+
+  WAIT_UNTIL (received->len == 2000);
+
+  /* Holding on to the messages, they must not have changed */
+  for (i = 0; i < received->len; i++)
+    {
+      contents = g_bytes_get_data (received->pdata[i], &len);
+      g_assert_cmpuint (len, ==, (i % 100 == 0) ? 50 * 1000 + i : (i % 200) + 1);
+      expect = g_strnfill (len, 'a' + i % 26);
+      g_assert (memcmp (contents, expect, len) == 0);
+      g_assert (contents[len] == '\0');
+      g_free (expect);
+    }
+
+  g_ptr_array_free (received, TRUE);
+}
+
+static void
+test_send_deflated (Test *test,
+                    gconstpointer data)
+{
+  gboolean enabled = GPOINTER_TO_INT (data);
+  WebSocketCompressionStats stats;
+  GBytes *received = NULL;
+  GBytes *sent;
+  const gchar *contents;
+  gsize len;
+
+  /* Must be set before the handshake, which happens in the main loop */
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->server, "permessage-deflate", enabled, NULL);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Compressible, and then too small to be worth it */
+  sent = g_bytes_new_take (g_strnfill (100 * 1000, 'x'), 100 * 1000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  contents = g_bytes_get_data (received, &len);
+  g_assert (contents[len] == '\0');
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  sent = g_bytes_new_static ("small", 5);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+
+  web_socket_connection_get_compression_stats (test->client, &stats);
+  g_assert_cmpuint (stats.sent, ==, 100 * 1000 + 5);
+  web_socket_connection_get_compression_stats (test->server, &stats);
+  g_assert_cmpuint (stats.received, ==, 100 * 1000 + 5);
+
+  if (enabled)
+    g_assert_cmpuint (stats.received_wire, <, 1000);
+  else
+    g_assert_cmpuint (stats.received_wire, ==, 100 * 1000 + 5);
+}
+
+static void
+test_max_payload_deflated (Test *test,
+                           gconstpointer unused)
+{
+  GError *error = NULL;
+  GBytes *sent;
+  guint logid;
+
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->server, "permessage-deflate", TRUE, "max-payload", (guint64)1000, NULL);
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* Small on the wire, but too large once inflated */
+  sent = g_bytes_new_take (g_strnfill (100 * 1000, 'x'), 100 * 1000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_TOO_BIG);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) == WEB_SOCKET_STATE_CLOSED);
+  g_assert_cmpuint (web_socket_connection_get_close_code (test->client), ==, WEB_SOCKET_CLOSE_TOO_BIG);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
 static void
 on_pressure_set_throttle (WebSocketConnection *socket,
                           gboolean throttle,
@@ -711,6 +894,100 @@ test_pressure_queue (Test *test,
   g_assert_cmpint (throttle, ==, 0);
 }
 
+#define SHORT_WRITES_MESSAGES 200
+
+static gsize
+short_writes_message_length (gint i)
+{
+  /* Small ones get copied into their frame, large ones are sent from their chunks */
+  return (i % 2) ? 15 * 1000 + i : 10 + (i * 37) % 1000;
+}
+
+static void
+test_send_short_writes (Test *test,
+                        gconstpointer data)
+{
+  gsize remaining[SHORT_WRITES_MESSAGES + 1];
+  GPtrArray *received;
+  GSocket *socket;
+  GError *error = NULL;
+  GBytes *prefix;
+  GBytes *sent;
+  gint throttle = -1;
+  const gchar *contents;
+  gchar *string;
+  gsize amount;
+  gsize len;
+  gint i, j;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_hold), received);
+  g_signal_connect (test->server, "pressure", G_CALLBACK (on_pressure_set_throttle), &throttle);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* With tiny socket buffers, most writes are short, and end anywhere in a frame */
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (web_socket_connection_get_io_stream (test->server)));
+  g_socket_set_option (socket, SOL_SOCKET, SO_SNDBUF, 4096, &error);
+  g_assert_no_error (error);
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (web_socket_connection_get_io_stream (test->client)));
+  g_socket_set_option (socket, SOL_SOCKET, SO_RCVBUF, 4096, &error);
+  g_assert_no_error (error);
+
+  /* The buffered amount once the first i messages are sent */
+  remaining[SHORT_WRITES_MESSAGES] = 0;
+  for (i = SHORT_WRITES_MESSAGES - 1; i >= 0; i--)
+    remaining[i] = remaining[i + 1] + short_writes_message_length (i);
+
+  for (i = 0; i < SHORT_WRITES_MESSAGES; i++)
+    {
+      len = short_writes_message_length (i);
+      string = g_strdup_printf ("%d:", i);
+      prefix = g_bytes_new_take (string, strlen (string));
+      sent = g_bytes_new_take (g_strnfill (len - g_bytes_get_size (prefix), 'a' + i % 26),
+                               len - g_bytes_get_size (prefix));
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, sent);
+      g_bytes_unref (prefix);
+      g_bytes_unref (sent);
+    }
+
+  /* More than enough to put on the pressure */
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, remaining[0]);
+  g_assert_cmpint (throttle, ==, 1);
+
+  /*
+   * Only frames which went out whole are no longer buffered, and none
+   * can be both sent and missing on the other side.
+   */
+  j = 0;
+  while (received->len < SHORT_WRITES_MESSAGES)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      amount = web_socket_connection_get_buffered_amount (test->server);
+      while (j < SHORT_WRITES_MESSAGES && remaining[j] > amount)
+        j++;
+      g_assert_cmpuint (remaining[j], ==, amount);
+      g_assert_cmpint (j, >=, received->len);
+    }
+
+  for (i = 0; i < SHORT_WRITES_MESSAGES; i++)
+    {
+      contents = g_bytes_get_data (received->pdata[i], &len);
+      g_assert_cmpuint (len, ==, short_writes_message_length (i));
+      string = g_strdup_printf ("%d:", i);
+      g_assert (g_str_has_prefix (contents, string));
+      g_assert (contents[len - 1] == 'a' + i % 26);
+      g_free (string);
+    }
+
+  /* And the queue accounting went back to where the pressure is off */
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+  g_assert_cmpint (throttle, ==, 0);
+
+  g_ptr_array_free (received, TRUE);
+}
+
 static void
 test_pressure_throttle (Test *test,
                         gconstpointer data)
@@ -796,6 +1073,165 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+test_send_prefixed_large (Test *test,
+                          gconstpointer data)
+{
+  GBytes *prefix = NULL;
+  GBytes *payload = NULL;
+  GBytes *received = NULL;
+  gchar *contents;
+  gsize length;
+  gsize i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Big enough to be sent from the caller's data, rather than a copy */
+  length = 3 * 1000 * 1000;
+  contents = g_malloc (length);
+  for (i = 0; i < length; i++)
+    contents[i] = 'a' + (i % 26);
+
+  prefix = g_bytes_new_static ("channel\n", 8);
+  payload = g_bytes_new_take (contents, length);
+
+  /* The frame holds on to the data after the caller is done with it */
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, payload);
+  g_bytes_unref (prefix);
+
+  WAIT_UNTIL (received != NULL);
+  g_assert_cmpint (g_bytes_get_size (received), ==, length + 8);
+  g_assert (memcmp (g_bytes_get_data (received, NULL), "channel\n", 8) == 0);
+  g_assert (memcmp ((const gchar *)g_bytes_get_data (received, NULL) + 8,
+                    g_bytes_get_data (payload, NULL), length) == 0);
+  g_bytes_unref (received);
+  received = NULL;
+
+  /* And the same again without a prefix */
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+  g_bytes_unref (payload);
+
+  WAIT_UNTIL (received != NULL);
+  g_assert_cmpint (g_bytes_get_size (received), ==, length);
+  for (i = 0; i < length; i++)
+    g_assert_cmpint (((const gchar *)g_bytes_get_data (received, NULL))[i], ==, 'a' + (i % 26));
+  g_bytes_unref (received);
+}
+
+static void
+test_send_tagged (Test *test,
+                  gconstpointer data)
+{
+  GPtrArray *received;
+  GBytes *sent;
+  gchar *contents;
+  gint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_hold), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* A bulk transfer, all queued before anything goes out */
+  for (i = 0; i < 20; i++)
+    {
+      contents = g_strnfill (64 * 1024, 'a' + i);
+      sent = g_bytes_new_take (contents, 64 * 1024);
+      web_socket_connection_send_tagged (test->server, WEB_SOCKET_DATA_TEXT, "bulk", 1, NULL, sent);
+      g_bytes_unref (sent);
+    }
+
+  /* Something interactive, which doesn't have to wait for all of that */
+  sent = g_bytes_new_static ("key", 3);
+  web_socket_connection_send_tagged (test->server, WEB_SOCKET_DATA_TEXT, "terminal", 8, NULL, sent);
+  g_bytes_unref (sent);
+
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 20 * 64 * 1024 + 3);
+
+  WAIT_UNTIL (received->len == 21);
+  g_assert_cmpstr (g_bytes_get_data (received->pdata[0], NULL), ==, "key");
+
+  /* And the bulk transfer arrives whole and in order */
+  for (i = 0; i < 20; i++)
+    {
+      g_assert_cmpuint (g_bytes_get_size (received->pdata[i + 1]), ==, 64 * 1024);
+      g_assert_cmpint (((const gchar *)g_bytes_get_data (received->pdata[i + 1], NULL))[0], ==, 'a' + i);
+    }
+
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+  g_ptr_array_free (received, TRUE);
+}
+
+static GBytes *
+build_tagged_message (const gchar *tag,
+                      gint number)
+{
+  GString *string = g_string_new ("");
+
+  while (string->len < 16 * 1024)
+    g_string_append_printf (string, "%s message %d\n", tag, number);
+  return g_string_free_to_bytes (string);
+}
+
+static void
+test_send_tagged_deflated (Test *test,
+                           gconstpointer data)
+{
+  WebSocketCompressionStats stats;
+  GPtrArray *received;
+  GBytes *expect;
+  GBytes *sent;
+  gint i;
+
+  /* Must be set before the handshake, which happens in the main loop */
+  g_object_set (test->client, "permessage-deflate", TRUE, NULL);
+  g_object_set (test->server, "permessage-deflate", TRUE, NULL);
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_hold), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /*
+   * Similar messages with two tags, which go out in another order than
+   * they were queued in. Each gets compressed with the context of the
+   * ones before, so the client can only inflate them if that's the
+   * order in which they were compressed.
+   */
+  for (i = 0; i < 10; i++)
+    {
+      sent = build_tagged_message ("bulk", i);
+      web_socket_connection_send_tagged (test->server, WEB_SOCKET_DATA_TEXT, "bulk", 1, NULL, sent);
+      g_bytes_unref (sent);
+    }
+  sent = build_tagged_message ("terminal", 0);
+  web_socket_connection_send_tagged (test->server, WEB_SOCKET_DATA_TEXT, "terminal", 8, NULL, sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (received->len == 11);
+
+  expect = build_tagged_message ("terminal", 0);
+  g_assert (g_bytes_equal (received->pdata[0], expect));
+  g_bytes_unref (expect);
+
+  for (i = 0; i < 10; i++)
+    {
+      expect = build_tagged_message ("bulk", i);
+      g_assert (g_bytes_equal (received->pdata[i + 1], expect));
+      g_bytes_unref (expect);
+    }
+
+  web_socket_connection_get_compression_stats (test->server, &stats);
+  g_assert_cmpuint (stats.sent_wire, <, stats.sent / 10);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+  g_ptr_array_free (received, TRUE);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -834,6 +1270,49 @@ test_send_bad_data (Test *test,
   g_log_remove_handler (G_LOG_DOMAIN, logid);
 }
 
+static void
+test_max_payload (Test *test,
+                  gconstpointer unused)
+{
+  GBytes *received = NULL;
+  GError *error = NULL;
+  GBytes *sent;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  /* Bigger than the default */
+  g_object_set (test->server, "max-payload", (guint64)1024 * 1024, NULL);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+
+  sent = g_bytes_new_take (g_strnfill (512 * 1024, 'x'), 512 * 1024);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (received);
+  g_bytes_unref (sent);
+
+  /* And smaller */
+  g_object_set (test->server, "max-payload", (guint64)1000, NULL);
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  sent = g_bytes_new_take (g_strnfill (2000, 'x'), 2000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_TOO_BIG);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) == WEB_SOCKET_STATE_CLOSED);
+  g_assert_cmpuint (web_socket_connection_get_close_code (test->client), ==, WEB_SOCKET_CLOSE_TOO_BIG);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
 static void
 test_protocol_negotiate (Test *test,
                          gconstpointer unused)
@@ -1047,7 +1526,8 @@ test_message_after_closing (Test *test,
 }
 
 static void
-mock_perform_handshake (GIOStream *io)
+mock_perform_handshake_with (GIOStream *io,
+                             const gchar *extra_headers)
 {
   GHashTable *headers;
   gchar buffer[1024];
@@ -1076,7 +1556,8 @@ mock_perform_handshake (GIOStream *io)
                       "Upgrade: websocket\r\n"
                       "Connection: Upgrade\r\n"
                       "Sec-WebSocket-Accept: %s\r\n"
-                      "\r\n", accept);
+                      "%s"
+                      "\r\n", accept, extra_headers);
   g_free (accept);
 
   if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
@@ -1087,6 +1568,12 @@ mock_perform_handshake (GIOStream *io)
   g_hash_table_unref (headers);
 }
 
+static void
+mock_perform_handshake (GIOStream *io)
+{
+  mock_perform_handshake_with (io, "");
+}
+
 static gpointer
 handshake_then_timeout_server_thread (gpointer user_data)
 {
@@ -1183,6 +1670,278 @@ test_receive_fragmented (void)
   g_object_unref (io_b);
 }
 
+static gpointer
+send_split_utf8_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  /* The euro sign is split between the first two fragments */
+  const gchar fragments[] = "\x01\x05""one \xe2"     /* !fin | opcode */
+                            "\x00\x06""\x82\xactwo "  /* !fin | no opcode */
+                            "\x80\x05""three";       /* fin  | no opcode */
+
+  mock_perform_handshake (io);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  fragments, sizeof (fragments) -1, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, sizeof (fragments) - 1);
+
+  return NULL;
+}
+
+typedef struct {
+  GByteArray *data;
+  guint count;
+  gboolean last;
+} Fragments;
+
+static void
+on_fragment_collect (WebSocketConnection *ws,
+                     WebSocketDataType type,
+                     GBytes *fragment,
+                     gboolean last,
+                     gpointer user_data)
+{
+  Fragments *fragments = user_data;
+  gsize len;
+  const gchar *data = g_bytes_get_data (fragment, &len);
+
+  g_assert_cmpint (type, ==, WEB_SOCKET_DATA_TEXT);
+  g_assert (!fragments->last);
+  g_assert (data[len] == '\0');
+
+  g_byte_array_append (fragments->data, (const guint8 *)data, len);
+  fragments->count++;
+  fragments->last = last;
+}
+
+static void
+test_receive_fragmented_utf8 (gconstpointer data)
+{
+  gboolean streaming = GPOINTER_TO_INT (data);
+  WebSocketConnection *client;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  GBytes *received = NULL;
+  Fragments fragments = { g_byte_array_new (), 0, FALSE };
+
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("fragment-thread", send_split_utf8_server_thread, io_a);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "stream-fragments", streaming, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (client, "fragment", G_CALLBACK (on_fragment_collect), &fragments);
+
+  if (streaming)
+    {
+      WAIT_UNTIL (fragments.last);
+      g_assert_cmpuint (fragments.count, ==, 3);
+      g_assert_cmpuint (fragments.data->len, ==, 16);
+      g_assert (memcmp (fragments.data->data, "one \xe2\x82\xactwo three", 16) == 0);
+      g_assert (received == NULL);
+    }
+  else
+    {
+      WAIT_UNTIL (received != NULL);
+      g_assert_cmpstr (g_bytes_get_data (received, NULL), ==, "one \xe2\x82\xactwo three");
+      g_assert_cmpuint (fragments.count, ==, 0);
+      g_bytes_unref (received);
+    }
+
+  g_byte_array_unref (fragments.data);
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_deflated_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  /* The examples from RFC 7692 section 7.2.3.2, the second one using the context of the first */
+  const gchar frames[] = "\xc1\x07""\xf2\x48\xcd\xc9\xc9\x07\x00"
+                         "\xc1\x05""\xf2\x00\x11\x00\x00";
+
+  mock_perform_handshake_with (io, "Sec-WebSocket-Extensions: permessage-deflate\r\n");
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frames, sizeof (frames) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, sizeof (frames) - 1);
+
+  return NULL;
+}
+
+static void
+test_receive_deflated (void)
+{
+  WebSocketConnection *client;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  GPtrArray *received;
+  WebSocketCompressionStats stats;
+
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("deflate-thread", send_deflated_server_thread, io_a);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "permessage-deflate", TRUE, NULL);
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_hold), received);
+
+  WAIT_UNTIL (received->len == 2);
+  g_assert_cmpstr (g_bytes_get_data (received->pdata[0], NULL), ==, "Hello");
+  g_assert_cmpstr (g_bytes_get_data (received->pdata[1], NULL), ==, "Hello");
+
+  web_socket_connection_get_compression_stats (client, &stats);
+  g_assert_cmpuint (stats.received, ==, 10);
+  g_assert_cmpuint (stats.received_wire, ==, 12);
+
+  g_ptr_array_free (received, TRUE);
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_deflated_fragments_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  /* 800 and then 700 bytes of 'x', each fragment alone under the limit */
+  const gchar frames[] = "\x41\x0f""\xaa\xa8\x18\x05\xa3\x60\x14\xe0\x02\x00\x00\x00\x00\xff\xff"
+                         "\x80\x08""\x1a\x05\xa3\x60\xa8\x02\x00\x00";
+
+  mock_perform_handshake_with (io, "Sec-WebSocket-Extensions: permessage-deflate\r\n");
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frames, sizeof (frames) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, sizeof (frames) - 1);
+
+  return NULL;
+}
+
+static void
+test_receive_deflated_fragments_too_big (void)
+{
+  WebSocketConnection *client;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  GError *error = NULL;
+  guint logid;
+
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("deflate-thread", send_deflated_fragments_server_thread, io_a);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "permessage-deflate", TRUE, "stream-fragments", TRUE,
+                "max-payload", (guint64)1000, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_copy), &error);
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_TOO_BIG);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_large_frames_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  GOutputStream *output;
+  gchar *payload;
+  gsize written;
+  gsize i;
+
+  /* A binary frame of 1 MiB, then one which claims 64 MiB, with hardly any of it */
+  const gchar large[] = "\x82\x7f""\x00\x00\x00\x00\x00\x10\x00\x00";
+  const gchar huge[] = "\x82\x7f""\x00\x00\x00\x00\x04\x00\x00\x00""not much";
+
+  mock_perform_handshake (io);
+  output = g_io_stream_get_output_stream (io);
+
+  if (!g_output_stream_write_all (output, large, sizeof (large) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  /* The payload trickles in */
+  payload = g_strnfill (64 * 1024, 'x');
+  for (i = 0; i < 16; i++)
+    {
+      if (!g_output_stream_write_all (output, payload, 64 * 1024, &written, NULL, NULL))
+        g_assert_not_reached ();
+      g_output_stream_flush (output, NULL, NULL);
+      g_usleep (1000);
+    }
+  g_free (payload);
+
+  if (!g_output_stream_write_all (output, huge, sizeof (huge) - 1, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  g_io_stream_close (io, NULL, NULL);
+  return NULL;
+}
+
+static void
+test_receive_large_frames (void)
+{
+  WebSocketConnection *client;
+  GPtrArray *received;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  const gchar *data;
+  gsize len;
+  guint logid;
+
+  cockpit_socket_streampair (&io_a, &io_b);
+  thread = g_thread_new ("large-thread", send_large_frames_server_thread, io_a);
+
+  /*
+   * Room for a frame gets made as its payload arrives, not when its
+   * header claims it, even when the peer can send as much as this.
+   */
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "max-payload", (guint64)64 * 1024 * 1024, NULL);
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_hold), received);
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* The peer hangs up in the middle of the huge frame */
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_CLOSED);
+
+  g_assert_cmpuint (received->len, ==, 1);
+  data = g_bytes_get_data (received->pdata[0], &len);
+  g_assert_cmpuint (len, ==, 1024 * 1024);
+  g_assert (data[0] == 'x' && data[len - 1] == 'x');
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+  g_ptr_array_free (received, TRUE);
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
 static gpointer
 client_thread (gpointer data)
 {
@@ -1271,8 +2030,13 @@ main (int argc,
       { test_send_client_to_server, "send-client-to-server" },
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
+      { test_send_many_messages, "send-many-messages" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_prefixed_large, "send-prefixed-large" },
+      { test_send_tagged, "send-tagged" },
+      { test_send_short_writes, "send-short-writes" },
       { test_send_bad_data, "send-bad-data" },
+      { test_max_payload, "max-payload" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
       { test_protocol_negotiate, "protocol-negotiate" },
@@ -1314,6 +2078,11 @@ main (int argc,
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
+  g_test_add_data_func ("/web-socket/mask/scalar", "scalar", test_mask);
+  g_test_add_data_func ("/web-socket/mask/word", "word", test_mask);
+  g_test_add_data_func ("/web-socket/mask/sse2", "sse2", test_mask);
+  g_test_add_data_func ("/web-socket/mask/avx2", "avx2", test_mask);
+  g_test_add_data_func ("/web-socket/mask/default", NULL, test_mask);
 
   for (j = 0; j < G_N_ELEMENTS (tests_with_client_server_pair); j++)
     {
@@ -1326,6 +2095,21 @@ main (int argc,
   if (g_test_slow ())
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
+  g_test_add_data_func ("/web-socket/receive-fragmented-utf8", GINT_TO_POINTER (FALSE),
+                        test_receive_fragmented_utf8);
+  g_test_add_data_func ("/web-socket/receive-streamed", GINT_TO_POINTER (TRUE),
+                        test_receive_fragmented_utf8);
+  g_test_add_func ("/web-socket/receive-deflated", test_receive_deflated);
+  g_test_add_func ("/web-socket/receive-deflated-fragments-too-big", test_receive_deflated_fragments_too_big);
+  g_test_add_func ("/web-socket/receive-large-frames", test_receive_large_frames);
+  g_test_add ("/web-socket/send-deflated", Test, GINT_TO_POINTER (TRUE),
+              setup_pair, test_send_deflated, teardown);
+  g_test_add ("/web-socket/send-deflated-declined", Test, GINT_TO_POINTER (FALSE),
+              setup_pair, test_send_deflated, teardown);
+  g_test_add ("/web-socket/max-payload-deflated", Test, NULL,
+              setup_pair, test_max_payload_deflated, teardown);
+  g_test_add ("/web-socket/send-tagged-deflated", Test, NULL,
+              setup_pair, test_send_tagged_deflated, teardown);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
 
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
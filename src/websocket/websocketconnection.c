@@ -85,11 +85,15 @@ enum {
   PROP_READY_STATE,
   PROP_BUFFERED_AMOUNT,
   PROP_IO_STREAM,
+  PROP_PERMESSAGE_DEFLATE,
+  PROP_STREAM_FRAGMENTS,
+  PROP_MAX_PAYLOAD,
 };
 
 enum {
   OPEN,
   MESSAGE,
+  FRAGMENT,
   ERROR,
   CLOSING,
   CLOSE,
@@ -98,13 +102,32 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * A frame is written out from up to three chunks: the header, and the
+ * prefix and payload as the caller passed them, so those don't get copied.
+ */
+#define MAX_FRAME_CHUNKS   3
+
 typedef struct {
-  GBytes *data;
+  GBytes *chunks[MAX_FRAME_CHUNKS];
+  guint n_chunks;
+  gsize length;
   gboolean last;
   gsize sent;
   gsize amount;
+
+  /* Set while a tagged message waits to be compressed, its chunks then being the message */
+  guint8 deflate_opcode;
 } Frame;
 
+/* The frames queued with one tag, see web_socket_connection_send_tagged() */
+typedef struct {
+  gchar *tag;
+  guint weight;
+  gsize deficit;
+  GQueue frames;
+} Flow;
+
 typedef struct
 {
   /* FALSE if client, TRUE if server */
@@ -137,27 +160,92 @@ typedef struct
   GSource *input_source;
   GByteArray *incoming;
 
+  /*
+   * Once the handshake is done, input gets read into blocks, and frames
+   * get parsed in place. Unfragmented messages are passed on as slices
+   * of the block, so parts of it before input_start may be in use.
+   */
+  GBytes *input_block;
+  guint8 *input_data;
+  gsize input_size;
+  gsize input_start;
+  gsize input_end;
+  gboolean input_shared;
+  gsize input_needed;
+  gsize read_size;
+
   GPollableOutputStream *output;
   GSource *output_source;
   gsize output_queued;
   GQueue outgoing;
 
-  /* Current message being assembled */
+  /* Tagged frames, which take turns to move to outgoing once it's empty */
+  GHashTable *flows;
+  GQueue active_flows;
+
+  /* Current message being assembled, or streamed */
   guint8 message_opcode;
   GByteArray *message_data;
+  gboolean message_compressed;
+  gboolean message_streaming;
+  guint64 message_inflated;
+
+  /* The start of a UTF-8 character split across fragments */
+  guint8 message_utf8[4];
+  gsize message_utf8_len;
+
+  /* Emit the fragments of messages as they come, and the largest frame to accept */
+  gboolean stream_fragments;
+  guint64 max_payload;
+
+  /* permessage-deflate: whether to use it, and its state once negotiated */
+  gboolean permessage_deflate;
+  WebSocketDeflate *deflate;
+  WebSocketCompressionStats compression;
 
   /* Pressure which throttles input on this web socket */
   CockpitFlow *pressure;
   gulong pressure_sig;
 } WebSocketConnectionPrivate;
 
-#define MAX_PAYLOAD   128 * 1024
+/* The default max-payload, and how large it may be set */
+#define MAX_PAYLOAD         128 * 1024
+#define MAX_PAYLOAD_LIMIT   64 * 1024 * 1024
+
+/* How much we try to read at once, adapted to how much the peer sends */
+#define READ_SIZE_MIN   4096
+#define READ_SIZE_MAX   256 * 1024
+
+/* Smaller messages aren't worth compressing */
+#define DEFLATE_THRESHOLD   256
+
+/* How many chunks of queued frames get written at once */
+#define MAX_OUTPUT_VECTORS   64
+
+/* Smaller messages get copied in with the frame header, rather than referenced */
+#define COPY_THRESHOLD   1024
+
+/* How much a tag may send per turn and unit of weight, and how much to schedule at once */
+#define FLOW_QUANTUM   4 * 1024
+#define FLOW_BATCH     64 * 1024
 
 /* The queue size above which we consider applying back pressure */
 #define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
 
 static void    web_socket_connection_flow_iface_init        (CockpitFlowInterface *iface);
 
+static void    queue_chunks                                 (WebSocketConnection *self,
+                                                             WebSocketQueueFlags flags,
+                                                             const gchar *tag,
+                                                             guint weight,
+                                                             guint8 deflate_opcode,
+                                                             GBytes **chunks,
+                                                             guint n_chunks,
+                                                             gsize amount);
+
+static void    deflate_frame                                (WebSocketConnectionPrivate *pv,
+                                                             Frame *frame);
+
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT,
                                   G_ADD_PRIVATE(WebSocketConnection)
                                   G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, web_socket_connection_flow_iface_init));
@@ -168,20 +256,93 @@ static void
 frame_free (gpointer data)
 {
   Frame *frame = data;
+  guint i;
+
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      for (i = 0; i < frame->n_chunks; i++)
+        g_bytes_unref (frame->chunks[i]);
       g_slice_free (Frame, frame);
     }
 }
 
+static void
+flow_free (gpointer data)
+{
+  Flow *flow = data;
+
+  while (!g_queue_is_empty (&flow->frames))
+    frame_free (g_queue_pop_head (&flow->frames));
+  g_free (flow->tag);
+  g_slice_free (Flow, flow);
+}
+
+/*
+ * Moves tagged frames to the outgoing queue by deficit round robin: each
+ * turn a tag gets to send a quantum in proportion to its weight, and what
+ * it doesn't use carries over to its next turn. A tag is forgotten once
+ * it has nothing more queued.
+ */
+static void
+schedule_flows (WebSocketConnectionPrivate *pv)
+{
+  gsize moved = 0;
+  Frame *frame;
+  Flow *flow;
+
+  while (moved < FLOW_BATCH && !g_queue_is_empty (&pv->active_flows))
+    {
+      flow = g_queue_pop_head (&pv->active_flows);
+      flow->deficit += FLOW_QUANTUM * flow->weight;
+
+      while ((frame = g_queue_peek_head (&flow->frames)) && frame->length <= flow->deficit)
+        {
+          g_queue_pop_head (&flow->frames);
+          flow->deficit -= frame->length;
+          moved += frame->length;
+          if (frame->deflate_opcode)
+            deflate_frame (pv, frame);
+          g_queue_push_tail (&pv->outgoing, frame);
+        }
+
+      if (g_queue_is_empty (&flow->frames))
+        g_hash_table_remove (pv->flows, flow->tag);
+      else
+        g_queue_push_tail (&pv->active_flows, flow);
+    }
+}
+
+/* Moves all tagged frames to the outgoing queue, such as before closing */
+static void
+flush_flows (WebSocketConnectionPrivate *pv)
+{
+  Frame *frame;
+  Flow *flow;
+
+  while (!g_queue_is_empty (&pv->active_flows))
+    {
+      flow = g_queue_pop_head (&pv->active_flows);
+      while ((frame = g_queue_pop_head (&flow->frames)))
+        {
+          if (frame->deflate_opcode)
+            deflate_frame (pv, frame);
+          g_queue_push_tail (&pv->outgoing, frame);
+        }
+      g_hash_table_remove (pv->flows, flow->tag);
+    }
+}
+
 static void
 web_socket_connection_init (WebSocketConnection *self)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
 
   g_queue_init (&pv->outgoing);
+  pv->flows = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, flow_free);
+  g_queue_init (&pv->active_flows);
   pv->main_context = g_main_context_ref_thread_default ();
+  pv->read_size = READ_SIZE_MIN;
+  pv->max_payload = MAX_PAYLOAD;
 }
 
 static void
@@ -344,59 +505,50 @@ close_io_after_timeout (WebSocketConnection *self)
   g_source_attach (pv->close_timeout, pv->main_context);
 }
 
+/*
+ * Unmasks the payload which follows the 4 byte @mask, and moves it to
+ * where the mask was in the same pass. That leaves room to null terminate
+ * the payload without touching whatever follows the frame.
+ */
 static void
-xor_with_mask_rfc6455 (const guint8 *mask,
-                       guint8 *data,
-                       gsize len)
+unmask_rfc6455 (guint8 *mask,
+                gsize len)
 {
-  g_assert (mask != NULL);
-  g_assert (data != NULL);
+  guint8 key[4];
 
-  /* Do the masking */
-  for (gsize n = 0; n < len; n++)
-    data[n] ^= mask[n & 3];
+  memcpy (key, mask, 4);
+  _web_socket_mask (key, mask, mask + 4, len);
+  mask[len] = '\0';
 }
 
-static void
-send_prefixed_message_rfc6455 (WebSocketConnection *self,
-                               WebSocketQueueFlags flags,
-                               guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+/*
+ * Puts together the chunks a frame is written out from, and returns how
+ * many there are. A @compressed payload gets sent with RSV1 set.
+ */
+static guint
+build_frame_rfc6455 (WebSocketConnectionPrivate *pv,
+                     guint8 opcode,
+                     gboolean compressed,
+                     GBytes *prefix,
+                     GBytes *payload,
+                     GBytes **chunks)
 {
-  gsize amount;
+  guint n_chunks = 0;
+  gsize prefix_len = 0;
   GByteArray *bytes;
-  gsize frame_len;
+  guint8 key[4];
   guint8 *outer;
-  guint8 *mask = 0;
   guint8 *at;
   gsize len;
   guint64 size;
 
-  len = payload_len + prefix_len;
-  amount = len;
+  if (prefix)
+    prefix_len = g_bytes_get_size (prefix);
+  len = g_bytes_get_size (payload) + prefix_len;
 
-  bytes = g_byte_array_sized_new (14 + len);
+  bytes = g_byte_array_sized_new (14);
   outer = bytes->data;
-  outer[0] = 0x80 | opcode;
-
-  /* If control message, truncate payload */
-  if (opcode & 0x08)
-    {
-      if (len > 125)
-        {
-          g_warning ("Truncating WebSocket control message payload");
-          if (prefix_len > 125)
-              prefix_len = 125;
-          payload_len = 125 - prefix_len;
-          len = 125;
-        }
-
-      /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
-    }
+  outer[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
 
   size = len;
   if (size < 126)
@@ -429,27 +581,166 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
    * The server side doesn't need to mask, so we don't. There's
    * probably a client somewhere that's not expecting it.
    */
-  const gboolean is_client_side = !GET_PRIV(self)->server_side;
+  const gboolean is_client_side = !pv->server_side;
   if (is_client_side)
     {
       guint32 rand = g_random_int ();
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
-      memcpy (mask, &rand, sizeof (guint32));
+      memcpy (key, &rand, sizeof (guint32));
+      memcpy (outer + bytes->len, key, sizeof (key));
       bytes->len += 4;
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
+  /*
+   * Masking means copying anyway, and small messages are cheaper to copy
+   * than to write out as separate chunks. Otherwise the frame refers to
+   * the data of the caller, which GBytes promises won't change.
+   */
+  if (is_client_side || len < COPY_THRESHOLD)
+    {
+      g_byte_array_set_size (bytes, bytes->len + len);
+      at = bytes->data + bytes->len - len;
+      if (prefix_len > 0)
+        memcpy (at, g_bytes_get_data (prefix, NULL), prefix_len);
+      if (len > prefix_len)
+        memcpy (at + prefix_len, g_bytes_get_data (payload, NULL), len - prefix_len);
 
-  if (is_client_side)
-    xor_with_mask_rfc6455 (mask, at, len);
+      if (is_client_side)
+        _web_socket_mask (key, at, at, len);
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+      chunks[n_chunks++] = g_byte_array_free_to_bytes (bytes);
+    }
+  else
+    {
+      chunks[n_chunks++] = g_byte_array_free_to_bytes (bytes);
+      if (prefix_len > 0)
+        chunks[n_chunks++] = g_bytes_ref (prefix);
+      chunks[n_chunks++] = g_bytes_ref (payload);
+    }
+
+  return n_chunks;
+}
+
+static GBytes *
+compress_message (WebSocketConnectionPrivate *pv,
+                  GBytes *prefix,
+                  GBytes *payload)
+{
+  GBytes *compressed;
+
+  compressed = g_byte_array_free_to_bytes (_web_socket_deflate_compress (pv->deflate,
+                                           prefix ? g_bytes_get_data (prefix, NULL) : NULL,
+                                           prefix ? g_bytes_get_size (prefix) : 0,
+                                           g_bytes_get_data (payload, NULL), g_bytes_get_size (payload)));
+  pv->compression.sent_wire += g_bytes_get_size (compressed);
+  return compressed;
+}
+
+/*
+ * Compresses and frames a message that was queued with a tag. The peer
+ * inflates messages in the order they arrive, with the context left by
+ * the ones before, so this happens as the frame moves to outgoing, rather
+ * than when it was queued.
+ */
+static void
+deflate_frame (WebSocketConnectionPrivate *pv,
+               Frame *frame)
+{
+  GBytes *chunks[MAX_FRAME_CHUNKS];
+  GBytes *prefix = NULL;
+  GBytes *payload;
+  GBytes *compressed;
+  gsize len = 0;
+  guint n_chunks;
+  guint i;
+
+  g_assert (frame->sent == 0);
+
+  if (frame->n_chunks == 2)
+    prefix = frame->chunks[0];
+  payload = frame->chunks[frame->n_chunks - 1];
+
+  compressed = compress_message (pv, prefix, payload);
+  n_chunks = build_frame_rfc6455 (pv, frame->deflate_opcode, TRUE, NULL, compressed, chunks);
+  g_bytes_unref (compressed);
+
+  for (i = 0; i < frame->n_chunks; i++)
+    g_bytes_unref (frame->chunks[i]);
+  for (i = 0; i < n_chunks; i++)
+    {
+      frame->chunks[i] = chunks[i];
+      len += g_bytes_get_size (chunks[i]);
+    }
+  frame->n_chunks = n_chunks;
+  frame->deflate_opcode = 0;
+
+  g_assert (frame->length <= pv->output_queued);
+  pv->output_queued = pv->output_queued - frame->length + len;
+  frame->length = len;
+}
+
+static void
+send_prefixed_message_rfc6455 (WebSocketConnection *self,
+                               WebSocketQueueFlags flags,
+                               guint8 opcode,
+                               const gchar *tag,
+                               guint weight,
+                               GBytes *prefix,
+                               GBytes *payload)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GBytes *compressed = NULL;
+  GBytes *chunks[MAX_FRAME_CHUNKS];
+  guint8 deflate_opcode = 0;
+  guint n_chunks = 0;
+  gsize amount;
+  gsize len;
+
+  len = g_bytes_get_size (payload);
+  if (prefix)
+    len += g_bytes_get_size (prefix);
+  amount = len;
+
+  /* Data messages get compressed, if negotiated and worth it */
+  if (!(opcode & 0x08))
+    {
+      pv->compression.sent += len;
+      if (pv->deflate && len >= DEFLATE_THRESHOLD)
+        {
+          /* Tagged messages wait for their turn to be compressed, see deflate_frame() */
+          if (tag && !(flags & WEB_SOCKET_QUEUE_URGENT))
+            {
+              deflate_opcode = opcode;
+              if (prefix)
+                chunks[n_chunks++] = g_bytes_ref (prefix);
+              chunks[n_chunks++] = g_bytes_ref (payload);
+            }
+          else
+            {
+              compressed = compress_message (pv, prefix, payload);
+              n_chunks = build_frame_rfc6455 (pv, opcode, TRUE, NULL, compressed, chunks);
+              len = g_bytes_get_size (compressed);
+              g_bytes_unref (compressed);
+            }
+        }
+      else
+        {
+          pv->compression.sent_wire += len;
+        }
+    }
+
+  else
+    {
+      /* Already truncated, and buffered amount of bytes is zero for control messages */
+      g_assert (len <= 125);
+      amount = 0;
+    }
+
+  if (n_chunks == 0)
+    n_chunks = build_frame_rfc6455 (pv, opcode, FALSE, prefix, payload, chunks);
+
+  queue_chunks (self, flags, tag, weight, deflate_opcode, chunks, n_chunks, amount);
+  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)len);
 }
 
 static void
@@ -459,7 +750,18 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes;
+
+  /* If control message, truncate payload */
+  if ((opcode & 0x08) && payload_len > 125)
+    {
+      g_warning ("Truncating WebSocket control message payload");
+      payload_len = 125;
+    }
+
+  bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -470,6 +772,7 @@ send_close_rfc6455 (WebSocketConnection *self,
 {
   /* Note that send_message truncates as expected */
   gchar buffer[128];
+  gsize before;
   gsize len = 0;
 
   if (code != 0)
@@ -480,6 +783,17 @@ send_close_rfc6455 (WebSocketConnection *self,
         len += g_strlcpy (buffer + len, reason, sizeof (buffer) - len);
     }
 
+  /* Everything else that is queued goes out first, unless this is urgent */
+  if (!(flags & WEB_SOCKET_QUEUE_URGENT))
+    {
+      before = GET_PRIV(self)->output_queued;
+      flush_flows (GET_PRIV(self));
+
+      /* Compressing what was queued with a tag may relieve the pressure */
+      if (before >= QUEUE_PRESSURE && GET_PRIV(self)->output_queued < QUEUE_PRESSURE)
+        cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+    }
+
   send_message_rfc6455 (self, flags, 0x08, (guint8 *)buffer, len);
   GET_PRIV(self)->close_sent = TRUE;
 }
@@ -598,16 +912,13 @@ bad_data_error_and_close (WebSocketConnection *self)
 }
 
 static void
-too_big_error_and_close (WebSocketConnection *self,
-                         gsize payload_len)
+too_big_error_and_close (WebSocketConnection *self)
 {
   GError *error = g_error_new_literal (WEB_SOCKET_ERROR,
                                        WEB_SOCKET_CLOSE_TOO_BIG,
                                        GET_PRIV(self)->server_side ?
                                            "Received extremely large WebSocket data from the server" :
                                            "Received extremely large WebSocket data from the client");
-  g_message ("%s is trying to frame of size %" G_GSIZE_FORMAT " or greater, but max supported size is 128KiB",
-             GET_PRIV(self)->server_side ? "server" : "client", payload_len);
   _web_socket_connection_error_and_close (self, error, TRUE);
 
   /* The input is in an invalid state now */
@@ -683,16 +994,147 @@ receive_ping_rfc6455 (WebSocketConnection *self,
   send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
 }
 
+/*
+ * Validates text that may come in several fragments, where a character
+ * can be split across them. The start of such a character is held back
+ * until the next fragment. Returns: FALSE if invalid
+ */
+static gboolean
+validate_utf8_rfc6455 (WebSocketConnectionPrivate *pv,
+                       const guint8 *data,
+                       gsize len,
+                       gboolean fin)
+{
+  const gchar *end;
+  gsize need;
+  gsize take;
+
+  /* Complete the character from the previous fragment first */
+  if (pv->message_utf8_len > 0)
+    {
+      need = g_utf8_skip[pv->message_utf8[0]];
+      take = MIN (need - pv->message_utf8_len, len);
+      memcpy (pv->message_utf8 + pv->message_utf8_len, data, take);
+      pv->message_utf8_len += take;
+      data += take;
+      len -= take;
+
+      if (pv->message_utf8_len < need)
+        return !fin;
+      if (!g_utf8_validate ((gchar *)pv->message_utf8, need, NULL))
+        return FALSE;
+      pv->message_utf8_len = 0;
+    }
+
+  if (g_utf8_validate ((gchar *)data, len, &end))
+    return TRUE;
+
+  /* Only an incomplete character at the very end can be held back */
+  len -= end - (gchar *)data;
+  if (fin || len >= sizeof (pv->message_utf8) ||
+      g_utf8_get_char_validated (end, len) != (gunichar)-2)
+    return FALSE;
+
+  memcpy (pv->message_utf8, end, len);
+  pv->message_utf8_len = len;
+  return TRUE;
+}
+
+static void
+deliver_fragment_rfc6455 (WebSocketConnection *self,
+                          gboolean fin,
+                          const guint8 *payload,
+                          gsize payload_len,
+                          GBytes *slice)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  guint8 opcode = pv->message_opcode;
+  GByteArray *inflated;
+  GByteArray *copy;
+  GBytes *fragment;
+  gboolean too_big;
+
+  if (pv->message_compressed)
+    {
+      /* The limit applies to the whole message, not each fragment */
+      inflated = _web_socket_deflate_inflate (pv->deflate, payload, payload_len, fin,
+                                              pv->max_payload > pv->message_inflated ?
+                                                  pv->max_payload - pv->message_inflated : 0,
+                                              &too_big);
+      if (too_big)
+        {
+          g_message ("%s is trying to send a compressed message larger than max supported size %" G_GUINT64_FORMAT,
+                     pv->server_side ? "server" : "client", pv->max_payload);
+          pv->message_opcode = 0;
+          too_big_error_and_close (self);
+          return;
+        }
+      if (!inflated ||
+          (opcode == 0x01 && !validate_utf8_rfc6455 (pv, inflated->data, inflated->len, fin)))
+        {
+          g_message ("received invalid compressed message fragment");
+          if (inflated)
+            g_byte_array_unref (inflated);
+          pv->message_opcode = 0;
+          bad_data_error_and_close (self);
+          return;
+        }
+      pv->message_inflated += inflated->len;
+      fragment = g_byte_array_free_to_bytes (inflated);
+    }
+  else if (slice)
+    {
+      /* Already null terminated, see unmask_rfc6455() */
+      fragment = g_bytes_ref (slice);
+    }
+  else
+    {
+      /* Always null terminate, as a convenience, but don't count it */
+      copy = g_byte_array_sized_new (payload_len + 1);
+      g_byte_array_append (copy, payload, payload_len);
+      g_byte_array_append (copy, (guchar *)"\0", 1);
+      copy->len--;
+      fragment = g_byte_array_free_to_bytes (copy);
+    }
+
+  pv->compression.received += g_bytes_get_size (fragment);
+  pv->compression.received_wire += payload_len;
+
+  if (fin)
+    {
+      pv->message_opcode = 0;
+      pv->message_streaming = FALSE;
+    }
+
+  g_debug ("message: delivering %s fragment %d with %d length", fin ? "last" : "a",
+           (int)opcode, (int)g_bytes_get_size (fragment));
+  g_signal_emit (self, signals[FRAGMENT], 0, (int)opcode, fragment, fin);
+  g_bytes_unref (fragment);
+}
+
 static void
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
+                          gboolean compressed,
                           guint8 opcode,
                           gconstpointer payload,
-                          gsize payload_len)
+                          gsize payload_len,
+                          GBytes *slice)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *inflated;
+  gboolean too_big;
   GBytes *message;
+  gsize wire_len;
+
+  /* Only the first frame of a data message may be compressed */
+  if (compressed && (!pv->deflate || control || !opcode))
+    {
+      g_message ("received unexpected compressed frame");
+      protocol_error_and_close (self);
+      return;
+    }
 
   if (control)
     {
@@ -733,7 +1175,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Initial fragment of a message */
       if (!fin && opcode)
         {
-          if (pv->message_data)
+          if (pv->message_opcode)
             {
               g_message ("received out of order initial message fragment");
               protocol_error_and_close (self);
@@ -745,7 +1187,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Middle fragment of a message */
       else if (!fin && !opcode)
         {
-          if (!pv->message_data)
+          if (!pv->message_opcode)
             {
               g_message ("received out of order middle message fragment");
               protocol_error_and_close (self);
@@ -757,7 +1199,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Last fragment of a message */
       else if (fin && !opcode)
         {
-          if (!pv->message_data)
+          if (!pv->message_opcode)
             {
               g_message ("received out of order ending message fragment");
               protocol_error_and_close (self);
@@ -770,7 +1212,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
       else
         {
           g_assert (opcode != 0);
-          if (pv->message_data)
+          if (pv->message_opcode)
             {
               g_message ("received unfragmented message when fragment was expected");
               protocol_error_and_close (self);
@@ -779,22 +1221,31 @@ process_contents_rfc6455 (WebSocketConnection *self,
           g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
         }
 
+      /*
+       * An unfragmented message can be delivered as is, if it came in a
+       * slice. Fragmented ones get assembled, unless they're streamed.
+       */
       if (opcode)
         {
           pv->message_opcode = opcode;
-          pv->message_data = g_byte_array_sized_new (payload_len);
+          pv->message_compressed = compressed;
+          pv->message_streaming = pv->stream_fragments && !fin;
+          pv->message_utf8_len = 0;
+          pv->message_inflated = 0;
+          if (!slice && !pv->message_streaming)
+            pv->message_data = g_byte_array_sized_new (payload_len);
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text gets validated once inflated */
+          if (!pv->message_compressed && !validate_utf8_rfc6455 (pv, payload, payload_len, fin))
             {
               g_message ("received invalid non-UTF8 text data");
 
               /* Discard the entire message */
-              g_byte_array_unref (pv->message_data);
-              pv->message_data = NULL;
+              g_clear_pointer (&pv->message_data, g_byte_array_unref);
               pv->message_opcode = 0;
 
               bad_data_error_and_close (self);
@@ -802,7 +1253,8 @@ process_contents_rfc6455 (WebSocketConnection *self,
             }
           /* fall through */
         case 0x02:
-          g_byte_array_append (pv->message_data, payload, payload_len);
+          if (pv->message_data)
+            g_byte_array_append (pv->message_data, payload, payload_len);
           break;
         default:
           g_debug ("received unknown data frame: %d", (gint)opcode);
@@ -810,17 +1262,65 @@ process_contents_rfc6455 (WebSocketConnection *self,
         }
 
       /* Actually deliver the message? */
-      if (fin)
+      if (pv->message_streaming)
+        {
+          deliver_fragment_rfc6455 (self, fin, payload, payload_len, slice);
+        }
+      else if (fin)
         {
-          /* Always null terminate, as a convenience */
-          g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
+          if (slice)
+            {
+              /* Already null terminated, see unmask_rfc6455() */
+              message = g_bytes_ref (slice);
+              wire_len = payload_len;
+            }
+          else if (pv->message_compressed)
+            {
+              wire_len = pv->message_data->len;
+              inflated = _web_socket_deflate_inflate (pv->deflate, pv->message_data->data,
+                                                      pv->message_data->len, TRUE,
+                                                      pv->max_payload, &too_big);
+              g_clear_pointer (&pv->message_data, g_byte_array_unref);
+
+              if (too_big)
+                {
+                  g_message ("%s is trying to send a compressed message larger than max supported size %" G_GUINT64_FORMAT,
+                             pv->server_side ? "server" : "client", pv->max_payload);
+                  pv->message_opcode = 0;
+                  too_big_error_and_close (self);
+                  return;
+                }
+              if (!inflated ||
+                  (pv->message_opcode == 0x01 && !g_utf8_validate ((gchar *)inflated->data, inflated->len, NULL)))
+                {
+                  g_message ("received invalid compressed message");
+                  if (inflated)
+                    g_byte_array_unref (inflated);
+                  pv->message_opcode = 0;
+                  bad_data_error_and_close (self);
+                  return;
+                }
+
+              message = g_byte_array_free_to_bytes (inflated);
+            }
+          else
+            {
+              wire_len = pv->message_data->len;
+
+              /* Always null terminate, as a convenience */
+              g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
+
+              /* But don't include the null terminator in the byte count */
+              pv->message_data->len--;
+
+              message = g_byte_array_free_to_bytes (pv->message_data);
+              pv->message_data = NULL;
+            }
 
-          /* But don't include the null terminator in the byte count */
-          pv->message_data->len--;
+          pv->compression.received += g_bytes_get_size (message);
+          pv->compression.received_wire += wire_len;
 
           opcode = pv->message_opcode;
-          message = g_byte_array_free_to_bytes (pv->message_data);
-          pv->message_data = NULL;
           pv->message_opcode = 0;
           g_debug ("message: delivering %d with %d length",
                    (int)opcode, (int)g_bytes_get_size (message));
@@ -833,23 +1333,29 @@ process_contents_rfc6455 (WebSocketConnection *self,
 static gboolean
 process_frame_rfc6455 (WebSocketConnection *self)
 {
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GBytes *slice = NULL;
   guint8 *header;
   guint8 *payload;
   guint64 payload_len;
-  guint8 *mask;
   gboolean fin;
   gboolean control;
+  gboolean compressed;
   gboolean masked;
+  gboolean sliced;
   guint8 opcode;
   gsize len;
   gsize at;
 
-  len = GET_PRIV(self)->incoming->len;
+  pv->input_needed = 0;
+
+  len = pv->input_end - pv->input_start;
   if (len < 2)
     return FALSE; /* need more data */
 
-  header = GET_PRIV(self)->incoming->data;
+  header = pv->input_data + pv->input_start;
   fin = ((header[0] & 0x80) != 0);
+  compressed = ((header[0] & 0x40) != 0);
   control = header[0] & 0x08;
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
@@ -883,38 +1389,95 @@ process_frame_rfc6455 (WebSocketConnection *self)
     }
 
   /* Safety valve */
-  if (payload_len >= MAX_PAYLOAD)
+  if (payload_len > pv->max_payload)
     {
-      too_big_error_and_close (self, payload_len);
+      g_message ("%s is trying to frame of size %" G_GUINT64_FORMAT ", but max supported size is %" G_GUINT64_FORMAT,
+                 pv->server_side ? "server" : "client", payload_len, pv->max_payload);
+      too_big_error_and_close (self);
       return FALSE;
     }
 
+  /* The mask follows the length */
+  if (masked)
+    at += 4;
+
   if (len < at + payload_len)
-    return FALSE; /* need more data */
+    {
+      /* The whole frame has to fit into the block */
+      pv->input_needed = at + payload_len;
+      return FALSE; /* need more data */
+    }
 
   payload = header + at;
 
+  /*
+   * Note that once we've unmasked, we've modified the buffer, we can
+   * only return below via discarding or processing the message
+   */
   if (masked)
     {
-      mask = header + at;
-      payload += 4;
-      at += 4;
+      payload -= 4;
+      unmask_rfc6455 (payload, payload_len);
 
-      if (len < at + payload_len)
-        return FALSE; /* need more data */
+      /* Unfragmented messages, and streamed fragments, get passed on without a copy */
+      if (opcode == 0x01 || opcode == 0x02)
+        sliced = fin || pv->stream_fragments;
+      else
+        sliced = opcode == 0x00 && pv->message_streaming && !pv->message_compressed;
 
-      xor_with_mask_rfc6455 (mask, payload, payload_len);
+      if (sliced && !compressed && payload_len > 0)
+        {
+          slice = g_bytes_new_from_bytes (pv->input_block, payload - pv->input_data, payload_len);
+          pv->input_shared = TRUE;
+        }
     }
 
-  /*
-   * Note that now that we've unmasked, we've modified the buffer, we can
-   * only return below via discarding or processing the message
-   */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, compressed, opcode, payload, payload_len, slice);
+  if (slice)
+    g_bytes_unref (slice);
 
-  /* Move past the parsed frame */
-  g_byte_array_remove_range (GET_PRIV(self)->incoming, 0, at + payload_len);
-  return TRUE;
+  /* Move past the parsed frame, and stop if it made us close */
+  pv->input_start += at + payload_len;
+  return pv->io_open;
+}
+
+/*
+ * Makes room for reading at least @want more bytes after the unconsumed
+ * input. That gets moved to the start of the block, or into a new block
+ * when slices of the current one are in use, as those must not change.
+ */
+static void
+input_reserve (WebSocketConnectionPrivate *pv,
+               gsize want)
+{
+  gsize pending = pv->input_end - pv->input_start;
+  guint8 *data;
+  gsize size;
+
+  if (pv->input_block && pv->input_size - pv->input_end >= want)
+    return;
+
+  if (pv->input_block && !pv->input_shared && pv->input_size - pending >= want)
+    {
+      memmove (pv->input_data, pv->input_data + pv->input_start, pending);
+    }
+  else
+    {
+      /* Grow geometrically while a long read batch piles up */
+      size = MAX (MAX (pending + want, pending * 2), pv->read_size);
+      data = g_malloc (size);
+      if (pending > 0)
+        memcpy (data, pv->input_data + pv->input_start, pending);
+      if (pv->input_block)
+        g_bytes_unref (pv->input_block);
+      pv->input_block = g_bytes_new_take (data, size);
+      pv->input_data = data;
+      pv->input_size = size;
+      pv->input_shared = FALSE;
+    }
+
+  pv->input_start = 0;
+  pv->input_end = pending;
 }
 
 static void
@@ -928,21 +1491,38 @@ process_incoming (WebSocketConnection *self)
     {
       klass = WEB_SOCKET_CONNECTION_GET_CLASS (self);
       g_assert (klass->handshake != NULL);
-      if ((klass->handshake) (self, pv->incoming))
-        {
-          pv->handshake_done = TRUE;
-          g_object_notify (G_OBJECT (self), "ready-state");
-          g_signal_emit (self, signals[OPEN], 0);
-        }
+      if (!(klass->handshake) (self, pv->incoming))
+        return;
+
+      /* Whatever came after the handshake are frames */
+      input_reserve (pv, pv->incoming->len);
+      memcpy (pv->input_data + pv->input_end, pv->incoming->data, pv->incoming->len);
+      pv->input_end += pv->incoming->len;
+      g_byte_array_free (pv->incoming, TRUE);
+      pv->incoming = NULL;
+
+      pv->handshake_done = TRUE;
+      g_object_notify (G_OBJECT (self), "ready-state");
+      g_signal_emit (self, signals[OPEN], 0);
     }
 
-  if (pv->handshake_done)
+  do
     {
-      do
+      more = process_frame_rfc6455 (self);
+    }
+  while (more);
+
+  /* Let go of the block when it is all passed on, or start over */
+  if (pv->input_start == pv->input_end)
+    {
+      if (pv->input_shared)
         {
-          more = process_frame_rfc6455 (self);
+          g_clear_pointer (&pv->input_block, g_bytes_unref);
+          pv->input_data = NULL;
+          pv->input_size = 0;
+          pv->input_shared = FALSE;
         }
-      while (more);
+      pv->input_start = pv->input_end = 0;
     }
 }
 
@@ -954,17 +1534,39 @@ on_web_socket_input (GObject *pollable_stream,
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   GError *error = NULL;
   gboolean end = FALSE;
+  gsize total = 0;
+  guint8 *buffer;
   gssize count;
-  gsize len;
+  gsize pending;
+  gsize want;
+  gsize size;
+  gsize len = 0;
 
   do
     {
-      len = pv->incoming->len;
-      g_byte_array_set_size (pv->incoming, len + 1024);
+      if (pv->handshake_done)
+        {
+          /*
+           * Make room for the rest of the frame, but only as much again as
+           * actually arrived: a frame header alone can't make us allocate
+           * up to max-payload.
+           */
+          pending = pv->input_end - pv->input_start;
+          want = pv->input_needed > pending ? pv->input_needed - pending : 0;
+          want = MIN (want, MAX (pending, READ_SIZE_MAX));
+          input_reserve (pv, MAX (READ_SIZE_MIN, want));
+          buffer = pv->input_data + pv->input_end;
+          size = pv->input_size - pv->input_end;
+        }
+      else
+        {
+          len = pv->incoming->len;
+          g_byte_array_set_size (pv->incoming, len + 1024);
+          buffer = pv->incoming->data + len;
+          size = 1024;
+        }
 
-      count = g_pollable_input_stream_read_nonblocking (pv->input,
-                                                        pv->incoming->data + len,
-                                                        1024, NULL, &error);
+      count = g_pollable_input_stream_read_nonblocking (pv->input, buffer, size, NULL, &error);
 
       if (count < 0)
         {
@@ -984,10 +1586,20 @@ on_web_socket_input (GObject *pollable_stream,
           end = TRUE;
         }
 
-      pv->incoming->len = len + count;
+      if (pv->handshake_done)
+        pv->input_end += count;
+      else
+        pv->incoming->len = len + count;
+      total += count;
     }
   while (count > 0);
 
+  /* Read in bigger blocks while there is a lot coming in */
+  if (total >= pv->read_size)
+    pv->read_size = MIN (pv->read_size * 2, READ_SIZE_MAX);
+  else if (total < pv->read_size / 4)
+    pv->read_size = MAX (pv->read_size / 2, READ_SIZE_MIN);
+
   process_incoming (self);
 
   if (end)
@@ -1025,50 +1637,110 @@ on_web_socket_output (GObject *pollable_stream,
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GOutputVector vectors[MAX_OUTPUT_VECTORS];
+  guint n_vectors = 0;
   const guint8 *data;
   GError *error = NULL;
+  gsize written = 0;
+  gsize offset;
   gsize before;
   Frame *frame;
-  gssize count;
+  GList *l;
   gsize len;
+  gsize n;
+  guint i;
+
+  /* Compressing tagged frames as they're scheduled changes what is queued */
+  before = pv->output_queued;
 
-  frame = g_queue_peek_head (&pv->outgoing);
+  /* Tagged frames take their turn once the others went out */
+  if (g_queue_is_empty (&pv->outgoing))
+    schedule_flows (pv);
 
   /* No more frames to send */
-  if (frame == NULL)
+  if (g_queue_is_empty (&pv->outgoing))
     {
       stop_output (self);
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
-
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
-
-  if (count < 0)
+  /* Send as many frames as we can at once, but nothing after the last one */
+  for (l = pv->outgoing.head; l != NULL && n_vectors < MAX_OUTPUT_VECTORS; l = l->next)
     {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
-        {
-          g_clear_error (&error);
-          count = 0;
-        }
-      else
+      frame = l->data;
+      g_assert (frame->length > frame->sent);
+
+      /* Skip over the chunks, or part of one, that went out already */
+      offset = frame->sent;
+      for (i = 0; i < frame->n_chunks && n_vectors < MAX_OUTPUT_VECTORS; i++)
         {
-          _web_socket_connection_error_and_close (self, error, TRUE);
-          return FALSE;
+          data = g_bytes_get_data (frame->chunks[i], &len);
+          if (offset >= len)
+            {
+              offset -= len;
+              continue;
+            }
+
+          vectors[n_vectors].buffer = data + offset;
+          vectors[n_vectors].size = len - offset;
+          n_vectors++;
+          offset = 0;
         }
-    }
 
-  before = pv->output_queued;
+      if (frame->last)
+        break;
+    }
 
-  frame->sent += count;
-  if (frame->sent >= len)
+#if GLIB_CHECK_VERSION(2,60,0)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+  switch (g_pollable_output_stream_writev_nonblocking (pv->output, vectors, n_vectors,
+                                                      &written, NULL, &error))
+    {
+    case G_POLLABLE_RETURN_OK:
+      break;
+    case G_POLLABLE_RETURN_WOULD_BLOCK:
+      written = 0;
+      break;
+    default:
+      _web_socket_connection_error_and_close (self, error, TRUE);
+      return FALSE;
+    }
+#pragma GCC diagnostic pop
+#else
+  {
+    gssize count = g_pollable_output_stream_write_nonblocking (pv->output,
+                                                               vectors[0].buffer,
+                                                               vectors[0].size,
+                                                               NULL, &error);
+    if (count < 0)
+      {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+          {
+            _web_socket_connection_error_and_close (self, error, TRUE);
+            return FALSE;
+          }
+        g_clear_error (&error);
+        count = 0;
+      }
+    written = count;
+  }
+#endif
+
+  /* Account what got written to the frames, which may end in the middle of one */
+  while (written > 0)
     {
+      frame = g_queue_peek_head (&pv->outgoing);
+      g_assert (frame != NULL);
+
+      len = frame->length;
+      n = MIN (written, len - frame->sent);
+      frame->sent += n;
+      written -= n;
+
+      if (frame->sent < len)
+        break;
+
       g_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
       g_assert (len <= pv->output_queued);
@@ -1076,6 +1748,7 @@ on_web_socket_output (GObject *pollable_stream,
 
       if (frame->last)
         {
+          g_assert (written == 0);
           if (pv->server_side)
             {
               close_io_stream (self);
@@ -1113,26 +1786,37 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_chunks (WebSocketConnection *self,
+              WebSocketQueueFlags flags,
+              const gchar *tag,
+              guint weight,
+              guint8 deflate_opcode,
+              GBytes **chunks,
+              guint n_chunks,
+              gsize amount)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   gsize before;
+  gsize len = 0;
   Frame *frame;
   Frame *prev;
+  Flow *flow;
+  guint i;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
   g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  g_assert (n_chunks > 0 && n_chunks <= MAX_FRAME_CHUNKS);
 
   frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
+  for (i = 0; i < n_chunks; i++)
+    {
+      frame->chunks[i] = chunks[i];
+      len += g_bytes_get_size (chunks[i]);
+    }
+  frame->n_chunks = n_chunks;
+  frame->length = len;
   frame->amount = amount;
+  frame->deflate_opcode = deflate_opcode;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
 
   /* If urgent put at front of queue */
@@ -1155,6 +1839,23 @@ _web_socket_connection_queue (WebSocketConnection *self,
           g_queue_push_head (&pv->outgoing, frame);
         }
     }
+
+  /* Tagged frames wait for their turn */
+  else if (tag)
+    {
+      flow = g_hash_table_lookup (pv->flows, tag);
+      if (!flow)
+        {
+          flow = g_slice_new0 (Flow);
+          flow->tag = g_strdup (tag);
+          g_queue_init (&flow->frames);
+          g_hash_table_insert (pv->flows, flow->tag, flow);
+          g_queue_push_tail (&pv->active_flows, flow);
+        }
+      flow->weight = weight;
+      g_queue_push_tail (&flow->frames, frame);
+    }
+
   else
     {
       g_queue_push_tail (&pv->outgoing, frame);
@@ -1174,6 +1875,23 @@ _web_socket_connection_queue (WebSocketConnection *self,
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  GBytes *chunk;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  chunk = g_bytes_new_take (data, len);
+  queue_chunks (self, flags, NULL, 0, 0, &chunk, 1, amount);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1305,6 +2023,18 @@ web_socket_connection_get_property (GObject *object,
       g_value_set_object (value, web_socket_connection_get_io_stream (self));
       break;
 
+    case PROP_PERMESSAGE_DEFLATE:
+      g_value_set_boolean (value, GET_PRIV(self)->permessage_deflate);
+      break;
+
+    case PROP_STREAM_FRAGMENTS:
+      g_value_set_boolean (value, GET_PRIV(self)->stream_fragments);
+      break;
+
+    case PROP_MAX_PAYLOAD:
+      g_value_set_uint64 (value, GET_PRIV(self)->max_payload);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1335,6 +2065,19 @@ web_socket_connection_set_property (GObject *object,
         _web_socket_connection_take_io_stream (self, io_stream);
       break;
 
+    case PROP_PERMESSAGE_DEFLATE:
+      g_return_if_fail (!pv->handshake_done);
+      pv->permessage_deflate = g_value_get_boolean (value);
+      break;
+
+    case PROP_STREAM_FRAGMENTS:
+      pv->stream_fragments = g_value_get_boolean (value);
+      break;
+
+    case PROP_MAX_PAYLOAD:
+      pv->max_payload = g_value_get_uint64 (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1369,8 +2112,12 @@ web_socket_connection_finalize (GObject *object)
 
   if (pv->incoming)
     g_byte_array_free (pv->incoming, TRUE);
+  if (pv->input_block)
+    g_bytes_unref (pv->input_block);
   while (!g_queue_is_empty (&pv->outgoing))
     frame_free (g_queue_pop_head (&pv->outgoing));
+  g_queue_clear (&pv->active_flows);
+  g_hash_table_destroy (pv->flows);
   pv->output_queued = 0;
 
   g_clear_object (&pv->io_stream);
@@ -1384,6 +2131,8 @@ web_socket_connection_finalize (GObject *object)
     g_source_unref (pv->start_idle);
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
+  if (pv->deflate)
+    _web_socket_deflate_free (pv->deflate);
 
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
@@ -1459,6 +2208,40 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    g_param_spec_object ("io-stream", "IO Stream", "Underlying io stream", G_TYPE_IO_STREAM,
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * WebSocketConnection:permessage-deflate:
+   *
+   * Whether to offer or accept compression of messages with the
+   * permessage-deflate extension. Only has an effect when set before
+   * the handshake.
+   */
+  g_object_class_install_property (gobject_class, PROP_PERMESSAGE_DEFLATE,
+                                   g_param_spec_boolean ("permessage-deflate", "permessage-deflate", "Use permessage-deflate compression",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:stream-fragments:
+   *
+   * Whether to emit the #WebSocketConnection::fragment signal for each
+   * part of a fragmented message as it arrives, rather than assembling
+   * the whole message for #WebSocketConnection::message. Unfragmented
+   * messages are emitted as a message either way.
+   */
+  g_object_class_install_property (gobject_class, PROP_STREAM_FRAGMENTS,
+                                   g_param_spec_boolean ("stream-fragments", "stream-fragments", "Emit message fragments as they arrive",
+                                                         FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:max-payload:
+   *
+   * The largest payload of a frame to accept from the peer. A frame
+   * has to be received whole before it gets processed, so this limits
+   * how much memory the peer can make us use. It can be at most 64 MiB.
+   */
+  g_object_class_install_property (gobject_class, PROP_MAX_PAYLOAD,
+                                   g_param_spec_uint64 ("max-payload", "max-payload", "Largest frame payload to accept",
+                                                        1, MAX_PAYLOAD_LIMIT, MAX_PAYLOAD, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * WebSocketConnection::open:
    * @self: the WebSocket
@@ -1494,6 +2277,27 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    NULL, NULL, g_cclosure_marshal_generic,
                                    G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_BYTES);
 
+  /**
+   * WebSocketConnection::fragment:
+   * @self: the WebSocket
+   * @type: the type of message contents
+   * @fragment: the data of this part of the message
+   * @last: whether this is the end of the message
+   *
+   * Emitted instead of #WebSocketConnection::message for each part of a
+   * fragmented message, when #WebSocketConnection:stream-fragments is set.
+   *
+   * Text is validated as it arrives, so together the fragments are valid
+   * UTF-8, but a character may be split between two of them. As with
+   * messages, the @fragment data is always null-terminated.
+   */
+  signals[FRAGMENT] = g_signal_new ("fragment",
+                                    WEB_SOCKET_TYPE_CONNECTION,
+                                    G_SIGNAL_RUN_FIRST,
+                                    G_STRUCT_OFFSET (WebSocketConnectionClass, fragment),
+                                    NULL, NULL, g_cclosure_marshal_generic,
+                                    G_TYPE_NONE, 3, G_TYPE_INT, G_TYPE_BYTES, G_TYPE_BOOLEAN);
+
   /**
    * WebSocketConnection::error:
    * @self: the WebSocket
@@ -1623,7 +2427,8 @@ web_socket_connection_get_buffered_amount (WebSocketConnection *self)
 {
   gsize amount = 0;
   Frame *frame;
-  GList *l;
+  Flow *flow;
+  GList *l, *k;
 
   g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
 
@@ -1633,6 +2438,16 @@ web_socket_connection_get_buffered_amount (WebSocketConnection *self)
       amount += frame->amount;
     }
 
+  for (k = GET_PRIV(self)->active_flows.head; k != NULL; k = g_list_next (k))
+    {
+      flow = k->data;
+      for (l = flow->frames.head; l != NULL; l = g_list_next (l))
+        {
+          frame = l->data;
+          amount += frame->amount;
+        }
+    }
+
   return amount;
 }
 
@@ -1651,6 +2466,24 @@ web_socket_connection_get_io_stream (WebSocketConnection *self)
   return GET_PRIV(self)->io_stream;
 }
 
+/**
+ * web_socket_connection_get_compression_stats:
+ * @self: the WebSocket
+ * @stats: (out): location to place the counters
+ *
+ * Get how many bytes of data messages were sent and received, and how
+ * many of them went over the wire after permessage-deflate compression.
+ * Without compression the counts are the same.
+ */
+void
+web_socket_connection_get_compression_stats (WebSocketConnection *self,
+                                             WebSocketCompressionStats *stats)
+{
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (stats != NULL);
+  *stats = GET_PRIV(self)->compression;
+}
+
 /**
  * web_socket_connection_get_close_code:
  * @self: the WebSocket
@@ -1713,6 +2546,35 @@ web_socket_connection_send (WebSocketConnection *self,
                             WebSocketDataType type,
                             GBytes *prefix,
                             GBytes *message)
+{
+  web_socket_connection_send_tagged (self, type, NULL, 0, prefix, message);
+}
+
+/**
+ * web_socket_connection_send_tagged:
+ * @self: the WebSocket
+ * @type: the data type of message
+ * @tag: (allow-none): what the message belongs to, such as a channel
+ * @weight: the share of the connection for @tag, if @tag is set
+ * @prefix: (allow-none): an optional prefix prepended to the message
+ * @message: the message contents
+ *
+ * Send a message to the peer, like web_socket_connection_send(), but
+ * queue it fairly with others that have a different @tag.
+ *
+ * Messages with the same @tag go out in order. When several tags have
+ * messages queued, they take turns, each sending an amount in proportion
+ * to its @weight. So a big transfer doesn't hold up something interactive
+ * behind it. Messages without a @tag go out before any tagged ones that
+ * are still waiting for their turn.
+ */
+void
+web_socket_connection_send_tagged (WebSocketConnection *self,
+                                   WebSocketDataType type,
+                                   const gchar *tag,
+                                   guint weight,
+                                   GBytes *prefix,
+                                   GBytes *message)
 {
   gconstpointer pref = NULL;
   gsize prefix_len = 0;
@@ -1722,6 +2584,7 @@ web_socket_connection_send (WebSocketConnection *self,
 
   g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
   g_return_if_fail (message != NULL);
+  g_return_if_fail (tag == NULL || weight > 0);
 
   if (web_socket_connection_get_ready_state (self) != WEB_SOCKET_STATE_OPEN)
     {
@@ -1752,8 +2615,7 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                 pref, prefix_len, payload, payload_len);
+  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, tag, weight, prefix, message);
 
   g_object_notify (G_OBJECT (self), "buffered-amount");
 }
@@ -1850,6 +2712,70 @@ web_socket_connection_throttle (CockpitFlow *flow,
     }
 }
 
+/*
+ * Used by the client: the Sec-WebSocket-Extensions header to send,
+ * or %NULL for none.
+ */
+const gchar *
+_web_socket_connection_offer_extensions (WebSocketConnection *self)
+{
+  if (!GET_PRIV(self)->permessage_deflate)
+    return NULL;
+  return _web_socket_deflate_offer ();
+}
+
+/*
+ * Used by the server: picks from the extensions that the client offers
+ * in @value, and returns the Sec-WebSocket-Extensions header to respond
+ * with, or %NULL for none. Offers that we don't support get ignored.
+ */
+gchar *
+_web_socket_connection_choose_extensions (WebSocketConnection *self,
+                                          const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  gchar *response = NULL;
+
+  g_return_val_if_fail (pv->deflate == NULL, NULL);
+
+  if (value && pv->permessage_deflate)
+    {
+      pv->deflate = _web_socket_deflate_new_for_offer (value, &response);
+      if (pv->deflate)
+        g_debug ("agreed on extensions: %s", response);
+    }
+
+  return response;
+}
+
+/*
+ * Used by the client: checks the extensions that the server chose
+ * from our offer, in @value, which may be %NULL.
+ */
+gboolean
+_web_socket_connection_accept_extensions (WebSocketConnection *self,
+                                          const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  g_return_val_if_fail (pv->deflate == NULL, FALSE);
+
+  if (!value || !value[0])
+    return TRUE;
+
+  if (pv->permessage_deflate)
+    pv->deflate = _web_socket_deflate_new_for_response (value);
+
+  if (!pv->deflate)
+    {
+      g_message ("received unsupported Sec-WebSocket-Extensions: %s", value);
+      return FALSE;
+    }
+
+  g_debug ("agreed on extensions: %s", value);
+  return TRUE;
+}
+
 gboolean
 _web_socket_connection_choose_protocol (WebSocketConnection *self,
                                         const gchar **protocols,
@@ -46,6 +46,11 @@ struct _WebSocketConnectionClass
                              WebSocketDataType type,
                              GBytes *message);
 
+  void      (* fragment)    (WebSocketConnection *self,
+                             WebSocketDataType type,
+                             GBytes *fragment,
+                             gboolean last);
+
   gboolean  (* error)       (WebSocketConnection *self,
                              GError *error);
 
@@ -54,6 +59,14 @@ struct _WebSocketConnectionClass
   void      (* close)       (WebSocketConnection *self);
 };
 
+/* Counts of data message bytes, see web_socket_connection_get_compression_stats() */
+typedef struct {
+  guint64 sent;
+  guint64 sent_wire;
+  guint64 received;
+  guint64 received_wire;
+} WebSocketCompressionStats;
+
 GType           web_socket_connection_get_type            (void) G_GNUC_CONST;
 
 const gchar *   web_socket_connection_get_url             (WebSocketConnection *self);
@@ -70,11 +83,21 @@ const gchar *   web_socket_connection_get_close_data      (WebSocketConnection *
 
 GIOStream *     web_socket_connection_get_io_stream       (WebSocketConnection *self);
 
+void            web_socket_connection_get_compression_stats (WebSocketConnection *self,
+                                                             WebSocketCompressionStats *stats);
+
 void            web_socket_connection_send                (WebSocketConnection *self,
                                                            WebSocketDataType type,
                                                            GBytes *prefix,
                                                            GBytes *payload);
 
+void            web_socket_connection_send_tagged         (WebSocketConnection *self,
+                                                           WebSocketDataType type,
+                                                           const gchar *tag,
+                                                           guint weight,
+                                                           GBytes *prefix,
+                                                           GBytes *payload);
+
 void            web_socket_connection_close               (WebSocketConnection *self,
                                                            gushort code,
                                                            const gchar *data);
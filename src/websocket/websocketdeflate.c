@@ -0,0 +1,387 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The permessage-deflate extension, RFC 7692: the negotiation of its
+ * parameters in the handshake, and the compression of messages. This uses
+ * zlib directly rather than GZlibCompressor, as the window size needs to
+ * be set to what got negotiated.
+ */
+
+#include "config.h"
+
+#include "websocketprivate.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#define EXTENSION_NAME "permessage-deflate"
+
+/* How much output to make room for at once */
+#define CHUNK_SIZE 16 * 1024
+
+/* Every message ends with this after a sync flush, but it isn't sent */
+static const guint8 sync_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+struct _WebSocketDeflate {
+  z_stream deflater;
+  z_stream inflater;
+
+  /* Start over with each message that we send */
+  gboolean no_context_takeover;
+};
+
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits; /* 0 if not present */
+  gint client_max_window_bits; /* 0 if not present, -1 without a value */
+} DeflateParams;
+
+static gboolean
+parse_window_bits (const gchar *value,
+                   gint *bits)
+{
+  guint64 number;
+
+  /* The value may be quoted */
+  if (value[0] == '"')
+    {
+      gsize len = strlen (value);
+      g_autofree gchar *unquoted = NULL;
+      if (len < 3 || value[len - 1] != '"')
+        return FALSE;
+      unquoted = g_strndup (value + 1, len - 2);
+      return parse_window_bits (unquoted, bits);
+    }
+
+  if (!g_ascii_string_to_unsigned (value, 10, 8, 15, &number, NULL))
+    return FALSE;
+
+  *bits = number;
+  return TRUE;
+}
+
+/*
+ * Parses the parameters of one offer or response, which come after the
+ * extension name. Returns: FALSE for unknown, duplicate or invalid ones.
+ */
+static gboolean
+parse_params (gchar **tokens,
+              DeflateParams *params)
+{
+  gboolean valid = TRUE;
+  gchar *value;
+  gchar *name;
+  gint i;
+
+  memset (params, 0, sizeof (DeflateParams));
+
+  for (i = 0; valid && tokens[i] != NULL; i++)
+    {
+      name = g_strstrip (tokens[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *(value++) = '\0';
+          g_strstrip (name);
+          g_strstrip (value);
+        }
+
+      if (g_str_equal (name, "server_no_context_takeover") && !value && !params->server_no_context_takeover)
+        params->server_no_context_takeover = TRUE;
+      else if (g_str_equal (name, "client_no_context_takeover") && !value && !params->client_no_context_takeover)
+        params->client_no_context_takeover = TRUE;
+      else if (g_str_equal (name, "server_max_window_bits") && value && !params->server_max_window_bits)
+        valid = parse_window_bits (value, &params->server_max_window_bits);
+      else if (g_str_equal (name, "client_max_window_bits") && !params->client_max_window_bits)
+        {
+          if (value)
+            valid = parse_window_bits (value, &params->client_max_window_bits);
+          else
+            params->client_max_window_bits = -1;
+        }
+      else
+        valid = FALSE;
+    }
+
+  return valid;
+}
+
+static WebSocketDeflate *
+deflate_new (gint window_bits,
+             gboolean no_context_takeover)
+{
+  WebSocketDeflate *self = g_new0 (WebSocketDeflate, 1);
+
+  /* Negative window bits means raw deflate, without a zlib header */
+  if (deflateInit2 (&self->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+      inflateInit2 (&self->inflater, -15) != Z_OK)
+    g_error ("couldn't initialize zlib");
+
+  self->no_context_takeover = no_context_takeover;
+  return self;
+}
+
+/**
+ * _web_socket_deflate_new_for_offer:
+ * @offer: The Sec-WebSocket-Extensions header from the client
+ * @response: location to place the header value to respond with
+ *
+ * Used on the server to pick the first permessage-deflate offer from the
+ * client that we can do.
+ *
+ * Returns: the compression state, or %NULL if there's nothing to accept
+ */
+WebSocketDeflate *
+_web_socket_deflate_new_for_offer (const gchar *offer,
+                                   gchar **response)
+{
+  WebSocketDeflate *self = NULL;
+  DeflateParams params;
+  GString *string;
+  gchar **offers;
+  gchar **tokens;
+  gint i;
+
+  offers = g_strsplit (offer, ",", -1);
+  for (i = 0; self == NULL && offers[i] != NULL; i++)
+    {
+      tokens = g_strsplit (offers[i], ";", -1);
+
+      /*
+       * zlib can't compress with a window of 8 bits, and treats it as 9,
+       * so that is one we have to decline. The client's window can stay
+       * as it is, as we always inflate with the largest one.
+       */
+      if (tokens[0] && g_str_equal (g_strstrip (tokens[0]), EXTENSION_NAME) &&
+          parse_params (tokens + 1, &params) && params.server_max_window_bits != 8)
+        {
+          string = g_string_new (EXTENSION_NAME);
+          if (params.server_no_context_takeover)
+            g_string_append (string, "; server_no_context_takeover");
+          if (params.client_no_context_takeover)
+            g_string_append (string, "; client_no_context_takeover");
+          if (params.server_max_window_bits)
+            g_string_append_printf (string, "; server_max_window_bits=%d", params.server_max_window_bits);
+
+          self = deflate_new (params.server_max_window_bits ? params.server_max_window_bits : 15,
+                              params.server_no_context_takeover);
+          *response = g_string_free (string, FALSE);
+        }
+
+      g_strfreev (tokens);
+    }
+  g_strfreev (offers);
+
+  return self;
+}
+
+/**
+ * _web_socket_deflate_offer:
+ *
+ * The Sec-WebSocket-Extensions header for the client to send. We don't
+ * offer any parameters, so the server can't ask us to limit our window.
+ */
+const gchar *
+_web_socket_deflate_offer (void)
+{
+  return EXTENSION_NAME;
+}
+
+/**
+ * _web_socket_deflate_new_for_response:
+ * @response: The Sec-WebSocket-Extensions header from the server
+ *
+ * Used on the client to check the server's response to our offer.
+ *
+ * Returns: the compression state, or %NULL if the response is invalid
+ */
+WebSocketDeflate *
+_web_socket_deflate_new_for_response (const gchar *response)
+{
+  WebSocketDeflate *self = NULL;
+  DeflateParams params;
+  gchar **tokens;
+
+  /* Only one extension, and it must be the one we offered */
+  if (strchr (response, ','))
+    return NULL;
+
+  tokens = g_strsplit (response, ";", -1);
+  if (tokens[0] && g_str_equal (g_strstrip (tokens[0]), EXTENSION_NAME) &&
+      parse_params (tokens + 1, &params) && params.client_max_window_bits == 0)
+    self = deflate_new (15, params.client_no_context_takeover);
+  g_strfreev (tokens);
+
+  return self;
+}
+
+void
+_web_socket_deflate_free (WebSocketDeflate *self)
+{
+  deflateEnd (&self->deflater);
+  inflateEnd (&self->inflater);
+  g_free (self);
+}
+
+/* Runs @data through the deflater, appending the output to @out */
+static void
+deflate_data (z_stream *z,
+              const guint8 *data,
+              gsize len,
+              gint flush,
+              GByteArray *out)
+{
+  gsize used = out->len;
+  gint ret;
+
+  z->next_in = (Bytef *)data;
+  z->avail_in = len;
+
+  do
+    {
+      g_byte_array_set_size (out, used + CHUNK_SIZE);
+      z->next_out = out->data + used;
+      z->avail_out = CHUNK_SIZE;
+
+      ret = deflate (z, flush);
+      g_assert (ret == Z_OK || ret == Z_BUF_ERROR);
+
+      used = out->len - z->avail_out;
+    }
+  while (z->avail_out == 0);
+
+  g_byte_array_set_size (out, used);
+}
+
+/**
+ * _web_socket_deflate_compress:
+ * @self: the compression state
+ * @prefix: (allow-none): data to compress before @payload
+ * @prefix_len: length of @prefix
+ * @payload: the data to compress
+ * @payload_len: length of @payload
+ *
+ * Compresses a whole message.
+ *
+ * Returns: the compressed data, to send with the RSV1 bit set
+ */
+GByteArray *
+_web_socket_deflate_compress (WebSocketDeflate *self,
+                              const guint8 *prefix,
+                              gsize prefix_len,
+                              const guint8 *payload,
+                              gsize payload_len)
+{
+  GByteArray *out = g_byte_array_sized_new (MIN (prefix_len + payload_len, CHUNK_SIZE));
+
+  if (prefix_len > 0)
+    deflate_data (&self->deflater, prefix, prefix_len, Z_NO_FLUSH, out);
+  deflate_data (&self->deflater, payload, payload_len, Z_SYNC_FLUSH, out);
+
+  g_assert (out->len >= sizeof (sync_tail));
+  g_assert (memcmp (out->data + out->len - sizeof (sync_tail), sync_tail, sizeof (sync_tail)) == 0);
+  g_byte_array_set_size (out, out->len - sizeof (sync_tail));
+
+  if (self->no_context_takeover)
+    deflateReset (&self->deflater);
+
+  return out;
+}
+
+/* Runs @data through the inflater. Returns: FALSE on invalid or too much data */
+static gboolean
+inflate_data (z_stream *z,
+              const guint8 *data,
+              gsize len,
+              gsize max_len,
+              GByteArray *out,
+              gboolean *too_big)
+{
+  gsize used = out->len;
+  gint ret;
+
+  z->next_in = (Bytef *)data;
+  z->avail_in = len;
+
+  do
+    {
+      g_byte_array_set_size (out, used + CHUNK_SIZE);
+      z->next_out = out->data + used;
+      z->avail_out = CHUNK_SIZE;
+
+      ret = inflate (z, Z_SYNC_FLUSH);
+
+      used = out->len - z->avail_out;
+      if (used > max_len)
+        {
+          *too_big = TRUE;
+          return FALSE;
+        }
+
+      /* The sender may have ended the stream, and starts a new one */
+      if (ret == Z_STREAM_END)
+        ret = inflateReset (z);
+      else if (ret == Z_BUF_ERROR)
+        ret = Z_OK;
+    }
+  while (ret == Z_OK && (z->avail_in > 0 || z->avail_out == 0));
+
+  g_byte_array_set_size (out, used);
+  return ret == Z_OK;
+}
+
+/**
+ * _web_socket_deflate_inflate:
+ * @self: the compression state
+ * @data: the compressed message
+ * @len: the length of @data
+ * @fin: whether @data is the end of the message
+ * @max_len: the maximum length of the output to accept
+ * @too_big: set to %TRUE if the output would be longer than @max_len
+ *
+ * Decompresses a whole message, or a fragment of one, which gets null
+ * terminated outside of its length.
+ *
+ * Returns: the data, or %NULL if invalid or too long
+ */
+GByteArray *
+_web_socket_deflate_inflate (WebSocketDeflate *self,
+                             const guint8 *data,
+                             gsize len,
+                             gboolean fin,
+                             gsize max_len,
+                             gboolean *too_big)
+{
+  GByteArray *out = g_byte_array_sized_new (MIN (len * 4, CHUNK_SIZE));
+
+  *too_big = FALSE;
+  if (!inflate_data (&self->inflater, data, len, max_len, out, too_big) ||
+      (fin && !inflate_data (&self->inflater, sync_tail, sizeof (sync_tail), max_len, out, too_big)))
+    {
+      g_byte_array_unref (out);
+      return NULL;
+    }
+
+  g_byte_array_append (out, (guchar *)"\0", 1);
+  out->len--;
+  return out;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2021 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Masking of WebSocket payloads, as per RFC 6455 section 5.3. Every frame
+ * from a browser is masked, so this is on the path of each byte that gets
+ * uploaded. There are implementations that work on 64-bit words, and with
+ * SSE2 or AVX2, and the best one that the CPU supports gets picked on
+ * first use.
+ *
+ * All of them work front to back, and read each block of input before
+ * writing it out, so @dest may also be a bit before @src in the same
+ * buffer, not just the same as it.
+ */
+
+#include "config.h"
+
+#include "websocketprivate.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static void
+mask_bytes (const guint8 *key,
+            guint8 *dest,
+            const guint8 *src,
+            gsize from,
+            gsize to)
+{
+  for (gsize n = from; n < to; n++)
+    dest[n] = src[n] ^ key[n & 3];
+}
+
+/*
+ * Masks the bytes up to where @dest is aligned to @align, and fills
+ * @pattern with @align bytes of the key as it goes on from there.
+ * Returns: how many bytes were masked
+ */
+static gsize
+mask_head (const guint8 *key,
+           guint8 *dest,
+           const guint8 *src,
+           gsize len,
+           gsize align,
+           guint8 *pattern)
+{
+  gsize head = (align - ((guintptr)dest & (align - 1))) & (align - 1);
+
+  head = MIN (head, len);
+  mask_bytes (key, dest, src, 0, head);
+
+  for (gsize i = 0; i < align; i++)
+    pattern[i] = key[(head + i) & 3];
+
+  return head;
+}
+
+static void
+mask_scalar (const guint8 *key,
+             guint8 *dest,
+             const guint8 *src,
+             gsize len)
+{
+  mask_bytes (key, dest, src, 0, len);
+}
+
+static void
+mask_word (const guint8 *key,
+           guint8 *dest,
+           const guint8 *src,
+           gsize len)
+{
+  guint8 pattern[8];
+  guint64 k, v;
+  gsize n;
+
+  n = mask_head (key, dest, src, len, sizeof (k), pattern);
+  memcpy (&k, pattern, sizeof (k));
+
+  for (; n + sizeof (v) <= len; n += sizeof (v))
+    {
+      memcpy (&v, src + n, sizeof (v));
+      v ^= k;
+      memcpy (dest + n, &v, sizeof (v));
+    }
+
+  mask_bytes (key, dest, src, n, len);
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target ("sse2")))
+static void
+mask_sse2 (const guint8 *key,
+           guint8 *dest,
+           const guint8 *src,
+           gsize len)
+{
+  guint8 pattern[16];
+  __m128i k, v;
+  gsize n;
+
+  n = mask_head (key, dest, src, len, sizeof (k), pattern);
+  k = _mm_loadu_si128 ((const __m128i *)pattern);
+
+  for (; n + sizeof (v) <= len; n += sizeof (v))
+    {
+      v = _mm_loadu_si128 ((const __m128i *)(src + n));
+      _mm_store_si128 ((__m128i *)(dest + n), _mm_xor_si128 (v, k));
+    }
+
+  mask_bytes (key, dest, src, n, len);
+}
+
+__attribute__((target ("avx2")))
+static void
+mask_avx2 (const guint8 *key,
+           guint8 *dest,
+           const guint8 *src,
+           gsize len)
+{
+  guint8 pattern[32];
+  __m256i k, v;
+  gsize n;
+
+  n = mask_head (key, dest, src, len, sizeof (k), pattern);
+  k = _mm256_loadu_si256 ((const __m256i *)pattern);
+
+  for (; n + sizeof (v) <= len; n += sizeof (v))
+    {
+      v = _mm256_loadu_si256 ((const __m256i *)(src + n));
+      _mm256_store_si256 ((__m256i *)(dest + n), _mm256_xor_si256 (v, k));
+    }
+
+  mask_bytes (key, dest, src, n, len);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/**
+ * _web_socket_mask_lookup:
+ * @implementation: (allow-none): "scalar", "word", "sse2" or "avx2"
+ *
+ * Get a specific masking implementation, mostly for testing and
+ * benchmarks, or the best one for this CPU if @implementation is %NULL.
+ *
+ * Returns: the function, or %NULL if not supported here
+ */
+WebSocketMaskFunc
+_web_socket_mask_lookup (const gchar *implementation)
+{
+  if (implementation == NULL)
+    {
+#ifdef HAVE_X86_SIMD
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        return mask_avx2;
+      if (__builtin_cpu_supports ("sse2"))
+        return mask_sse2;
+#endif
+      return mask_word;
+    }
+
+  if (g_str_equal (implementation, "scalar"))
+    return mask_scalar;
+  if (g_str_equal (implementation, "word"))
+    return mask_word;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (g_str_equal (implementation, "sse2") && __builtin_cpu_supports ("sse2"))
+    return mask_sse2;
+  if (g_str_equal (implementation, "avx2") && __builtin_cpu_supports ("avx2"))
+    return mask_avx2;
+#endif
+
+  return NULL;
+}
+
+/**
+ * _web_socket_mask:
+ * @key: the 4 byte masking key
+ * @dest: where to put the result, either @src or before it
+ * @src: the data to mask or unmask
+ * @len: the length of @src
+ *
+ * XOR the data with the masking key, starting at its first byte.
+ */
+void
+_web_socket_mask (const guint8 *key,
+                  guint8 *dest,
+                  const guint8 *src,
+                  gsize len)
+{
+  static gsize func = 0;
+
+  if (g_once_init_enter (&func))
+    g_once_init_leave (&func, (gsize)_web_socket_mask_lookup (NULL));
+
+  ((WebSocketMaskFunc)func) (key, dest, src, len);
+}
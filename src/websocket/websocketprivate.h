@@ -72,8 +72,52 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+const gchar *    _web_socket_connection_offer_extensions  (WebSocketConnection *self);
+
+gchar *          _web_socket_connection_choose_extensions (WebSocketConnection *self,
+                                                           const gchar *value);
+
+gboolean         _web_socket_connection_accept_extensions (WebSocketConnection *self,
+                                                           const gchar *value);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
+typedef struct _WebSocketDeflate WebSocketDeflate;
+
+WebSocketDeflate * _web_socket_deflate_new_for_offer      (const gchar *offer,
+                                                           gchar **response);
+
+const gchar *    _web_socket_deflate_offer                (void);
+
+WebSocketDeflate * _web_socket_deflate_new_for_response   (const gchar *response);
+
+void             _web_socket_deflate_free                 (WebSocketDeflate *self);
+
+GByteArray *     _web_socket_deflate_compress             (WebSocketDeflate *self,
+                                                           const guint8 *prefix,
+                                                           gsize prefix_len,
+                                                           const guint8 *payload,
+                                                           gsize payload_len);
+
+GByteArray *     _web_socket_deflate_inflate              (WebSocketDeflate *self,
+                                                           const guint8 *data,
+                                                           gsize len,
+                                                           gboolean fin,
+                                                           gsize max_len,
+                                                           gboolean *too_big);
+
+typedef void     (* WebSocketMaskFunc)                    (const guint8 *key,
+                                                           guint8 *dest,
+                                                           const guint8 *src,
+                                                           gsize len);
+
+WebSocketMaskFunc _web_socket_mask_lookup                 (const gchar *implementation);
+
+void             _web_socket_mask                         (const guint8 *key,
+                                                           guint8 *dest,
+                                                           const guint8 *src,
+                                                           gsize len);
+
 G_END_DECLS
 
 #endif /* __WEB_SOCKET_PRIVATE_H__ */
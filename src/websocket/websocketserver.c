@@ -144,6 +144,7 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   const gchar *protocol;
   const gchar *origin;
   const gchar *host;
+  gchar *extensions;
   gchar *accept_key;
   gchar *key;
   GString *handshake;
@@ -221,6 +222,11 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = _web_socket_connection_choose_extensions (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"));
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+  g_free (extensions);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
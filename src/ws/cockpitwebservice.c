@@ -57,12 +57,36 @@ typedef struct {
   JsonObject *init_received;
 } CockpitSocket;
 
+/*
+ * How big a share of a busy web socket a channel gets, see
+ * web_socket_connection_send_tagged(). Channels that someone is
+ * waiting on get a bigger one than bulk transfers.
+ */
+#define CHANNEL_WEIGHT_INTERACTIVE   8
+#define CHANNEL_WEIGHT_BULK          1
+
+/* How the messages of a channel get routed, owned by its socket */
+typedef struct {
+  CockpitSocket *socket;
+  WebSocketDataType data_type;
+  guint weight;
+  GBytes *prefix; /* The channel id and a newline */
+} CockpitSocketChannel;
+
 typedef struct {
   GHashTable *by_channel;
   GHashTable *by_connection;
   guint next_socket_id;
 } CockpitSockets;
 
+static void
+cockpit_socket_channel_free (gpointer data)
+{
+  CockpitSocketChannel *info = data;
+  g_bytes_unref (info->prefix);
+  g_free (info);
+}
+
 static void
 cockpit_socket_free (gpointer data)
 {
@@ -94,7 +118,7 @@ cockpit_socket_lookup_by_connection (CockpitSockets *sockets,
   return g_hash_table_lookup (sockets->by_connection, connection);
 }
 
-inline static CockpitSocket *
+inline static CockpitSocketChannel *
 cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
                                   const gchar *channel)
 {
@@ -115,13 +139,23 @@ static void
 cockpit_socket_add_channel (CockpitSockets *sockets,
                             CockpitSocket *socket,
                             const gchar *channel,
-                            WebSocketDataType data_type)
+                            WebSocketDataType data_type,
+                            guint weight)
 {
+  CockpitSocketChannel *info;
+  gchar *prefix;
   gchar *chan;
 
+  info = g_new0 (CockpitSocketChannel, 1);
+  info->socket = socket;
+  info->data_type = data_type;
+  info->weight = weight;
+  prefix = g_strdup_printf ("%s\n", channel);
+  info->prefix = g_bytes_new_take (prefix, strlen (prefix));
+
   chan = g_strdup (channel);
-  g_hash_table_insert (sockets->by_channel, chan, socket);
-  g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
+  g_hash_table_replace (sockets->by_channel, chan, info);
+  g_hash_table_replace (socket->channels, chan, info);
 
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
@@ -135,7 +169,7 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cockpit_socket_channel_free);
 
   g_debug ("%s new socket", socket->id);
 
@@ -684,6 +718,8 @@ on_transport_control (CockpitTransport *transport,
   const gchar *problem = "protocol-error";
   CockpitWebService *self = user_data;
   CockpitSocket *socket = NULL;
+  CockpitSocketChannel *info;
+  guint weight = CHANNEL_WEIGHT_BULK;
   gboolean valid = FALSE;
   gboolean forward;
 
@@ -716,7 +752,13 @@ on_transport_control (CockpitTransport *transport,
     }
   else
     {
-      socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
+      /* Before a close forgets about the channel */
+      info = cockpit_socket_lookup_by_channel (&self->sockets, channel);
+      if (info)
+        {
+          socket = info->socket;
+          weight = info->weight;
+        }
 
       /* Usually all control messages with a channel are forwarded */
       forward = TRUE;
@@ -732,11 +774,11 @@ on_transport_control (CockpitTransport *transport,
 
       if (forward)
         {
-          /* Forward this message to the right websocket */
+          /* Forward this message to the right websocket, in order with the channel's data */
           if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
             {
-              web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix, payload);
+              web_socket_connection_send_tagged (socket->connection, WEB_SOCKET_DATA_TEXT,
+                                                 channel, weight, self->control_prefix, payload);
             }
         }
     }
@@ -756,23 +798,17 @@ on_transport_recv (CockpitTransport *transport,
                    gpointer user_data)
 {
   CockpitWebService *self = user_data;
-  WebSocketDataType data_type;
-  CockpitSocket *socket;
-  gchar *string;
-  GBytes *prefix;
+  CockpitSocketChannel *info;
 
   if (!channel)
     return FALSE;
 
-  /* Forward the message to the right socket */
-  socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-  if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+  /* Forward the message to the right socket, fairly among the channels */
+  info = cockpit_socket_lookup_by_channel (&self->sockets, channel);
+  if (info && web_socket_connection_get_ready_state (info->socket->connection) == WEB_SOCKET_STATE_OPEN)
     {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
-      data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
-      g_bytes_unref (prefix);
+      web_socket_connection_send_tagged (info->socket->connection, info->data_type,
+                                         channel, info->weight, info->prefix, payload);
       return TRUE;
     }
 
@@ -894,6 +930,29 @@ cockpit_web_service_parse_external (JsonObject *options,
   return TRUE;
 }
 
+static guint
+channel_weight (JsonObject *options)
+{
+  const gchar *payload;
+  gboolean pty;
+
+  if (!cockpit_json_get_string (options, "payload", NULL, &payload) ||
+      !cockpit_json_get_bool (options, "pty", FALSE, &pty))
+    return CHANNEL_WEIGHT_BULK;
+
+  /* A terminal, D-Bus calls and signals, file change notifications ... */
+  if ((g_strcmp0 (payload, "stream") == 0 && pty) ||
+      g_strcmp0 (payload, "dbus-json3") == 0 ||
+      g_strcmp0 (payload, "fswatch1") == 0 ||
+      g_strcmp0 (payload, "fsinfo") == 0 ||
+      g_strcmp0 (payload, "echo") == 0 ||
+      g_strcmp0 (payload, "null") == 0)
+    return CHANNEL_WEIGHT_INTERACTIVE;
+
+  /* ... rather than file transfers, http, metrics and the output of commands */
+  return CHANNEL_WEIGHT_BULK;
+}
+
 static gboolean
 process_and_relay_open (CockpitWebService *self,
                         CockpitSocket *socket,
@@ -925,7 +984,7 @@ process_and_relay_open (CockpitWebService *self,
     return FALSE;
 
   if (socket)
-    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type, channel_weight (options));
 
   if (!self->sent_done)
     {
@@ -1325,6 +1384,8 @@ cockpit_web_service_create_socket (const gchar **protocols,
                                                  cockpit_web_request_get_io_stream (request),
                                                  cockpit_web_request_get_headers (request),
                                                  cockpit_web_request_get_buffer (request));
+  g_object_set (connection, "permessage-deflate",
+                cockpit_conf_bool ("WebService", "WebSocketCompression", FALSE), NULL);
   g_free (allocated);
   g_free (url);
   g_free (origin);
@@ -195,6 +195,8 @@ main (int argc,
 
   if (opt_for_tls_proxy)
     server_flags |= COCKPIT_WEB_SERVER_FOR_TLS_PROXY;
+  if (cockpit_conf_bool ("WebService", "ProxyProtocol", FALSE))
+    server_flags |= COCKPIT_WEB_SERVER_PROXY_PROTOCOL;
   if (!cockpit_conf_bool ("WebService", "AllowUnencrypted", FALSE))
     {
       if (!opt_no_tls)